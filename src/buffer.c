@@ -0,0 +1,237 @@
+//
+//  buffer.c
+//  jedisocks
+//
+//  Reference counted receive slabs and outbound frame queues shared by
+//  js-local and js-server.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "buffer.h"
+
+slab_t* slab_new(size_t size)
+{
+    slab_t* slab = malloc(sizeof(slab_t) + size);
+    if (slab == NULL)
+        FATAL("Not enough memory");
+    slab->ref = 1;
+    slab->size = size;
+    slab->rpos = 0;
+    slab->wpos = 0;
+    return slab;
+}
+
+slab_t* slab_ref(slab_t* slab)
+{
+    slab->ref++;
+    return slab;
+}
+
+void slab_unref(slab_t* slab)
+{
+    if (slab != NULL && --slab->ref == 0)
+        free(slab);
+}
+
+// make sure the slab owned by a reader has at least min_space bytes of tail
+// room. Only the trailing partial frame is ever moved: in place when nobody
+// else holds the slab, otherwise into a fresh slab so that payload slices
+// still referenced by pending writes stay valid.
+slab_t* slab_reserve(slab_t* slab, size_t size, size_t min_space)
+{
+    if (slab == NULL)
+        return slab_new(size);
+
+    size_t pending = slab->wpos - slab->rpos;
+    if (slab->ref == 1 && pending == 0) {
+        slab->rpos = slab->wpos = 0;
+        return slab;
+    }
+    if (slab->size - slab->wpos >= min_space)
+        return slab;
+
+    // a partial frame (or record) larger than a slab gets a slab of its own
+    if (pending + min_space > size)
+        size = pending + min_space;
+    if (slab->ref == 1 && slab->size >= size) {
+        memmove(slab->data, slab->data + slab->rpos, pending);
+        slab->rpos = 0;
+        slab->wpos = pending;
+        return slab;
+    }
+
+    slab_t* fresh = slab_new(size);
+    memcpy(fresh->data, slab->data + slab->rpos, pending);
+    fresh->wpos = pending;
+    slab_unref(slab);
+    return fresh;
+}
+
+void buf_pool_init(buf_pool_t* pool, size_t size, int max_idle)
+{
+    pool->size = size < sizeof(void*) ? sizeof(void*) : size;
+    pool->idle = 0;
+    pool->max_idle = max_idle;
+    pool->free_list = NULL;
+}
+
+char* buf_pool_get(buf_pool_t* pool)
+{
+    char* mem = pool->free_list;
+    if (mem != NULL) {
+        pool->free_list = *(void**)mem;
+        pool->idle--;
+        return mem;
+    }
+    mem = malloc(pool->size);
+    if (mem == NULL)
+        FATAL("Not enough memory");
+    return mem;
+}
+
+void buf_pool_put(buf_pool_t* pool, char* mem)
+{
+    if (pool->idle >= pool->max_idle) {
+        free(mem);
+        return;
+    }
+    *(void**)mem = pool->free_list;
+    pool->free_list = mem;
+    pool->idle++;
+}
+
+// larger classes keep fewer idle blocks, so every class pins about the
+// same amount of idle memory
+void read_pools_init(read_pools_t* rp, size_t headroom, int max_idle)
+{
+    rp->headroom = headroom;
+    for (int i = 0; i < READ_CLASSES; i++)
+        buf_pool_init(&rp->pools[i], headroom + read_class_size(i), max_idle >> i > 0 ? max_idle >> i : 1);
+}
+
+size_t read_class_size(int cls)
+{
+    size_t size = (size_t)READ_SIZE_MIN << cls;
+    return size > READ_SIZE_MAX ? READ_SIZE_MAX : size;
+}
+
+// a read that filled its buffer moves the stream up a class (as long as the
+// class still fits max_size), one that would have fit in half of the class
+// below moves it down
+int read_class_adapt(int cls, size_t nread, size_t max_size)
+{
+    if (nread >= read_class_size(cls)) {
+        if (cls + 1 < READ_CLASSES && read_class_size(cls + 1) <= max_size)
+            return cls + 1;
+        return cls;
+    }
+    if (cls > 0 && nread <= read_class_size(cls - 1) / 2)
+        return cls - 1;
+    return cls;
+}
+
+void read_alloc(read_pools_t* rp, int cls, uv_buf_t* buf)
+{
+    char* mem = buf_pool_get(&rp->pools[cls]);
+    *buf = uv_buf_init(mem + rp->headroom, (unsigned int)read_class_size(cls));
+}
+
+void read_release(read_pools_t* rp, int cls, const uv_buf_t* buf)
+{
+    if (buf->base != NULL && buf->len)
+        buf_pool_put(&rp->pools[cls], buf->base - rp->headroom);
+}
+
+void frame_queue_init(frame_queue_t* queue)
+{
+    list_init(queue);
+    queue->count = 0;
+}
+
+void frame_queue_push(frame_queue_t* queue, buf_pool_t* pool, char* mem, char* base, size_t len)
+{
+    frame_t* frame = malloc(sizeof(frame_t));
+    if (frame == NULL)
+        FATAL("Not enough memory");
+    frame->mem = mem;
+    frame->pool = pool;
+    frame->buf = uv_buf_init(base, (unsigned int)len);
+    list_add_to_tail(queue, frame);
+    queue->count++;
+}
+
+frame_t* frame_queue_pop(frame_queue_t* queue)
+{
+    frame_t* frame = list_get_head_elem(queue);
+    if (frame != NULL) {
+        list_remove_elem(frame);
+        queue->count--;
+    }
+    return frame;
+}
+
+void frame_queue_clear(frame_queue_t* queue)
+{
+    frame_t* frame = NULL;
+    while ((frame = list_get_head_elem(queue))) {
+        list_remove_elem(frame);
+        if (frame->pool != NULL)
+            buf_pool_put(frame->pool, frame->mem);
+        else
+            free(frame->mem);
+        free(frame);
+    }
+    queue->count = 0;
+}
+
+void batch_write_free(batch_write_req_t* wr)
+{
+    frame_queue_clear(&wr->frames);
+    free(wr);
+}
+
+batch_write_req_t* batch_write_new(void* data)
+{
+    batch_write_req_t* wr = malloc(sizeof(batch_write_req_t));
+    if (wr == NULL)
+        FATAL("Not enough memory");
+    wr->req.data = data;
+    frame_queue_init(&wr->frames);
+    return wr;
+}
+
+// write every frame of the batch with a single uv_write. Returns uv_write's
+// status, the request is already freed when it fails.
+int batch_write_submit(batch_write_req_t* wr, uv_stream_t* stream, crypto_t* crypto, uv_write_cb cb)
+{
+    uv_buf_t bufs[MAX_BATCH_FRAMES + 2];
+    int nbufs = 1; // bufs[0] is kept for the record header
+    frame_t* frame = list_get_start(&wr->frames);
+    while (!list_elem_is_end(&wr->frames, frame) && nbufs <= MAX_BATCH_FRAMES) {
+        bufs[nbufs++] = frame->buf;
+        frame = frame->next;
+    }
+
+    uv_buf_t* first = bufs + 1;
+    int count = nbufs - 1;
+    if (crypto) {
+        // the whole batch becomes one record, sealed in place in the frames
+        int hdr_len = crypto_seal(crypto, bufs + 1, nbufs - 1, wr->record_hdr, wr->record_tag);
+        if (hdr_len < 0) {
+            batch_write_free(wr);
+            return UV_EINVAL;
+        }
+        bufs[0] = uv_buf_init(wr->record_hdr, hdr_len);
+        bufs[nbufs++] = uv_buf_init(wr->record_tag, CRYPTO_TAG_LEN);
+        first = bufs;
+        count = nbufs;
+    }
+
+    // libuv copies the buf array, so the stack copy can go away after this
+    int r = uv_write(&wr->req, stream, first, count, cb);
+    if (r)
+        batch_write_free(wr);
+    return r;
+}
@@ -0,0 +1,95 @@
+//
+//  buffer.h
+//  jedisocks
+//
+//  Reference counted receive slabs and outbound frame queues shared by
+//  js-local and js-server.
+//
+
+#ifndef jedisocks_buffer_h
+#define jedisocks_buffer_h
+#include <stddef.h>
+#include <uv.h>
+#include "crypto.h"
+
+// A slab is filled by reads from the long connection; frames are parsed in
+// place and payload slices handed to writes keep the slab alive with a ref.
+typedef struct slab {
+    int ref;
+    size_t size;
+    size_t rpos; // start of the bytes not parsed yet
+    size_t wpos; // end of the bytes received
+    char data[];
+} slab_t;
+
+// fixed size blocks recycled through a free list threaded through the
+// blocks themselves, at most max_idle blocks are kept around
+typedef struct buf_pool {
+    size_t size;
+    int idle;
+    int max_idle;
+    void* free_list;
+} buf_pool_t;
+
+// a frame waiting to go out on a long connection, buf points somewhere into
+// mem which goes back to pool (or is freed when pool is NULL) once written
+typedef struct frame {
+    uv_buf_t buf;
+    char* mem;
+    buf_pool_t* pool;
+    struct frame* prev;
+    struct frame* next;
+} frame_t;
+
+typedef struct frame_queue {
+    frame_t head;
+    int count;
+} frame_queue_t;
+
+// one scatter-gather write carrying the frames picked by a flush
+typedef struct {
+    uv_write_t req;
+    frame_queue_t frames;
+    char record_hdr[CRYPTO_SALT_LEN + CRYPTO_HDR_LEN]; // when the connection is encrypted
+    char record_tag[CRYPTO_TAG_LEN];
+} batch_write_req_t;
+
+#define MAX_BATCH_FRAMES 1024
+
+// socket reads that become frames come in size classes doubling from
+// READ_SIZE_MIN, the last class is capped to what a 16-bit frame length
+// can carry
+#define READ_SIZE_MIN 2048
+#define READ_SIZE_MAX 65535
+#define READ_CLASSES 6
+
+// one pool per read size class, blocks keep headroom bytes in front of the
+// read for the frame header
+typedef struct read_pools {
+    buf_pool_t pools[READ_CLASSES];
+    size_t headroom;
+} read_pools_t;
+
+extern slab_t* slab_new(size_t size);
+extern slab_t* slab_ref(slab_t* slab);
+extern void slab_unref(slab_t* slab);
+extern slab_t* slab_reserve(slab_t* slab, size_t size, size_t min_space);
+
+extern void buf_pool_init(buf_pool_t* pool, size_t size, int max_idle);
+extern char* buf_pool_get(buf_pool_t* pool);
+extern void buf_pool_put(buf_pool_t* pool, char* mem);
+
+extern void read_pools_init(read_pools_t* rp, size_t headroom, int max_idle);
+extern size_t read_class_size(int cls);
+extern int read_class_adapt(int cls, size_t nread, size_t max_size);
+extern void read_alloc(read_pools_t* rp, int cls, uv_buf_t* buf);
+extern void read_release(read_pools_t* rp, int cls, const uv_buf_t* buf);
+
+extern void frame_queue_init(frame_queue_t* queue);
+extern void frame_queue_push(frame_queue_t* queue, buf_pool_t* pool, char* mem, char* base, size_t len);
+extern frame_t* frame_queue_pop(frame_queue_t* queue);
+extern void frame_queue_clear(frame_queue_t* queue);
+extern batch_write_req_t* batch_write_new(void* data);
+extern int batch_write_submit(batch_write_req_t* wr, uv_stream_t* stream, crypto_t* crypto, uv_write_cb cb);
+extern void batch_write_free(batch_write_req_t* wr);
+#endif
@@ -0,0 +1,282 @@
+//
+//  connpool.c
+//  jedisocks
+//
+//  js-server's pool of idle connections to hot destinations. A destination
+//  (address and port) is hot when CONNPOOL_HOT_MIN sessions connected to it
+//  within CONNPOOL_HOT_WINDOW, or when it is pinned like the backend
+//  gateway; the pool keeps conf.conn_pool_size connections open to each hot
+//  one for sessions to take instead of connecting, and closes those idle
+//  for longer than conf.conn_pool_idle.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <uv.h>
+#include "utils.h"
+#include "connpool.h"
+
+connpool_stats_t connpool_stats;
+
+static uv_loop_t* pool_loop;
+static uv_timer_t pool_timer;
+static int pool_size; // connections kept per hot destination, 0 = no pool
+static int pool_idle; // ms a connection waits before it is replaced
+static int pool_dests;
+static uint64_t pool_window; // uv_now() the current hot window started
+static connpool_stats_t pool_logged; // as of the last window
+
+static inline int connpool_cmp(const connpool_dest_t* a, const connpool_dest_t* b)
+{
+    if (a->addr.family != b->addr.family)
+        return a->addr.family < b->addr.family ? -1 : 1;
+    int r = memcmp(a->addr.addr, b->addr.addr, a->addr.family == AF_INET ? 4 : 16);
+    if (r)
+        return r;
+    return memcmp(a->port, b->port, 2);
+}
+
+RB_HEAD(connpool_tree, connpool_dest) pool_dests_tree = RB_INITIALIZER(&pool_dests_tree);
+RB_PROTOTYPE(connpool_tree, connpool_dest, rb_link, connpool_cmp);
+RB_GENERATE(connpool_tree, connpool_dest, rb_link, connpool_cmp);
+
+static connpool_dest_t* connpool_find(const dns_addr_t* addr, const char* port)
+{
+    connpool_dest_t find;
+    find.addr = *addr;
+    memcpy(find.port, port, 2);
+    return RB_FIND(connpool_tree, &pool_dests_tree, &find);
+}
+
+static void connpool_close_cb(uv_handle_t* handle)
+{
+    free(handle->data);
+}
+
+// the connection leaves its destination and is closed
+static void connpool_drop(connpool_conn_t* conn)
+{
+    connpool_dest_t* dest = conn->dest;
+    if (conn->connected)
+        dest->idle--;
+    else
+        dest->connecting--;
+    list_remove_elem(conn);
+    conn->dest = NULL;
+    uv_close((uv_handle_t*)&conn->handle, connpool_close_cb);
+}
+
+// nothing is read on an idle connection but EOF, anything else would be
+// lost on the session that takes it
+static void connpool_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    static char scratch[64];
+    *buf = uv_buf_init(scratch, sizeof(scratch));
+}
+
+static void connpool_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    connpool_conn_t* conn = (connpool_conn_t*)stream->data;
+    if (nread == 0)
+        return;
+    if (nread < 0)
+        conn->dest->retry = uv_now(pool_loop) + CONNPOOL_RETRY_DELAY;
+    else if (!conn->dest->unpoolable) {
+        char name[INET6_ADDRSTRLEN];
+        uv_inet_ntop(conn->dest->addr.family, conn->dest->addr.addr, name, sizeof(name));
+        LOGW("connpool: %s port %d talks first, not pooled", name, ntohs(*(uint16_t*)conn->dest->port));
+        conn->dest->unpoolable = 1;
+    }
+    connpool_stats.dropped++;
+    connpool_drop(conn);
+}
+
+static void connpool_connect_cb(uv_connect_t* req, int status)
+{
+    connpool_conn_t* conn = (connpool_conn_t*)req->data;
+    connpool_dest_t* dest = conn->dest;
+    if (dest == NULL)
+        return; // closed by connpool_drop()
+    if (status) {
+        LOGD("connpool: connect failed: %s", uv_strerror(status));
+        dest->retry = uv_now(pool_loop) + CONNPOOL_RETRY_DELAY;
+        connpool_drop(conn);
+        return;
+    }
+    dest->connecting--;
+    dest->idle++;
+    conn->connected = 1;
+    conn->since = uv_now(pool_loop);
+    connpool_stats.opened++;
+    uv_read_start((uv_stream_t*)&conn->handle, connpool_alloc_cb, connpool_read_cb);
+}
+
+// opens connections until the destination has pool_size, counting those
+// still connecting
+static void connpool_fill(connpool_dest_t* dest)
+{
+    if (!dest->hot || dest->unpoolable || uv_now(pool_loop) < dest->retry)
+        return;
+    while (dest->idle + dest->connecting < pool_size) {
+        connpool_conn_t* conn = calloc(1, sizeof(connpool_conn_t));
+        conn->dest = dest;
+        conn->handle.data = conn;
+        conn->req.data = conn;
+        uv_tcp_init(pool_loop, &conn->handle);
+        uv_tcp_nodelay(&conn->handle, 1);
+        struct sockaddr_storage addr;
+        resolver_sockaddr(&dest->addr, dest->port, &addr);
+        int r = uv_tcp_connect(&conn->req, &conn->handle, (struct sockaddr*)&addr, connpool_connect_cb);
+        if (r) {
+            LOGD("connpool: connect failed: %s", uv_strerror(r));
+            dest->retry = uv_now(pool_loop) + CONNPOOL_RETRY_DELAY;
+            uv_close((uv_handle_t*)&conn->handle, connpool_close_cb);
+            return;
+        }
+        dest->connecting++;
+        list_add_to_tail(&dest->conns, conn);
+    }
+}
+
+static connpool_dest_t* connpool_add(const dns_addr_t* addr, const char* port)
+{
+    connpool_dest_t* dest = calloc(1, sizeof(connpool_dest_t));
+    dest->addr = *addr;
+    memcpy(dest->port, port, 2);
+    list_init(&dest->conns);
+    RB_INSERT(connpool_tree, &pool_dests_tree, dest);
+    pool_dests++;
+    return dest;
+}
+
+static void connpool_remove(connpool_dest_t* dest)
+{
+    RB_REMOVE(connpool_tree, &pool_dests_tree, dest);
+    pool_dests--;
+    free(dest);
+}
+
+// a cold destination without connections, if there is one
+static int connpool_evict(void)
+{
+    connpool_dest_t* dest;
+    RB_FOREACH(dest, connpool_tree, &pool_dests_tree) {
+        if (!dest->hot && dest->idle == 0 && dest->connecting == 0) {
+            connpool_remove(dest);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// idle connections are replaced once they are pool_idle old, destinations
+// are reconsidered at the end of each hot window
+static void connpool_tick_cb(uv_timer_t* handle)
+{
+    uint64_t now = uv_now(pool_loop);
+    int window = now - pool_window >= CONNPOOL_HOT_WINDOW;
+    connpool_dest_t* dest;
+    connpool_dest_t* next;
+    for (dest = RB_MIN(connpool_tree, &pool_dests_tree); dest != NULL; dest = next) {
+        next = RB_NEXT(connpool_tree, &pool_dests_tree, dest);
+        connpool_conn_t* conn = list_get_start(&dest->conns);
+        while (!list_elem_is_end(&dest->conns, conn)) {
+            connpool_conn_t* after = conn->next;
+            if (conn->connected && now - conn->since >= (uint64_t)pool_idle) {
+                connpool_stats.expired++;
+                connpool_drop(conn);
+            }
+            conn = after;
+        }
+        if (window) {
+            dest->hot = dest->pinned || dest->recent >= CONNPOOL_HOT_MIN;
+            dest->recent = 0;
+            if (!dest->hot && dest->idle == 0 && dest->connecting == 0) {
+                connpool_remove(dest);
+                continue;
+            }
+        }
+        connpool_fill(dest);
+    }
+    if (!window)
+        return;
+    pool_window = now;
+    if (connpool_stats.opened != pool_logged.opened || connpool_stats.taken != pool_logged.taken)
+        LOGI("connpool: %d destinations, %llu sessions took a pooled connection, %llu opened, %llu expired, %llu dropped",
+            pool_dests, (unsigned long long)(connpool_stats.taken - pool_logged.taken),
+            (unsigned long long)(connpool_stats.opened - pool_logged.opened),
+            (unsigned long long)(connpool_stats.expired - pool_logged.expired),
+            (unsigned long long)(connpool_stats.dropped - pool_logged.dropped));
+    pool_logged = connpool_stats;
+}
+
+void connpool_init(uv_loop_t* loop, int size, int idle)
+{
+    pool_loop = loop;
+    pool_size = size;
+    pool_idle = idle;
+    if (size == 0)
+        return;
+    pool_window = uv_now(loop);
+    uv_timer_init(loop, &pool_timer);
+    uv_timer_start(&pool_timer, connpool_tick_cb, CONNPOOL_TICK, CONNPOOL_TICK);
+    uv_unref((uv_handle_t*)&pool_timer);
+}
+
+// the destination is kept warm from now on, whether sessions use it or not
+void connpool_pin(const dns_addr_t* addr, const char* port)
+{
+    if (pool_size == 0)
+        return;
+    connpool_dest_t* dest = connpool_find(addr, port);
+    if (dest == NULL)
+        dest = connpool_add(addr, port);
+    dest->pinned = 1;
+    dest->hot = 1;
+    connpool_fill(dest);
+}
+
+// a session connected to the destination, which may make it hot
+void connpool_used(const dns_addr_t* addr, const char* port)
+{
+    if (pool_size == 0)
+        return;
+    connpool_dest_t* dest = connpool_find(addr, port);
+    if (dest == NULL) {
+        if (pool_dests >= CONNPOOL_MAX_DESTS && !connpool_evict())
+            return;
+        dest = connpool_add(addr, port);
+    }
+    dest->recent++;
+    if (!dest->hot && dest->recent >= CONNPOOL_HOT_MIN) {
+        dest->hot = 1;
+        connpool_fill(dest);
+    }
+}
+
+// hands the most recently connected idle connection to the destination
+// over to handle, which must be initialized and not open yet, and opens
+// another one. Returns 0, or UV_ENOENT when there is none
+int connpool_take(const dns_addr_t* addr, const char* port, uv_tcp_t* handle)
+{
+    connpool_dest_t* dest = pool_size ? connpool_find(addr, port) : NULL;
+    if (dest == NULL || dest->idle == 0)
+        return UV_ENOENT;
+    connpool_conn_t* conn = list_get_tail_elem(&dest->conns);
+    while (!conn->connected)
+        conn = conn->prev;
+
+    uv_os_fd_t fd = -1;
+    if (uv_fileno((uv_handle_t*)&conn->handle, &fd) == 0)
+        fd = dup(fd);
+    int r = fd < 0 ? UV_EBADF : uv_tcp_open(handle, fd);
+    if (r && fd >= 0)
+        close(fd);
+    connpool_drop(conn);
+    connpool_fill(dest);
+    if (r)
+        return r;
+    connpool_stats.taken++;
+    return 0;
+}
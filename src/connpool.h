@@ -0,0 +1,68 @@
+//
+//  connpool.h
+//  jedisocks
+//
+//  js-server's pool of idle connections to hot destinations. A destination
+//  (address and port) is hot when CONNPOOL_HOT_MIN sessions connected to it
+//  within CONNPOOL_HOT_WINDOW, or when it is pinned like the backend
+//  gateway; the pool keeps conf.conn_pool_size connections open to each hot
+//  one for sessions to take instead of connecting, and closes those idle
+//  for longer than conf.conn_pool_idle.
+//
+
+#ifndef jedisocks_connpool_h
+#define jedisocks_connpool_h
+#include <stdint.h>
+#include <uv.h>
+#include "tree.h"
+#include "resolver.h"
+
+#define CONNPOOL_IDLE_DEFAULT 20000
+#define CONNPOOL_TICK 1000 // idle connections expire and pools refill
+#define CONNPOOL_HOT_WINDOW 10000
+#define CONNPOOL_HOT_MIN 3
+#define CONNPOOL_MAX_DESTS 64 // destinations tracked, cold ones make room
+#define CONNPOOL_RETRY_DELAY 5000 // after a pool connection failed to connect
+
+typedef struct connpool_conn {
+    uv_tcp_t handle;
+    uv_connect_t req;
+    struct connpool_dest* dest; // NULL once it is being closed
+    int connected;
+    uint64_t since; // uv_now() it connected
+    struct connpool_conn* prev;
+    struct connpool_conn* next;
+} connpool_conn_t;
+
+typedef struct connpool_list {
+    connpool_conn_t head;
+} connpool_list_t;
+
+typedef struct connpool_dest {
+    RB_ENTRY(connpool_dest) rb_link;
+    dns_addr_t addr;
+    char port[2]; // network order
+    int pinned; // always hot
+    int hot;
+    uint32_t recent; // sessions connected in this window
+    int idle; // connected and waiting in conns
+    int connecting; // ... and those still connecting
+    int unpoolable; // it talks before being talked to, its pool is dropped
+    uint64_t retry; // uv_now() before which nothing is connected
+    connpool_list_t conns; // oldest first
+} connpool_dest_t;
+
+typedef struct connpool_stats {
+    uint64_t taken; // sessions that took a pool connection
+    uint64_t opened; // pool connections that connected
+    uint64_t expired; // ... closed idle
+    uint64_t dropped; // ... closed by the destination or unsolicited data
+} connpool_stats_t;
+
+extern connpool_stats_t connpool_stats;
+
+extern void connpool_init(uv_loop_t* loop, int size, int idle);
+extern void connpool_pin(const dns_addr_t* addr, const char* port);
+extern void connpool_used(const dns_addr_t* addr, const char* port);
+extern int connpool_take(const dns_addr_t* addr, const char* port, uv_tcp_t* handle);
+#endif
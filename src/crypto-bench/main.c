@@ -0,0 +1,197 @@
+//
+//  main.c
+//  crypto-bench
+//
+//  Pushes the same frame mix through a loopback TCP connection in the clear
+//  and sealed with each method, the way a long connection writes and reads
+//  it, and reports the throughput of each.
+//
+//  crypto-bench [megabytes]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "../utils.h"
+#include "../flowsched.h"
+#include "../crypto.h"
+
+#define DATA_FRAME (16 * 1024)
+#define CONTROL_FRAME 7 // the size of a window update
+#define CONTROL_EVERY 8 // one control frame per this many data frames
+#define RECV_SLAB (256 * 1024)
+#define MIN_READ_SPACE (16 * 1024)
+
+FILE* logfile = NULL;
+
+typedef struct bench {
+    uv_loop_t* loop;
+    uv_tcp_t listener;
+    uv_tcp_t client;
+    uv_tcp_t peer;
+    uv_connect_t connect_req;
+    scheduler_t sched;
+    buf_pool_t pool;
+    crypto_t* tx;
+    crypto_t* rx;
+    slab_t* slab;
+    size_t total; // payload bytes to move
+    size_t queued;
+    size_t received;
+    size_t wire_bytes;
+    int frames;
+    uint64_t start;
+    uint64_t end;
+} bench_t;
+
+static void bench_write_cb(uv_write_t* req, int status);
+
+static void bench_fill(bench_t* b)
+{
+    while (b->sched.count < MAX_BATCH_FRAMES && b->queued < b->total
+        && b->sched.count * DATA_FRAME < SCHED_FLUSH_BUDGET) {
+        size_t len = b->frames++ % (CONTROL_EVERY + 1) == CONTROL_EVERY ? CONTROL_FRAME : DATA_FRAME;
+        if (len > b->total - b->queued)
+            len = b->total - b->queued;
+        char* mem = buf_pool_get(&b->pool);
+        memset(mem, b->frames & 0xff, len);
+        sched_push(&b->sched, NULL, &b->pool, mem, mem, len);
+        b->queued += len;
+    }
+}
+
+static void bench_write(bench_t* b)
+{
+    bench_fill(b);
+    if (b->sched.count == 0)
+        return;
+    if (sched_write(&b->sched, (uv_stream_t*)&b->client, b->tx, b, bench_write_cb))
+        FATAL("write failed");
+}
+
+static void bench_write_cb(uv_write_t* req, int status)
+{
+    batch_write_req_t* wr = (batch_write_req_t*)req;
+    bench_t* b = (bench_t*)wr->req.data;
+    batch_write_free(wr);
+    if (status)
+        FATAL("write failed");
+    bench_write(b);
+}
+
+static void bench_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    bench_t* b = (bench_t*)handle->data;
+    size_t min_space = MIN_READ_SPACE;
+    if (b->rx && b->slab) {
+        size_t pending = b->slab->wpos - b->slab->rpos;
+        size_t need = crypto_need(b->rx);
+        if (need > pending + min_space)
+            min_space = need - pending;
+    }
+    b->slab = slab_reserve(b->slab, RECV_SLAB, min_space);
+    *buf = uv_buf_init(b->slab->data + b->slab->wpos, b->slab->size - b->slab->wpos);
+}
+
+static void bench_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    bench_t* b = (bench_t*)stream->data;
+    if (nread <= 0) {
+        if (nread < 0)
+            FATAL("read failed");
+        return;
+    }
+    b->wire_bytes += nread;
+    b->slab->wpos += nread;
+    if (b->rx == NULL) {
+        b->received += nread;
+        b->slab->rpos = b->slab->wpos;
+    }
+    while (b->rx && b->slab->wpos > b->slab->rpos) {
+        char* plain = NULL;
+        size_t plain_len = 0;
+        int n = crypto_open(b->rx, b->slab->data + b->slab->rpos, b->slab->wpos - b->slab->rpos, &plain, &plain_len);
+        if (n < 0)
+            FATAL("record does not authenticate");
+        if (n == 0)
+            break;
+        b->slab->rpos += n;
+        b->received += plain_len;
+    }
+    if (b->received >= b->total) {
+        b->end = uv_hrtime();
+        uv_read_stop(stream);
+        uv_close((uv_handle_t*)&b->peer, NULL);
+        uv_close((uv_handle_t*)&b->client, NULL);
+        uv_close((uv_handle_t*)&b->listener, NULL);
+    }
+}
+
+static void bench_accept_cb(uv_stream_t* server, int status)
+{
+    bench_t* b = (bench_t*)server->data;
+    if (status)
+        FATAL("accept failed");
+    uv_tcp_init(b->loop, &b->peer);
+    b->peer.data = b;
+    if (uv_accept(server, (uv_stream_t*)&b->peer))
+        FATAL("accept failed");
+    uv_read_start((uv_stream_t*)&b->peer, bench_alloc_cb, bench_read_cb);
+}
+
+static void bench_connect_cb(uv_connect_t* req, int status)
+{
+    bench_t* b = (bench_t*)req->data;
+    if (status)
+        FATAL("connect failed");
+    b->start = uv_hrtime();
+    bench_write(b);
+}
+
+static void bench_run(const char* method, size_t total)
+{
+    bench_t b;
+    struct sockaddr_in addr;
+    int namelen = sizeof(addr);
+    memset(&b, 0, sizeof(b));
+    b.loop = uv_default_loop();
+    b.total = total;
+    sched_init(&b.sched);
+    buf_pool_init(&b.pool, DATA_FRAME, MAX_BATCH_FRAMES);
+    if (method) {
+        if (crypto_setup(method, "crypto-bench"))
+            FATAL("unknown method");
+        b.tx = crypto_new();
+        b.rx = crypto_new();
+    }
+
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_tcp_init(b.loop, &b.listener);
+    uv_tcp_init(b.loop, &b.client);
+    b.listener.data = b.client.data = b.connect_req.data = &b;
+    uv_tcp_bind(&b.listener, (struct sockaddr*)&addr, 0);
+    uv_listen((uv_stream_t*)&b.listener, 1, bench_accept_cb);
+    uv_tcp_getsockname(&b.listener, (struct sockaddr*)&addr, &namelen);
+    uv_tcp_connect(&b.connect_req, &b.client, (struct sockaddr*)&addr, bench_connect_cb);
+    uv_run(b.loop, UV_RUN_DEFAULT);
+
+    double secs = (b.end - b.start) / 1e9;
+    printf("%-24s %8.1f MB/s  %5.2f%% record overhead\n", method ? method : "clear",
+        b.received / secs / (1024 * 1024), 100.0 * (b.wire_bytes - b.received) / b.received);
+    sched_clear(&b.sched);
+    slab_unref(b.slab);
+    crypto_free(b.tx);
+    crypto_free(b.rx);
+}
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? (size_t)atoi(argv[1]) : 1024;
+    size_t total = megabytes * 1024 * 1024;
+    printf("%zu MB in %d byte frames, a %d byte frame every %d\n", megabytes, DATA_FRAME, CONTROL_FRAME, CONTROL_EVERY + 1);
+    bench_run(NULL, total);
+    bench_run("chacha20-ietf-poly1305", total);
+    bench_run("aes-256-gcm", total);
+    return 0;
+}
@@ -0,0 +1,192 @@
+//
+//  crypto.c
+//  jedisocks
+//
+//  Encrypted transport for the long connection, one AEAD record per flush.
+//
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include "utils.h"
+#include "crypto.h"
+
+static const EVP_CIPHER* cipher = NULL;
+static unsigned char master_key[CRYPTO_KEY_LEN];
+
+static const char* kdf_salt = "jedisocks";
+static const char* subkey_info = "jedisocks-subkey";
+#define KDF_ITERATIONS 10000
+
+// "chacha20-ietf-poly1305" or "aes-256-gcm" (AES-NI is picked up by
+// OpenSSL where the CPU has it). Returns -1 for an unknown method
+int crypto_setup(const char* method, const char* password)
+{
+    if (strcmp(method, "chacha20-ietf-poly1305") == 0)
+        cipher = EVP_chacha20_poly1305();
+    else if (strcmp(method, "aes-256-gcm") == 0)
+        cipher = EVP_aes_256_gcm();
+    else
+        return -1;
+    if (!PKCS5_PBKDF2_HMAC(password, (int)strlen(password), (const unsigned char*)kdf_salt, (int)strlen(kdf_salt),
+            KDF_ITERATIONS, EVP_sha256(), CRYPTO_KEY_LEN, master_key))
+        return -1;
+    return 0;
+}
+
+int crypto_enabled(void)
+{
+    return cipher != NULL;
+}
+
+// HKDF-SHA256 of the master key with the connection's salt
+static void crypto_dir_init(crypto_dir_t* dir, const unsigned char* salt)
+{
+    unsigned char prk[EVP_MAX_MD_SIZE];
+    unsigned char info[64];
+    unsigned int len = 0;
+    size_t info_len = strlen(subkey_info);
+    HMAC(EVP_sha256(), salt, CRYPTO_SALT_LEN, master_key, CRYPTO_KEY_LEN, prk, &len);
+    memcpy(info, subkey_info, info_len);
+    info[info_len++] = 0x01;
+    HMAC(EVP_sha256(), prk, len, info, info_len, dir->key, &len);
+    memset(dir->nonce, 0, CRYPTO_NONCE_LEN);
+    dir->ctx = EVP_CIPHER_CTX_new();
+    if (dir->ctx == NULL)
+        FATAL("Not enough memory");
+    dir->ready = 1;
+}
+
+static void nonce_increment(unsigned char* nonce)
+{
+    for (int i = 0; i < CRYPTO_NONCE_LEN; i++)
+        if (++nonce[i] != 0)
+            break;
+}
+
+crypto_t* crypto_new(void)
+{
+    crypto_t* c = calloc(1, sizeof(crypto_t));
+    if (c == NULL)
+        FATAL("Not enough memory");
+    if (RAND_bytes(c->tx_salt, CRYPTO_SALT_LEN) != 1)
+        FATAL("No randomness for the connection salt");
+    crypto_dir_init(&c->tx, c->tx_salt);
+    return c;
+}
+
+void crypto_free(crypto_t* c)
+{
+    if (c == NULL)
+        return;
+    EVP_CIPHER_CTX_free(c->tx.ctx);
+    EVP_CIPHER_CTX_free(c->rx.ctx);
+    OPENSSL_cleanse(c, sizeof(crypto_t));
+    free(c);
+}
+
+// encrypt nbufs buffers in place as a single message, the tag goes to tag
+static int aead_seal(crypto_dir_t* dir, uv_buf_t* bufs, int nbufs, char* tag)
+{
+    int len = 0;
+    if (!EVP_EncryptInit_ex(dir->ctx, cipher, NULL, dir->key, dir->nonce))
+        return -1;
+    for (int i = 0; i < nbufs; i++) {
+        if (bufs[i].len && !EVP_EncryptUpdate(dir->ctx, (unsigned char*)bufs[i].base, &len,
+                               (unsigned char*)bufs[i].base, (int)bufs[i].len))
+            return -1;
+    }
+    if (!EVP_EncryptFinal_ex(dir->ctx, NULL, &len)
+        || !EVP_CIPHER_CTX_ctrl(dir->ctx, EVP_CTRL_AEAD_GET_TAG, CRYPTO_TAG_LEN, tag))
+        return -1;
+    nonce_increment(dir->nonce);
+    return 0;
+}
+
+static int aead_open(crypto_dir_t* dir, char* data, size_t len, char* tag)
+{
+    int out = 0;
+    if (!EVP_DecryptInit_ex(dir->ctx, cipher, NULL, dir->key, dir->nonce))
+        return -1;
+    if (len && !EVP_DecryptUpdate(dir->ctx, (unsigned char*)data, &out, (unsigned char*)data, (int)len))
+        return -1;
+    if (!EVP_CIPHER_CTX_ctrl(dir->ctx, EVP_CTRL_AEAD_SET_TAG, CRYPTO_TAG_LEN, tag)
+        || EVP_DecryptFinal_ex(dir->ctx, NULL, &out) <= 0)
+        return -1;
+    nonce_increment(dir->nonce);
+    return 0;
+}
+
+// seal the buffers of one write into a record, encrypting them in place.
+// hdr receives what goes in front of them (CRYPTO_SALT_LEN + CRYPTO_HDR_LEN
+// bytes at most), tag what goes behind. Returns the length of hdr, -1 on
+// failure
+int crypto_seal(crypto_t* c, uv_buf_t* bufs, int nbufs, char* hdr, char* tag)
+{
+    size_t total = 0;
+    int off = 0;
+    for (int i = 0; i < nbufs; i++)
+        total += bufs[i].len;
+    if (total > CRYPTO_RECORD_MAX)
+        return -1;
+    if (!c->salt_sent) {
+        memcpy(hdr, c->tx_salt, CRYPTO_SALT_LEN);
+        off = CRYPTO_SALT_LEN;
+        c->salt_sent = 1;
+    }
+    uint32_t len = htonl((uint32_t)total);
+    memcpy(hdr + off, &len, CRYPTO_LEN_LEN);
+    uv_buf_t len_buf = uv_buf_init(hdr + off, CRYPTO_LEN_LEN);
+    if (aead_seal(&c->tx, &len_buf, 1, hdr + off + CRYPTO_LEN_LEN))
+        return -1;
+    if (aead_seal(&c->tx, bufs, nbufs, tag))
+        return -1;
+    return off + CRYPTO_HDR_LEN;
+}
+
+// open the record at data in place. Returns the bytes it took up, 0 if it
+// is not complete yet and -1 if it does not authenticate. *plain_len stays
+// 0 when only the peer's salt was taken
+int crypto_open(crypto_t* c, char* data, size_t avail, char** plain, size_t* plain_len)
+{
+    *plain_len = 0;
+    if (!c->rx.ready) {
+        if (avail < CRYPTO_SALT_LEN)
+            return 0;
+        crypto_dir_init(&c->rx, (unsigned char*)data);
+        return CRYPTO_SALT_LEN;
+    }
+    if (!c->rx_opened) {
+        if (avail < CRYPTO_HDR_LEN)
+            return 0;
+        if (aead_open(&c->rx, data, CRYPTO_LEN_LEN, data + CRYPTO_LEN_LEN))
+            return -1;
+        uint32_t len;
+        memcpy(&len, data, CRYPTO_LEN_LEN);
+        c->rx_len = ntohl(len);
+        if (c->rx_len > CRYPTO_RECORD_MAX)
+            return -1;
+        c->rx_opened = 1;
+    }
+    size_t record = CRYPTO_HDR_LEN + c->rx_len + CRYPTO_TAG_LEN;
+    if (avail < record)
+        return 0;
+    if (aead_open(&c->rx, data + CRYPTO_HDR_LEN, c->rx_len, data + CRYPTO_HDR_LEN + c->rx_len))
+        return -1;
+    c->rx_opened = 0;
+    *plain = data + CRYPTO_HDR_LEN;
+    *plain_len = c->rx_len;
+    return (int)record;
+}
+
+// bytes the record being received takes up in total, as far as known
+size_t crypto_need(crypto_t* c)
+{
+    if (!c->rx.ready)
+        return CRYPTO_SALT_LEN;
+    if (!c->rx_opened)
+        return CRYPTO_HDR_LEN;
+    return CRYPTO_HDR_LEN + c->rx_len + CRYPTO_TAG_LEN;
+}
@@ -0,0 +1,52 @@
+//
+//  crypto.h
+//  jedisocks
+//
+//  Encrypted transport for the long connection. Every flush is sealed into
+//  one AEAD record, so the per-call cost is shared by all the frames it
+//  carries:
+//
+//  [salt, first record only][length, 4 bytes][tag][payload][tag]
+//
+//  Each direction derives its own key from the password and the salt its
+//  sender picked, nonces count up from zero per key.
+//
+
+#ifndef jedisocks_crypto_h
+#define jedisocks_crypto_h
+#include <stddef.h>
+#include <uv.h>
+#include <openssl/evp.h>
+
+#define CRYPTO_SALT_LEN 32
+#define CRYPTO_KEY_LEN 32
+#define CRYPTO_NONCE_LEN 12
+#define CRYPTO_TAG_LEN 16
+#define CRYPTO_LEN_LEN 4
+#define CRYPTO_HDR_LEN (CRYPTO_LEN_LEN + CRYPTO_TAG_LEN)
+#define CRYPTO_RECORD_MAX (512 * 1024) // larger records are refused
+
+typedef struct crypto_dir {
+    EVP_CIPHER_CTX* ctx;
+    unsigned char key[CRYPTO_KEY_LEN];
+    unsigned char nonce[CRYPTO_NONCE_LEN];
+    int ready;
+} crypto_dir_t;
+
+typedef struct crypto {
+    crypto_dir_t tx;
+    crypto_dir_t rx;
+    unsigned char tx_salt[CRYPTO_SALT_LEN];
+    int salt_sent;
+    int rx_opened; // the length of the record in progress is known
+    size_t rx_len; // ... and this is it
+} crypto_t;
+
+extern int crypto_setup(const char* method, const char* password);
+extern int crypto_enabled(void);
+extern crypto_t* crypto_new(void);
+extern void crypto_free(crypto_t* c);
+extern int crypto_seal(crypto_t* c, uv_buf_t* bufs, int nbufs, char* hdr, char* tag);
+extern int crypto_open(crypto_t* c, char* data, size_t avail, char** plain, size_t* plain_len);
+extern size_t crypto_need(crypto_t* c);
+#endif
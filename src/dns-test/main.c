@@ -0,0 +1,314 @@
+//
+//  main.c
+//  dns-test
+//
+//  Runs js-server's resolver against a stub nameserver on loopback: an
+//  answer over UDP, a truncated one asked again over TCP, NXDOMAIN, and a
+//  server that never answers. Checks that the queries left from ports of
+//  their own and that every socket is closed when they are done.
+//
+//  dns-test
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "../utils.h"
+#include "../resolver.h"
+
+#define STUB_BIG_COUNT 40 // A records of big.test, too many for 512 bytes
+#define STUB_UDP_MAX 512 // what the stub answers over UDP, EDNS0 or not
+#define STUB_MAX_PORTS 16
+
+FILE* logfile = NULL;
+
+typedef struct test_case {
+    const char* name;
+    int status; // expected
+    int count; // ... addresses
+    int done;
+} test_case_t;
+
+static test_case_t cases[] = {
+    { "a.test", 0, 1, 0 },
+    { "v6.test", 0, 1, 0 },
+    { "big.test", 0, DNS_MAX_ADDRS, 0 },
+    { "nx.test", UV_EAI_NONAME, 0, 0 },
+    { "dead.test", UV_ETIMEDOUT, 0, 0 },
+};
+
+#define CASE_COUNT (int)(sizeof(cases) / sizeof(cases[0]))
+
+typedef struct stub_port {
+    char name[64];
+    int port; // the query of name came from
+} stub_port_t;
+
+static uv_loop_t* loop;
+static uv_udp_t stub_udp;
+static uv_tcp_t stub_tcp;
+static stub_port_t ports[STUB_MAX_PORTS];
+static int port_count;
+static int tcp_questions;
+static int pending = CASE_COUNT;
+static int failures;
+
+typedef struct {
+    uv_udp_send_t req;
+    char buf[STUB_UDP_MAX];
+} stub_send_t;
+
+typedef struct {
+    uv_tcp_t handle;
+    char buf[2 + 1024];
+    size_t len;
+} stub_conn_t;
+
+typedef struct {
+    uv_write_t req;
+    char buf[2 + 1024];
+} stub_write_t;
+
+static void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+static uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+// the question of msg in dotted form, and where it ends
+static int stub_question(const uint8_t* msg, size_t len, char* name, size_t size)
+{
+    size_t pos = 12;
+    size_t out = 0;
+    while (pos < len && msg[pos] != 0) {
+        size_t label = msg[pos++];
+        if (pos + label > len || out + label + 2 > size)
+            return -1;
+        if (out > 0)
+            name[out++] = '.';
+        memcpy(name + out, msg + pos, label);
+        out += label;
+        pos += label;
+    }
+    name[out] = '\0';
+    if (pos + 5 > len)
+        return -1;
+    return (int)pos + 5;
+}
+
+static size_t stub_record(uint8_t* p, uint16_t type, const void* data, uint16_t len)
+{
+    p[0] = 0xc0; // the name of the question
+    p[1] = 12;
+    put16(p + 2, type);
+    put16(p + 4, 1);
+    memset(p + 6, 0, 4);
+    p[9] = 60;
+    put16(p + 10, len);
+    memcpy(p + 12, data, len);
+    return 12 + len;
+}
+
+// the answer to msg into out, 0 for none. Over UDP it is truncated to
+// STUB_UDP_MAX bytes, the OPT record of the question is not echoed
+static size_t stub_answer(const uint8_t* msg, size_t len, uint8_t* out, size_t size, int over_tcp)
+{
+    char name[256];
+    int end = stub_question(msg, len, name, sizeof(name));
+    if (end < 0 || strcmp(name, "dead.test") == 0)
+        return 0;
+    uint16_t qtype = get16(msg + end - 4);
+    uint16_t flags = 0x8000 | 0x0100 | 0x0080;
+    uint16_t answers = 0;
+    memcpy(out, msg, end);
+    size_t pos = end;
+    if (strcmp(name, "nx.test") == 0)
+        flags |= 3;
+    else if (qtype == 1 && strcmp(name, "v6.test") != 0) {
+        int n = strcmp(name, "big.test") == 0 ? STUB_BIG_COUNT : 1;
+        for (int i = 0; i < n && pos + 16 <= size; i++, answers++) {
+            uint8_t addr[4] = { 127, 0, 0, 1 + i };
+            pos += stub_record(out + pos, qtype, addr, 4);
+        }
+    }
+    else if (qtype == 28 && strcmp(name, "v6.test") == 0) {
+        uint8_t addr[16] = { 0 };
+        addr[15] = 1;
+        pos += stub_record(out + pos, qtype, addr, 16);
+        answers++;
+    }
+    if (!over_tcp && pos > STUB_UDP_MAX) {
+        flags |= 0x0200;
+        answers = 0;
+        pos = end;
+    }
+    put16(out + 2, flags);
+    put16(out + 6, answers);
+    memset(out + 8, 0, 4);
+    return pos;
+}
+
+static void stub_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    static char scratch[4096];
+    *buf = uv_buf_init(scratch, sizeof(scratch));
+}
+
+static void stub_send_cb(uv_udp_send_t* req, int status)
+{
+    free(req);
+}
+
+static void stub_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags)
+{
+    char name[256];
+    if (nread <= 0 || addr == NULL)
+        return;
+    if (stub_question((uint8_t*)buf->base, nread, name, sizeof(name)) < 0)
+        return;
+    int port = ntohs(((const struct sockaddr_in*)addr)->sin_port);
+    if (port_count < STUB_MAX_PORTS) {
+        strncpy(ports[port_count].name, name, sizeof(ports[port_count].name) - 1);
+        ports[port_count++].port = port;
+    }
+
+    stub_send_t* send = malloc(sizeof(stub_send_t));
+    uint8_t out[4096];
+    size_t len = stub_answer((uint8_t*)buf->base, nread, out, sizeof(out), 0);
+    if (len == 0) {
+        free(send);
+        return;
+    }
+    memcpy(send->buf, out, len);
+    uv_buf_t reply = uv_buf_init(send->buf, len);
+    if (uv_udp_send(&send->req, handle, &reply, 1, addr, stub_send_cb))
+        free(send);
+}
+
+static void stub_conn_close_cb(uv_handle_t* handle)
+{
+    free(handle->data);
+}
+
+static void stub_write_cb(uv_write_t* req, int status)
+{
+    uv_close((uv_handle_t*)req->handle, stub_conn_close_cb);
+    free(req);
+}
+
+static void stub_conn_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    stub_conn_t* conn = (stub_conn_t*)handle->data;
+    *buf = uv_buf_init(conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+}
+
+static void stub_conn_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    stub_conn_t* conn = (stub_conn_t*)stream->data;
+    if (nread < 0 || (nread > 0 && conn->len + nread == sizeof(conn->buf))) {
+        uv_close((uv_handle_t*)stream, stub_conn_close_cb);
+        return;
+    }
+    conn->len += nread;
+    if (conn->len < 2 || conn->len < 2 + (size_t)get16((uint8_t*)conn->buf))
+        return;
+    uv_read_stop(stream);
+    tcp_questions++;
+    stub_write_t* wr = malloc(sizeof(stub_write_t));
+    size_t len = stub_answer((uint8_t*)conn->buf + 2, get16((uint8_t*)conn->buf), (uint8_t*)wr->buf + 2, sizeof(wr->buf) - 2, 1);
+    put16((uint8_t*)wr->buf, (uint16_t)len);
+    uv_buf_t reply = uv_buf_init(wr->buf, len + 2);
+    if (len == 0 || uv_write(&wr->req, stream, &reply, 1, stub_write_cb)) {
+        free(wr);
+        uv_close((uv_handle_t*)stream, stub_conn_close_cb);
+    }
+}
+
+static void stub_accept_cb(uv_stream_t* server, int status)
+{
+    if (status)
+        return;
+    stub_conn_t* conn = calloc(1, sizeof(stub_conn_t));
+    conn->handle.data = conn;
+    uv_tcp_init(loop, &conn->handle);
+    if (uv_accept(server, (uv_stream_t*)&conn->handle)) {
+        uv_close((uv_handle_t*)&conn->handle, stub_conn_close_cb);
+        return;
+    }
+    uv_read_start((uv_stream_t*)&conn->handle, stub_conn_alloc_cb, stub_conn_read_cb);
+}
+
+// a UDP and a TCP socket on the same loopback port. Returns the port
+static int stub_start(void)
+{
+    struct sockaddr_in addr;
+    int len = sizeof(addr);
+    uv_ip4_addr("127.0.0.1", 0, &addr);
+    uv_udp_init(loop, &stub_udp);
+    if (uv_udp_bind(&stub_udp, (struct sockaddr*)&addr, 0)
+        || uv_udp_getsockname(&stub_udp, (struct sockaddr*)&addr, &len)
+        || uv_udp_recv_start(&stub_udp, stub_alloc_cb, stub_udp_recv_cb))
+        FATAL("dns-test: cannot open the stub's UDP socket");
+    uv_tcp_init(loop, &stub_tcp);
+    if (uv_tcp_bind(&stub_tcp, (struct sockaddr*)&addr, 0)
+        || uv_listen((uv_stream_t*)&stub_tcp, 16, stub_accept_cb))
+        FATAL("dns-test: cannot open the stub's TCP socket");
+    return ntohs(addr.sin_port);
+}
+
+static void test_check(int ok, const char* what)
+{
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+static void test_cb(void* data, int status, const dns_addr_t* addrs, int count, uint32_t ttl)
+{
+    test_case_t* c = (test_case_t*)data;
+    char what[128];
+    snprintf(what, sizeof(what), "%s: %s, %d address(es)", c->name, status ? uv_strerror(status) : "resolved", count);
+    test_check(!c->done && status == c->status && count == c->count, what);
+    c->done = 1;
+    if (--pending == 0) {
+        uv_close((uv_handle_t*)&stub_udp, NULL);
+        uv_close((uv_handle_t*)&stub_tcp, NULL);
+    }
+}
+
+// each query asked from a port of its own, both of its questions from it
+static void test_ports(void)
+{
+    int distinct = 1;
+    for (int i = 0; i < port_count; i++) {
+        for (int j = 0; j < i; j++) {
+            if ((strcmp(ports[i].name, ports[j].name) == 0) != (ports[i].port == ports[j].port))
+                distinct = 0;
+        }
+    }
+    test_check(port_count >= 2 * CASE_COUNT && distinct, "a source port per query");
+}
+
+int main(int argc, char** argv)
+{
+    char nameserver[32];
+    loop = uv_default_loop();
+    snprintf(nameserver, sizeof(nameserver), "127.0.0.1:%d", stub_start());
+    resolver_init(loop, nameserver);
+    for (int i = 0; i < CASE_COUNT; i++) {
+        if (resolver_start(cases[i].name, test_cb, &cases[i]) == NULL)
+            FATAL("dns-test: cannot ask for %s", cases[i].name);
+    }
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    test_check(tcp_questions == 1, "a truncated answer asked again over TCP");
+    test_ports();
+    test_check(uv_loop_close(loop) == 0, "every socket closed");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,476 @@
+//
+//  dns.c
+//  jedisocks
+//
+//  js-server's resolver cache. Answers are kept by hostname for their TTL,
+//  at most conf.dns_ttl, failures for DNS_NEGATIVE_TTL; concurrent requests
+//  for a name being resolved wait for the one lookup in flight, and IP
+//  literals and /etc/hosts names are answered without any lookup.
+//
+//  With conf.dns_snapshot the most used names are saved to that file every
+//  sweep and loaded again at startup; names that expired in between are
+//  answered as they were while a lookup refreshes them.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <uv.h>
+#include "utils.h"
+#include "dns.h"
+
+dns_stats_t dns_stats;
+
+static uv_loop_t* dns_loop;
+static uv_timer_t dns_sweep_timer;
+static int dns_ttl; // ms answers are kept at most, 0 = only lookups in flight are shared
+static int dns_count;
+static dns_stats_t dns_logged; // as of the last sweep
+static char* dns_snapshot_path; // NULL = no snapshot
+static char* dns_snapshot_tmp; // ... written there, then renamed
+static int dns_snapshot_busy; // a snapshot is being written
+
+static void dns_resolved_cb(void* data, int status, const dns_addr_t* addrs, int count, uint32_t ttl);
+
+static inline int dns_cmp(const dns_entry_t* a, const dns_entry_t* b)
+{
+    return strcmp(a->name, b->name);
+}
+
+RB_HEAD(dns_tree, dns_entry) dns_cache = RB_INITIALIZER(&dns_cache);
+RB_PROTOTYPE(dns_tree, dns_entry, rb_link, dns_cmp);
+RB_GENERATE(dns_tree, dns_entry, rb_link, dns_cmp);
+
+static void dns_remove(dns_entry_t* entry)
+{
+    RB_REMOVE(dns_tree, &dns_cache, entry);
+    dns_count--;
+    free(entry);
+}
+
+// names in flight stay, their waiters need them
+static void dns_sweep(uint64_t now)
+{
+    dns_entry_t* entry;
+    dns_entry_t* next;
+    for (entry = RB_MIN(dns_tree, &dns_cache); entry != NULL; entry = next) {
+        next = RB_NEXT(dns_tree, &dns_cache, entry);
+        if (entry->query == NULL && !entry->busy && entry->expires <= now)
+            dns_remove(entry);
+    }
+}
+
+// the name as it is kept, len is returned or -1 if it is too long
+static int dns_key(const char* name, char* key)
+{
+    size_t len = strlen(name);
+    if (len >= sizeof(((dns_entry_t*)0)->name))
+        return -1;
+    for (size_t i = 0; i <= len; i++)
+        key[i] = tolower((unsigned char)name[i]);
+    if (len > 0 && key[len - 1] == '.')
+        key[--len] = '\0';
+    return (int)len;
+}
+
+static int dns_uses_cmp(const void* a, const void* b)
+{
+    uint32_t x = (*(dns_entry_t* const*)a)->uses;
+    uint32_t y = (*(dns_entry_t* const*)b)->uses;
+    if (x == y)
+        return 0;
+    return x > y ? -1 : 1;
+}
+
+// runs on the threadpool, the file is replaced only once it is complete
+static void dns_snapshot_work_cb(uv_work_t* req)
+{
+    dns_snapshot_job_t* job = (dns_snapshot_job_t*)req->data;
+    job->status = 0;
+    int fd = open(dns_snapshot_tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        job->status = -errno;
+        return;
+    }
+    char* map = MAP_FAILED;
+    if (ftruncate(fd, job->len) == 0)
+        map = mmap(NULL, job->len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        job->status = -errno;
+        close(fd);
+        unlink(dns_snapshot_tmp);
+        return;
+    }
+    memcpy(map, job->buf, job->len);
+    munmap(map, job->len);
+    close(fd);
+    if (rename(dns_snapshot_tmp, dns_snapshot_path) < 0) {
+        job->status = -errno;
+        unlink(dns_snapshot_tmp);
+    }
+}
+
+static void dns_snapshot_after_cb(uv_work_t* req, int status)
+{
+    dns_snapshot_job_t* job = (dns_snapshot_job_t*)req->data;
+    if (job->status)
+        LOGW("dns: saving %s failed: %s", dns_snapshot_path, uv_strerror(job->status));
+    dns_snapshot_busy = 0;
+    free(job->buf);
+    free(job);
+}
+
+// the most used names that resolved, unless none of their destinations
+// could be connected. Nothing is written when there are none, the last
+// snapshot is better than an empty one
+static void dns_snapshot(uint64_t now)
+{
+    if (dns_snapshot_path == NULL || dns_snapshot_busy || dns_count == 0)
+        return;
+    dns_entry_t** hot = malloc(dns_count * sizeof(dns_entry_t*));
+    dns_entry_t* entry;
+    int n = 0;
+    RB_FOREACH(entry, dns_tree, &dns_cache) {
+        if (entry->status || entry->count == 0)
+            continue;
+        if (entry->connects == 0 && entry->connect_errors > 0)
+            continue;
+        hot[n++] = entry;
+    }
+    if (n == 0) {
+        free(hot);
+        return;
+    }
+    qsort(hot, n, sizeof(dns_entry_t*), dns_uses_cmp);
+    if (n > DNS_SNAPSHOT_MAX)
+        n = DNS_SNAPSHOT_MAX;
+
+    size_t len = sizeof(dns_snapshot_hdr_t);
+    for (int i = 0; i < n; i++)
+        len += sizeof(dns_snapshot_rec_t) + strlen(hot[i]->name) + hot[i]->count * 17;
+    char* buf = malloc(len);
+    size_t pos = sizeof(dns_snapshot_hdr_t);
+    uint64_t wall = time(NULL);
+    for (int i = 0; i < n; i++) {
+        entry = hot[i];
+        dns_snapshot_rec_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.expires = wall + (entry->expires > now ? (entry->expires - now + 999) / 1000 : 0);
+        rec.uses = entry->uses;
+        rec.connects = entry->connects;
+        rec.connect_errors = entry->connect_errors;
+        rec.count = entry->count;
+        rec.namelen = strlen(entry->name);
+        memcpy(buf + pos, &rec, sizeof(rec));
+        pos += sizeof(rec);
+        memcpy(buf + pos, entry->name, rec.namelen);
+        pos += rec.namelen;
+        for (int j = 0; j < entry->count; j++) {
+            int alen = entry->addrs[j].family == AF_INET ? 4 : 16;
+            buf[pos++] = alen == 4 ? 4 : 6;
+            memcpy(buf + pos, entry->addrs[j].addr, alen);
+            pos += alen;
+        }
+    }
+    free(hot);
+
+    dns_snapshot_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, DNS_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = DNS_SNAPSHOT_VERSION;
+    hdr.count = n;
+    hdr.size = pos;
+    hdr.saved = wall;
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    dns_snapshot_job_t* job = calloc(1, sizeof(dns_snapshot_job_t));
+    job->req.data = job;
+    job->buf = buf;
+    job->len = pos;
+    dns_snapshot_busy = 1;
+    uv_queue_work(dns_loop, &job->req, dns_snapshot_work_cb, dns_snapshot_after_cb);
+}
+
+// use counts are halved so that names nobody asks for anymore fade out
+// over restarts. Names that expired meanwhile are refreshed, and answered
+// with the addresses they had until then
+static void dns_snapshot_load(void)
+{
+    int fd = open(dns_snapshot_path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            LOGW("dns: cannot open %s: %s", dns_snapshot_path, strerror(errno));
+        return;
+    }
+    struct stat st;
+    char* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(dns_snapshot_hdr_t))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOGW("dns: cannot read %s", dns_snapshot_path);
+        return;
+    }
+
+    size_t size = st.st_size;
+    dns_snapshot_hdr_t hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, DNS_SNAPSHOT_MAGIC, sizeof(hdr.magic)) || hdr.version != DNS_SNAPSHOT_VERSION || hdr.size != size) {
+        LOGW("dns: %s is not a snapshot of this version, ignored", dns_snapshot_path);
+        munmap(map, size);
+        return;
+    }
+
+    uint64_t wall = time(NULL);
+    uint64_t now = uv_now(dns_loop);
+    size_t pos = sizeof(hdr);
+    int loaded = 0, refreshed = 0;
+    for (uint32_t i = 0; i < hdr.count && loaded < DNS_SNAPSHOT_MAX; i++) {
+        dns_snapshot_rec_t rec;
+        if (pos + sizeof(rec) > size)
+            break;
+        memcpy(&rec, map + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (rec.namelen == 0 || rec.count == 0 || rec.count > DNS_MAX_ADDRS || pos + rec.namelen > size)
+            break;
+        dns_entry_t* entry = calloc(1, sizeof(dns_entry_t));
+        memcpy(entry->name, map + pos, rec.namelen);
+        pos += rec.namelen;
+        int j;
+        for (j = 0; j < rec.count; j++) {
+            int family = pos < size ? map[pos++] : 0;
+            int alen = family == 4 ? 4 : family == 6 ? 16 : 0;
+            if (alen == 0 || pos + alen > size)
+                break;
+            entry->addrs[j].family = family == 4 ? AF_INET : AF_INET6;
+            memcpy(entry->addrs[j].addr, map + pos, alen);
+            pos += alen;
+        }
+        if (j < rec.count) {
+            free(entry);
+            break;
+        }
+        if (RB_FIND(dns_tree, &dns_cache, entry) != NULL) {
+            free(entry);
+            continue;
+        }
+        entry->count = rec.count;
+        entry->uses = rec.uses / 2;
+        entry->connects = rec.connects / 2;
+        entry->connect_errors = rec.connect_errors / 2;
+        if (rec.expires > wall) {
+            uint64_t keep = (rec.expires - wall) * 1000;
+            entry->expires = now + (keep < (uint64_t)dns_ttl ? keep : (uint64_t)dns_ttl);
+        }
+        else {
+            entry->expires = now;
+            entry->stale = 1;
+            entry->query = resolver_start(entry->name, dns_resolved_cb, entry);
+            if (entry->query == NULL) {
+                free(entry);
+                continue;
+            }
+            refreshed++;
+        }
+        RB_INSERT(dns_tree, &dns_cache, entry);
+        dns_count++;
+        loaded++;
+    }
+    munmap(map, size);
+    LOGI("dns: %d names loaded from %s, %d of them being refreshed", loaded, dns_snapshot_path, refreshed);
+}
+
+static void dns_sweep_cb(uv_timer_t* handle)
+{
+    uint64_t now = uv_now(dns_loop);
+    dns_snapshot(now);
+    dns_sweep(now);
+    uint64_t hits = dns_stats.hits - dns_logged.hits;
+    uint64_t lookups = hits + dns_stats.coalesced - dns_logged.coalesced + dns_stats.misses - dns_logged.misses;
+    if (lookups > 0)
+        LOGI("dns cache: %d names, %llu of %llu lookups answered from cache (%llu%%), %llu joined one in flight",
+            dns_count, (unsigned long long)hits, (unsigned long long)lookups, (unsigned long long)(100 * hits / lookups),
+            (unsigned long long)(dns_stats.coalesced - dns_logged.coalesced));
+    dns_logged = dns_stats;
+}
+
+void dns_init(uv_loop_t* loop, int ttl, const char* nameserver, const char* snapshot)
+{
+    dns_loop = loop;
+    dns_ttl = ttl;
+    resolver_init(loop, nameserver);
+    if (snapshot != NULL && ttl > 0) {
+        dns_snapshot_path = strdup(snapshot);
+        dns_snapshot_tmp = malloc(strlen(snapshot) + 5);
+        sprintf(dns_snapshot_tmp, "%s.tmp", snapshot);
+        dns_snapshot_load();
+    }
+    uv_timer_init(loop, &dns_sweep_timer);
+    uv_timer_start(&dns_sweep_timer, dns_sweep_cb, DNS_SWEEP_INTERVAL, DNS_SWEEP_INTERVAL);
+    uv_unref((uv_handle_t*)&dns_sweep_timer);
+}
+
+static void dns_resolved_cb(void* data, int status, const dns_addr_t* addrs, int count, uint32_t ttl)
+{
+    dns_entry_t* entry = (dns_entry_t*)data;
+    int refresh = entry->stale;
+    entry->query = NULL;
+    entry->stale = 0;
+    if (refresh && status && status != UV_EAI_NONAME) {
+        // nobody waits for a refresh, and the name may be fine while its
+        // nameservers are not: what the snapshot had is kept a little longer
+        LOGW("dns: refreshing %s failed: %s", entry->name, uv_strerror(status));
+        entry->expires = uv_now(dns_loop) + DNS_NEGATIVE_TTL;
+        return;
+    }
+    entry->status = status;
+    entry->count = count;
+    memcpy(entry->addrs, addrs, count * sizeof(dns_addr_t));
+    if (status)
+        LOGW("dns: resolving %s failed: %s", entry->name, uv_strerror(status));
+    uint64_t keep = status ? DNS_NEGATIVE_TTL : (uint64_t)ttl * 1000;
+    if (keep > (uint64_t)dns_ttl && !status)
+        keep = dns_ttl;
+    entry->expires = uv_now(dns_loop) + keep;
+
+    // the callbacks may ask for this name again, which the entry now
+    // answers, or cancel the waiters behind them
+    dns_waiter_t* waiter;
+    entry->busy = 1;
+    while ((waiter = entry->waiters) != NULL) {
+        entry->waiters = waiter->next;
+        if (entry->waiters != NULL)
+            entry->waiters->prev = NULL;
+        else
+            entry->last = NULL;
+        waiter->cb(waiter->data, entry->status, entry->addrs, entry->count);
+        free(waiter);
+    }
+    entry->busy = 0;
+    if (dns_ttl == 0 || dns_count > DNS_CACHE_MAX)
+        dns_remove(entry);
+}
+
+// cb runs before dns_resolve returns for literals, cached names and names
+// DNS cannot carry, NULL is returned then. Otherwise the waiter returned
+// can be given to dns_cancel until cb runs
+dns_waiter_t* dns_resolve(const char* name, dns_cb cb, void* data)
+{
+    dns_addr_t local[DNS_MAX_ADDRS];
+    int count;
+    if (resolver_literal(name, &local[0]))
+        count = 1;
+    else
+        count = resolver_hosts(name, local, DNS_MAX_ADDRS);
+    if (count > 0) {
+        dns_stats.literals++;
+        cb(data, 0, local, count);
+        return NULL;
+    }
+
+    dns_entry_t find;
+    int len = dns_key(name, find.name);
+    if (len < 0) {
+        cb(data, UV_EINVAL, NULL, 0);
+        return NULL;
+    }
+
+    // an expired name is looked up again in the same entry, which keeps
+    // its use and connect counts
+    uint64_t now = uv_now(dns_loop);
+    dns_entry_t* entry = RB_FIND(dns_tree, &dns_cache, &find);
+    int expired = entry != NULL && entry->query == NULL && !entry->busy && entry->expires <= now;
+    if (entry != NULL && !expired && (entry->query == NULL || entry->stale)) {
+        entry->uses++;
+        dns_stats.hits++;
+        if (entry->stale)
+            dns_stats.stale_hits++;
+        else if (entry->status)
+            dns_stats.negative_hits++;
+        cb(data, entry->status, entry->addrs, entry->count);
+        return NULL;
+    }
+
+    dns_waiter_t* waiter = calloc(1, sizeof(dns_waiter_t));
+    waiter->cb = cb;
+    waiter->data = data;
+    if (entry != NULL && !expired) {
+        entry->uses++;
+        dns_stats.coalesced++;
+        waiter->entry = entry;
+        waiter->prev = entry->last;
+        entry->last->next = waiter;
+        entry->last = waiter;
+        return waiter;
+    }
+
+    if (entry == NULL) {
+        if (dns_count >= DNS_CACHE_MAX)
+            dns_sweep(now);
+        entry = calloc(1, sizeof(dns_entry_t));
+        memcpy(entry->name, find.name, len + 1);
+    }
+    entry->query = resolver_start(entry->name, dns_resolved_cb, entry);
+    if (entry->query == NULL) {
+        if (expired)
+            dns_remove(entry);
+        else
+            free(entry);
+        free(waiter);
+        cb(data, UV_EINVAL, NULL, 0);
+        return NULL;
+    }
+    entry->uses++;
+    dns_stats.misses++;
+    waiter->entry = entry;
+    entry->waiters = waiter;
+    entry->last = waiter;
+    if (!expired) {
+        RB_INSERT(dns_tree, &dns_cache, entry);
+        dns_count++;
+    }
+    return waiter;
+}
+
+// the requester went away: its callback is not run, and the lookup is
+// dropped when nobody else waits for it
+void dns_cancel(dns_waiter_t* waiter)
+{
+    dns_entry_t* entry = waiter->entry;
+    dns_stats.cancelled++;
+    if (waiter->prev != NULL)
+        waiter->prev->next = waiter->next;
+    else
+        entry->waiters = waiter->next;
+    if (waiter->next != NULL)
+        waiter->next->prev = waiter->prev;
+    else
+        entry->last = waiter->prev;
+    free(waiter);
+    if (entry->waiters == NULL && entry->query != NULL) {
+        resolver_cancel(entry->query);
+        dns_remove(entry);
+    }
+}
+
+// whether a destination of the name could be connected, kept with the
+// name for as long as it is cached
+void dns_connected(const char* name, int ok)
+{
+    dns_entry_t find;
+    if (dns_key(name, find.name) < 0)
+        return;
+    dns_entry_t* entry = RB_FIND(dns_tree, &dns_cache, &find);
+    if (entry == NULL)
+        return;
+    if (ok)
+        entry->connects++;
+    else
+        entry->connect_errors++;
+}
@@ -0,0 +1,103 @@
+//
+//  dns.h
+//  jedisocks
+//
+//  js-server's resolver cache. Answers are kept by hostname for their TTL,
+//  at most conf.dns_ttl, failures for DNS_NEGATIVE_TTL; concurrent requests
+//  for a name being resolved wait for the one lookup in flight, and IP
+//  literals and /etc/hosts names are answered without any lookup.
+//
+//  With conf.dns_snapshot the most used names are saved to that file every
+//  sweep and loaded again at startup; names that expired in between are
+//  answered as they were while a lookup refreshes them.
+//
+
+#ifndef jedisocks_dns_h
+#define jedisocks_dns_h
+#include <stdint.h>
+#include <uv.h>
+#include "tree.h"
+#include "resolver.h"
+
+#define DNS_TTL_DEFAULT 60000
+#define DNS_NEGATIVE_TTL 5000
+#define DNS_CACHE_MAX 4096 // names, beyond that answers are not kept
+#define DNS_SWEEP_INTERVAL 60000 // expired names are dropped and the hit rate logged
+#define DNS_SNAPSHOT_MAX 1024 // names saved, the most used ones
+#define DNS_SNAPSHOT_MAGIC "JSDC"
+#define DNS_SNAPSHOT_VERSION 1
+
+// status is 0 or a libuv error, addrs only live through the call
+typedef void (*dns_cb)(void* data, int status, const dns_addr_t* addrs, int count);
+
+typedef struct dns_waiter {
+    dns_cb cb;
+    void* data;
+    struct dns_entry* entry;
+    struct dns_waiter* prev;
+    struct dns_waiter* next;
+} dns_waiter_t;
+
+typedef struct dns_entry {
+    RB_ENTRY(dns_entry) rb_link;
+    char name[256]; // lowercase, without the trailing dot
+    int status;
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    int count;
+    uint64_t expires; // uv_now()
+    uint32_t uses; // requests for the name, what the snapshot keeps first
+    uint32_t connects; // destinations of the name that were connected
+    uint32_t connect_errors; // ... and that could not be
+    resolver_query_t* query; // non-NULL while the lookup is in flight
+    int stale; // ... which refreshes addresses loaded from the snapshot
+    dns_waiter_t* waiters; // ... and these wait for it, oldest first
+    dns_waiter_t* last;
+    int busy; // the waiters are being called back, the entry must stay
+} dns_entry_t;
+
+typedef struct dns_stats {
+    uint64_t hits; // answered from the cache
+    uint64_t negative_hits; // ... with a cached failure
+    uint64_t coalesced; // joined a lookup in flight
+    uint64_t misses; // started a lookup
+    uint64_t cancelled; // gave up waiting
+    uint64_t literals; // IP literals and /etc/hosts names, never looked up
+    uint64_t stale_hits; // answered from the snapshot while refreshed
+} dns_stats_t;
+
+// the snapshot file is a header followed by count records, each of them
+// the fields below, then namelen bytes of name and count addresses as a
+// family byte (4 or 6) and 4 or 16 bytes. Numbers are in host order, the
+// file only ever goes back to the machine that wrote it
+typedef struct dns_snapshot_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t count;
+    uint32_t size; // of the whole file
+    uint64_t saved; // time()
+} dns_snapshot_hdr_t;
+
+typedef struct dns_snapshot_rec {
+    uint64_t expires; // time()
+    uint32_t uses;
+    uint32_t connects;
+    uint32_t connect_errors;
+    uint8_t count;
+    uint8_t namelen;
+    uint8_t reserved[2];
+} dns_snapshot_rec_t;
+
+typedef struct dns_snapshot_job {
+    uv_work_t req;
+    char* buf;
+    size_t len;
+    int status; // 0 or a libuv error
+} dns_snapshot_job_t;
+
+extern dns_stats_t dns_stats;
+
+extern void dns_init(uv_loop_t* loop, int ttl, const char* nameserver, const char* snapshot);
+extern dns_waiter_t* dns_resolve(const char* name, dns_cb cb, void* data);
+extern void dns_cancel(dns_waiter_t* waiter);
+extern void dns_connected(const char* name, int ok);
+#endif
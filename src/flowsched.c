@@ -0,0 +1,179 @@
+//
+//  flowsched.c
+//  jedisocks
+//
+//  Outbound frame scheduler of a long connection: control frames first,
+//  then a strict priority lane for interactive sessions, then deficit
+//  round robin across the bulk sessions. While bulk sessions wait, the
+//  interactive lane gets at most SCHED_FAST_SHARE of each flush, so a bulk
+//  transfer on an interactive port cannot starve them.
+//
+
+#include <stdlib.h>
+#include "utils.h"
+#include "flowsched.h"
+
+void sched_init(scheduler_t* sched)
+{
+    frame_queue_init(&sched->control);
+    list_init(&sched->fast);
+    list_init(&sched->bulk);
+    sched->count = 0;
+}
+
+sched_flow_t* sched_flow_new(int pinned)
+{
+    sched_flow_t* flow = calloc(1, sizeof(sched_flow_t));
+    if (flow == NULL)
+        FATAL("Not enough memory");
+    frame_queue_init(&flow->frames);
+    flow->pinned = pinned;
+    flow->fast = 1; // new sessions start out interactive
+    return flow;
+}
+
+// the owning session is gone; frames it queued (its close frame included)
+// still go out in order, after that the flow frees itself
+void sched_flow_detach(sched_flow_t* flow)
+{
+    if (flow == NULL)
+        return;
+    flow->detached = 1;
+    if (!flow->linked)
+        free(flow);
+}
+
+static void sched_unlink(sched_flow_t* flow)
+{
+    list_remove_elem(flow);
+    flow->linked = 0;
+    flow->deficit = 0;
+    if (flow->detached)
+        free(flow);
+}
+
+static void sched_link(scheduler_t* sched, sched_flow_t* flow)
+{
+    if (flow->fast) {
+        list_add_to_tail(&sched->fast, flow);
+    }
+    else {
+        list_add_to_tail(&sched->bulk, flow);
+    }
+    flow->linked = 1;
+}
+
+// sessions whose frames are small on average are interactive, the halved
+// promotion threshold keeps a flow from flapping between the lanes
+static void sched_classify(scheduler_t* sched, sched_flow_t* flow, size_t len)
+{
+    flow->avg_size = (flow->avg_size * 3 + (int)len) / 4;
+    if (flow->pinned)
+        return;
+    int fast = flow->fast;
+    if (fast && flow->avg_size > SCHED_INTERACTIVE_SIZE)
+        fast = 0;
+    else if (!fast && flow->avg_size < SCHED_INTERACTIVE_SIZE / 2)
+        fast = 1;
+    if (fast == flow->fast)
+        return;
+    flow->fast = fast;
+    if (flow->linked) {
+        list_remove_elem(flow);
+        sched_link(sched, flow);
+    }
+}
+
+// queue a frame on a flow, or on the control queue when flow is NULL
+void sched_push(scheduler_t* sched, sched_flow_t* flow, buf_pool_t* pool, char* mem, char* base, size_t len)
+{
+    sched->count++;
+    if (flow == NULL) {
+        frame_queue_push(&sched->control, pool, mem, base, len);
+        return;
+    }
+    frame_queue_push(&flow->frames, pool, mem, base, len);
+    sched_classify(sched, flow, len);
+    if (!flow->linked)
+        sched_link(sched, flow);
+}
+
+static void sched_take(scheduler_t* sched, batch_write_req_t* wr, frame_t* frame)
+{
+    list_add_to_tail(&wr->frames, frame);
+    wr->frames.count++;
+    sched->count--;
+}
+
+// pick up to SCHED_FLUSH_BUDGET bytes of frames and write them with a single
+// uv_write, sealed into one record when crypto is set. Returns uv_write's
+// status, 0 when there was nothing to write.
+int sched_write(scheduler_t* sched, uv_stream_t* stream, crypto_t* crypto, void* data, uv_write_cb cb)
+{
+    if (sched->count == 0)
+        return 0;
+
+    batch_write_req_t* wr = batch_write_new(data);
+    size_t budget = SCHED_FLUSH_BUDGET;
+    frame_t* frame = NULL;
+
+    while (wr->frames.count < MAX_BATCH_FRAMES && (frame = frame_queue_pop(&sched->control)))
+        sched_take(sched, wr, frame);
+
+    // fast lane: strict priority, one frame per flow per pass, up to its
+    // share when there is bulk waiting (pinned flows are never demoted)
+    sched_flow_t* flow = NULL;
+    size_t fast_bytes = 0;
+    while (budget > 0 && wr->frames.count < MAX_BATCH_FRAMES && (flow = list_get_head_elem(&sched->fast))) {
+        if (fast_bytes >= SCHED_FAST_SHARE && list_get_head_elem(&sched->bulk) != NULL)
+            break;
+        frame = frame_queue_pop(&flow->frames);
+        fast_bytes += frame->buf.len;
+        budget -= frame->buf.len < budget ? frame->buf.len : budget;
+        sched_take(sched, wr, frame);
+        if (flow->frames.count == 0) {
+            sched_unlink(flow);
+        }
+        else {
+            list_remove_elem(flow);
+            list_add_to_tail(&sched->fast, flow);
+        }
+    }
+
+    // bulk lane: deficit round robin, a flow that cannot afford its head
+    // frame earns a quantum and passes its turn on
+    while (budget > 0 && wr->frames.count < MAX_BATCH_FRAMES && (flow = list_get_head_elem(&sched->bulk))) {
+        frame = list_get_head_elem(&flow->frames);
+        if ((int)frame->buf.len > flow->deficit) {
+            flow->deficit += SCHED_QUANTUM;
+            list_remove_elem(flow);
+            list_add_to_tail(&sched->bulk, flow);
+            continue;
+        }
+        frame_queue_pop(&flow->frames);
+        flow->deficit -= frame->buf.len;
+        budget -= frame->buf.len < budget ? frame->buf.len : budget;
+        sched_take(sched, wr, frame);
+        if (flow->frames.count == 0)
+            sched_unlink(flow);
+    }
+
+    return batch_write_submit(wr, stream, crypto, cb);
+}
+
+// the connection is gone: drop every queued frame, flows whose sessions are
+// gone as well are freed, the others stay with their sessions
+void sched_clear(scheduler_t* sched)
+{
+    sched_flow_t* flow = NULL;
+    frame_queue_clear(&sched->control);
+    while ((flow = list_get_head_elem(&sched->fast))) {
+        frame_queue_clear(&flow->frames);
+        sched_unlink(flow);
+    }
+    while ((flow = list_get_head_elem(&sched->bulk))) {
+        frame_queue_clear(&flow->frames);
+        sched_unlink(flow);
+    }
+    sched->count = 0;
+}
@@ -0,0 +1,51 @@
+//
+//  flowsched.h
+//  jedisocks
+//
+//  Outbound frame scheduler of a long connection: control frames first,
+//  then a strict priority lane for interactive sessions, then deficit
+//  round robin across the bulk sessions. While bulk sessions wait, the
+//  interactive lane gets at most SCHED_FAST_SHARE of each flush, so a bulk
+//  transfer on an interactive port cannot starve them.
+//
+
+#ifndef jedisocks_flowsched_h
+#define jedisocks_flowsched_h
+#include "buffer.h"
+
+#define SCHED_QUANTUM (16 * 1024)
+#define SCHED_FLUSH_BUDGET (256 * 1024) // bytes handed to one uv_write
+#define SCHED_FAST_SHARE (SCHED_FLUSH_BUDGET / 2) // ... of which the fast lane may take while bulk waits
+#define SCHED_INTERACTIVE_SIZE 512 // average frame size of an interactive session
+
+// the frames one session queued on a long connection
+typedef struct sched_flow {
+    frame_queue_t frames;
+    int deficit;
+    int avg_size; // moving average of the frame sizes pushed
+    int pinned; // interactive by configuration, never demoted, SCHED_FAST_SHARE bounds it
+    int fast; // served from the fast lane
+    int linked; // has frames, sits on one of the lanes
+    int detached; // the session is gone, free the flow once it drained
+    struct sched_flow* prev;
+    struct sched_flow* next;
+} sched_flow_t;
+
+typedef struct sched_lane {
+    sched_flow_t head;
+} sched_lane_t;
+
+typedef struct scheduler {
+    frame_queue_t control;
+    sched_lane_t fast;
+    sched_lane_t bulk;
+    int count; // frames queued over all lanes
+} scheduler_t;
+
+extern void sched_init(scheduler_t* sched);
+extern sched_flow_t* sched_flow_new(int pinned);
+extern void sched_flow_detach(sched_flow_t* flow);
+extern void sched_push(scheduler_t* sched, sched_flow_t* flow, buf_pool_t* pool, char* mem, char* base, size_t len);
+extern int sched_write(scheduler_t* sched, uv_stream_t* stream, crypto_t* crypto, void* data, uv_write_cb cb);
+extern void sched_clear(scheduler_t* sched);
+#endif
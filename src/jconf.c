@@ -28,6 +28,30 @@ int server_validate_conf(conf_t* conf)
     return 0;
 }
 
+int is_interactive_port(conf_t* conf, uint16_t port)
+{
+    for (int i = 0; i < conf->interactive_port_count; i++)
+        if (conf->interactive_ports[i] == port)
+            return 1;
+    return 0;
+}
+
+// "interactive_ports": [22, 53, 3389]
+static void parse_port_list(char* val, int vlen, conf_t* conf)
+{
+    char* p = val;
+    char* end = val + vlen;
+    while (p < end && conf->interactive_port_count < MAX_INTERACTIVE_PORTS) {
+        if (*p < '0' || *p > '9') {
+            p++;
+            continue;
+        }
+        long port = strtol(p, &p, 10);
+        if (port > 0 && port <= 65535)
+            conf->interactive_ports[conf->interactive_port_count++] = (uint16_t)port;
+    }
+}
+
 void read_conf(char* configfile, conf_t* conf)
 {
     char* val = NULL;
@@ -38,6 +62,12 @@ void read_conf(char* configfile, conf_t* conf)
     char backend_mode_buf[6] = { 0 };
     char pool_size_buf[6] = { 0 };
     char timeout_buf[6] = { 0 };
+    char compress_buf[6] = { 0 };
+    char resume_buf[6] = { 0 };
+    char keepalive_buf[6] = { 0 };
+    char dns_ttl_buf[6] = { 0 };
+    char conn_pool_size_buf[6] = { 0 };
+    char conn_pool_idle_buf[6] = { 0 };
     int vlen = 0;
 
     FILE* f = fopen(configfile, "rb");
@@ -106,8 +136,9 @@ void read_conf(char* configfile, conf_t* conf)
 
             JSONPARSE("gateway_address")
             {
-                conf->centralgw_address = (char*)malloc(vlen);
+                conf->centralgw_address = (char*)malloc(vlen + 1);
                 memcpy(conf->centralgw_address, val, vlen);
+                conf->centralgw_address[vlen] = '\0';
                 conf->centralgw_address_len = vlen;
             }
 
@@ -126,6 +157,77 @@ void read_conf(char* configfile, conf_t* conf)
         conf->timeout = 1000 * atoi(timeout_buf); // transfer ms to s
     }
 
+    JSONPARSE("compress_level")
+    {
+        memcpy(compress_buf, val, vlen < 5 ? vlen : 5);
+        conf->compress_level = atoi(compress_buf);
+        if (conf->compress_level < 0 || conf->compress_level > 9)
+            conf->compress_level = 0;
+    }
+
+    JSONPARSE("resume_timeout")
+    {
+        memcpy(resume_buf, val, vlen < 5 ? vlen : 5);
+        conf->resume_timeout = 1000 * atoi(resume_buf); // s to ms
+    }
+
+    JSONPARSE("keepalive")
+    {
+        memcpy(keepalive_buf, val, vlen < 5 ? vlen : 5);
+        conf->keepalive = 1000 * atoi(keepalive_buf); // s to ms
+    }
+
+    JSONPARSE("dns_ttl")
+    {
+        memcpy(dns_ttl_buf, val, vlen < 5 ? vlen : 5);
+        conf->dns_ttl = 1000 * atoi(dns_ttl_buf); // s to ms
+    }
+
+    JSONPARSE("nameserver")
+    {
+        conf->nameserver = (char*)malloc(vlen + 1);
+        memcpy(conf->nameserver, val, vlen);
+        conf->nameserver[vlen] = '\0';
+    }
+
+    JSONPARSE("dns_snapshot")
+    {
+        conf->dns_snapshot = (char*)malloc(vlen + 1);
+        memcpy(conf->dns_snapshot, val, vlen);
+        conf->dns_snapshot[vlen] = '\0';
+    }
+
+    JSONPARSE("conn_pool_size")
+    {
+        memcpy(conn_pool_size_buf, val, vlen < 5 ? vlen : 5);
+        conf->conn_pool_size = atoi(conn_pool_size_buf);
+    }
+
+    JSONPARSE("conn_pool_idle")
+    {
+        memcpy(conn_pool_idle_buf, val, vlen < 5 ? vlen : 5);
+        conf->conn_pool_idle = 1000 * atoi(conn_pool_idle_buf); // s to ms
+    }
+
+    JSONPARSE("method")
+    {
+        conf->method = (char*)malloc(vlen + 1);
+        memcpy(conf->method, val, vlen);
+        conf->method[vlen] = '\0';
+    }
+
+    JSONPARSE("password")
+    {
+        conf->password = (char*)malloc(vlen + 1);
+        memcpy(conf->password, val, vlen);
+        conf->password[vlen] = '\0';
+    }
+
+    JSONPARSE("interactive_ports")
+    {
+        parse_port_list(val, vlen, conf);
+    }
+
 #undef JSONPARSE
 
     free(configbuf);
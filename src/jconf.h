@@ -14,6 +14,8 @@
 #include <string.h>
 #include <strings.h>
 
+#define MAX_INTERACTIVE_PORTS 32
+
 typedef struct {
     uint16_t localport;
     uint16_t serverport;
@@ -25,9 +27,22 @@ typedef struct {
     int backend_mode;
     int pool_size;
     int timeout;
+    uint16_t interactive_ports[MAX_INTERACTIVE_PORTS];
+    int interactive_port_count;
+    int compress_level; // deflate level for outgoing payloads, 0 = off
+    char* method; // cipher of the long connection, NULL = cleartext
+    char* password;
+    int resume_timeout; // ms sessions of a broken long connection wait for it to come back, 0 = off
+    int keepalive; // ms between pings on a long connection, 0 = off
+    int dns_ttl; // ms js-server keeps resolved names at most, 0 = off
+    char* nameserver; // host[:port] js-server asks instead of those in resolv.conf
+    char* dns_snapshot; // file js-server saves its most used names to, NULL = off
+    int conn_pool_size; // idle connections js-server keeps to each hot destination, 0 = off
+    int conn_pool_idle; // ms before an idle pool connection is replaced
 } conf_t;
 
 extern void read_conf(char* configfile, conf_t* conf);
 extern int server_validate_conf(conf_t* conf);
 extern int local_validate_conf(conf_t* conf);
+extern int is_interactive_port(conf_t* conf, uint16_t port);
 #endif
@@ -15,7 +15,8 @@
 // callback functions
 static void socks_handshake_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf);
 static void socks_handshake_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
-static void socks_write_cb(uv_write_t* req, int status);
+static void socks_reply_cb(uv_write_t* req, int status);
+static void socks_slab_write_cb(uv_write_t* req, int status);
 static void remote_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf);
 static void remote_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
 static void remote_write_cb(uv_write_t* req, int status);
@@ -30,15 +31,32 @@ static void connect_to_remote_cb(uv_connect_t* req, int status);
 static remote_ctx_t* create_new_long_connection(server_ctx_t* listener, int);
 static void remote_exception(remote_ctx_t* remote_ctx);
 static void send_EOF_packet(socks_handshake_t* socks_hsctx, remote_ctx_t* remote_ctx);
+static void remote_send_frame(remote_ctx_t* remote_ctx, sched_flow_t* flow, buf_pool_t* pool, char* mem, char* pkt_buf, size_t len);
+static void send_hello(remote_ctx_t* remote_ctx, uint32_t features);
+static void remote_flush_cb(uv_prepare_t* handle);
+static void remote_flush_closes(remote_ctx_t* remote_ctx);
+static void remote_retry_cb(uv_timer_t* handle);
+static void remote_ping_cb(uv_timer_t* handle);
+static int try_to_connect_remote(remote_ctx_t* ctx);
+static int write_init_addr(remote_ctx_t* remote_ctx, socks_handshake_t* socks_hsctx, char* payload, uint8_t* flags);
+static void socks_send_init(socks_handshake_t* socks_hsctx);
 
 int verbose = 0;
 int log_to_file = 1;
 int total_read = 0;
+
+// handshake replies, CONNECT ones carry an all-zero IPv4 bind address
+static const char socks_method_noauth[] = { SVERSION, METHOD_NOAUTH };
+static const char socks_method_refused[] = { SVERSION, METHOD_UNACCEPTABLE };
+static const char socks_reply_ok[] = { SVERSION, REP_OK, 0, ATYP_IPV4, 0, 0, 0, 0, 0, 0 };
+static const char socks_reply_cmd[] = { SVERSION, CMD_NOT_SUPPORTED, 0, ATYP_IPV4, 0, 0, 0, 0, 0, 0 };
+static const char socks_reply_atyp[] = { SVERSION, ATYP_NOT_SUPPORTED, 0, ATYP_IPV4, 0, 0, 0, 0, 0, 0 };
 int total_written = 0;
 FILE* logfile = NULL;
 
 conf_t conf;
 uv_loop_t* loop;
+read_pools_t read_pools;
 
 static inline int
 session_cmp(const socks_handshake_t* tree_a, const socks_handshake_t* tree_b)
@@ -51,36 +69,293 @@ session_cmp(const socks_handshake_t* tree_a, const socks_handshake_t* tree_b)
 RB_PROTOTYPE(socks_map_tree, socks_handshake, rb_link, session_cmp);
 RB_GENERATE(socks_map_tree, socks_handshake, rb_link, session_cmp);
 
+// a fresh index while the ring holds fewer than SESSION_IDS_REST or a
+// quarter of those handed out, so closed indices rest a while before reuse
+static int session_id_alloc(session_ids_t* ids)
+{
+    uint32_t index;
+    if (ids->free >= SESSION_IDS_REST && ids->free * 4 >= ids->used) {
+        index = ids->ring[ids->head];
+        ids->head = (ids->head + 1) % ids->cap;
+        ids->free--;
+        ids->gen[index] = (ids->gen[index] + 1) & SESSION_GEN_MASK;
+    }
+    else {
+        if (ids->used >= ids->cap) {
+            // unwrap the ring while growing it
+            uint32_t cap = ids->cap ? ids->cap * 2 : SESSION_IDS_MIN;
+            uint8_t* gen = calloc(cap, sizeof(uint8_t));
+            uint32_t* ring = malloc(cap * sizeof(uint32_t));
+            if (gen == NULL || ring == NULL)
+                FATAL("Not enough memory");
+            for (uint32_t i = 0; i < ids->free; i++)
+                ring[i] = ids->ring[(ids->head + i) % ids->cap];
+            if (ids->cap)
+                memcpy(gen, ids->gen, ids->cap);
+            free(ids->gen);
+            free(ids->ring);
+            ids->gen = gen;
+            ids->ring = ring;
+            ids->head = 0;
+            ids->cap = cap;
+        }
+        index = ids->used++;
+    }
+    return (int)(index << SESSION_GEN_BITS | ids->gen[index]);
+}
+
+static void session_id_release(session_ids_t* ids, int session_id)
+{
+    ids->ring[(ids->head + ids->free) % ids->cap] = (uint32_t)session_id >> SESSION_GEN_BITS;
+    ids->free++;
+}
+
+static void flush_handle_after_close_cb(uv_handle_t* handle)
+{
+    free(handle);
+}
+
+static void timer_after_close_cb(uv_handle_t* handle)
+{
+    free(handle);
+}
+
+// sessions suspended by remote_exception() move on to the pool slot's next
+// connection together with their ids. It is dialled at once, then every
+// RECONNECT_DELAY until the sessions give up
+static void remote_adopt_sessions(remote_ctx_t* ctx, remote_ctx_t* old)
+{
+    socks_handshake_t* socks_hsctx = NULL;
+    ctx->socks_map = old->socks_map;
+    RB_INIT(&old->socks_map);
+    ctx->ids = old->ids;
+    memset(&old->ids, 0, sizeof(old->ids));
+    ctx->peer_resume = old->peer_resume; // until the new connection's hello says otherwise
+    RB_FOREACH(socks_hsctx, socks_map_tree, &ctx->socks_map)
+    {
+        socks_hsctx->remote_long = ctx;
+    }
+    ctx->resume_deadline = old->resume_deadline ? old->resume_deadline : uv_now(loop) + conf.resume_timeout;
+    uv_timer_start(ctx->retry_timer, remote_retry_cb, old->resume_deadline ? RECONNECT_DELAY : 0, 0);
+}
+
+// the sessions waited long enough for their connection
+static void remote_drop_sessions(remote_ctx_t* ctx)
+{
+    socks_handshake_t* socks_hsctx = NULL;
+    RB_FOREACH(socks_hsctx, socks_map_tree, &ctx->socks_map)
+    {
+        if (socks_hsctx->suspended)
+            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+    }
+}
+
+static void remote_retry_cb(uv_timer_t* handle)
+{
+    remote_ctx_t* ctx = (remote_ctx_t*)handle->data;
+    uint64_t now = uv_now(loop);
+    if (now >= ctx->resume_deadline) {
+        LOGW("pool connection id: %d did not come back in time, closing its sessions", ctx->rc_index);
+        ctx->resume_deadline = 0;
+        remote_drop_sessions(ctx);
+        return;
+    }
+    if (ctx->connected == RC_OFF && try_to_connect_remote(ctx)) {
+        ctx->connected = RC_OFF;
+        uv_timer_start(handle, remote_retry_cb, RECONNECT_DELAY, 0);
+        return;
+    }
+    // a connect that hangs does not hold the sessions past their deadline
+    uv_timer_start(handle, remote_retry_cb, ctx->resume_deadline - now, 0);
+}
+
 static void remote_after_close_cb(uv_handle_t* handle)
 {
     remote_ctx_t* remote_ctx = (remote_ctx_t*)handle->data;
-    remote_ctx->listen->remote_long[remote_ctx->rc_index] = create_new_long_connection(remote_ctx->listen, remote_ctx->rc_index);
+    remote_ctx_t* next = create_new_long_connection(remote_ctx->listen, remote_ctx->rc_index);
+    remote_ctx->listen->remote_long[remote_ctx->rc_index] = next;
+    next->token = remote_ctx->token;
+    if (!RB_EMPTY(&remote_ctx->socks_map))
+        remote_adopt_sessions(next, remote_ctx);
+    uv_prepare_stop(remote_ctx->flush_handle);
+    uv_close((uv_handle_t*)remote_ctx->flush_handle, flush_handle_after_close_cb);
+    uv_timer_stop(remote_ctx->retry_timer);
+    uv_close((uv_handle_t*)remote_ctx->retry_timer, timer_after_close_cb);
+    uv_close((uv_handle_t*)remote_ctx->ping_timer, timer_after_close_cb);
+    sched_clear(&remote_ctx->sched);
+    slab_unref(remote_ctx->recv_slab);
+    crypto_free(remote_ctx->crypto);
+    free(remote_ctx->ids.gen);
+    free(remote_ctx->ids.ring);
     free(remote_ctx);
 }
 
-static void send_EOF_packet(socks_handshake_t* socks_hsctx, remote_ctx_t* remote_ctx)
+static void send_hello(remote_ctx_t* remote_ctx, uint32_t features)
 {
     int offset = 0;
-    char* pkt_buf = malloc(HDR_LEN);
-    uint32_t session_id = htonl((uint32_t)socks_hsctx->session_id);
-    uint16_t datalen = 0;
-    char rsv = CTL_CLOSE;
+    char* pkt_buf = malloc(HDR_LEN + HELLO_LEN);
+    uint32_t session_id = htonl(HELLO_SESSION);
+    uint8_t rsv = CTL_HELLO;
+    uint16_t datalen = htons(HELLO_LEN);
+    uint8_t atyp = IPV6;
+    uint8_t addrlen = 0;
+    uint16_t version = htons(PROTO_VERSION);
+    uint32_t max_frame = htonl(MAX_FRAME_PAYLOAD);
+    uint32_t features_n;
+    uint64_t token = remote_ctx->token; // opaque to js-server, sent as is
 
+    if (conf.resume_timeout)
+        features |= HELLO_F_RESUME;
+    features_n = htonl(features);
     set_header(pkt_buf, &session_id, ID_LEN, offset);
     set_header(pkt_buf, &rsv, RSV_LEN, offset);
     set_header(pkt_buf, &datalen, DATALEN_LEN, offset);
+    set_payload(pkt_buf, &atyp, ATYP_LEN, offset);
+    set_payload(pkt_buf, &addrlen, ADDRLEN_LEN, offset);
+    set_payload(pkt_buf, &version, sizeof(version), offset);
+    set_payload(pkt_buf, &max_frame, sizeof(max_frame), offset);
+    set_payload(pkt_buf, &features_n, sizeof(features_n), offset);
+    set_payload(pkt_buf, &token, sizeof(token), offset);
+    remote_send_frame(remote_ctx, NULL, NULL, pkt_buf, pkt_buf, HDR_LEN + HELLO_LEN);
+}
+
+// js-server parses compact headers: everything built so far in the legacy
+// format is handed to libuv first, then the switching hello marks where the
+// compact frames start
+static int remote_switch_compact(remote_ctx_t* remote_ctx)
+{
+    while (remote_ctx->sched.count > 0) {
+        int r = sched_write(&remote_ctx->sched, (uv_stream_t*)&remote_ctx->remote, remote_ctx->crypto, remote_ctx, remote_write_cb);
+        if (r)
+            return r;
+    }
+    send_hello(remote_ctx, HELLO_FEATURES | HELLO_F_SWITCH);
+    remote_ctx->compact_tx = 1;
+    return 0;
+}
 
-    //LOGD("session_id = %d session_idno = %d", ctx->session_id, session_id);
+// frames for the long connection are queued on the session's flow (control
+// frames on no flow at all) and leave in a single write per loop iteration,
+// flushed right before the loop polls for I/O again
+static void remote_send_frame(remote_ctx_t* remote_ctx, sched_flow_t* flow, buf_pool_t* pool, char* mem, char* pkt_buf, size_t len)
+{
+    if (remote_ctx->connected != RC_OK) {
+        // suspended sessions catch up with CTL_RESUME once it is back
+        if (pool != NULL)
+            buf_pool_put(pool, mem);
+        else
+            free(mem);
+        return;
+    }
+    sched_push(&remote_ctx->sched, flow, pool, mem, pkt_buf, len);
+    if (!uv_is_active((uv_handle_t*)remote_ctx->flush_handle))
+        uv_prepare_start(remote_ctx->flush_handle, remote_flush_cb);
+}
 
-    write_req_t* wr = (write_req_t*)malloc(sizeof(write_req_t));
-    wr->req.data = remote_ctx;
-    wr->buf = uv_buf_init(pkt_buf, EXP_TO_RECV_LEN);
-    int r = uv_write(&wr->req, (uv_stream_t*)&remote_ctx->remote, &wr->buf, 1, remote_write_cb);
-    if (r) {
-        free(wr->buf.base);
-        free(wr);
+// frames are only handed to libuv while the socket keeps up, otherwise they
+// wait in the scheduler where small sessions can still overtake bulk ones;
+// remote_write_cb restarts the flush once the socket drained
+static void remote_flush_cb(uv_prepare_t* handle)
+{
+    remote_ctx_t* remote_ctx = (remote_ctx_t*)handle->data;
+    if ((remote_ctx->sched.count == 0 && remote_ctx->close_count == 0) || remote_ctx->connected != RC_OK
+        || uv_is_closing((uv_handle_t*)&remote_ctx->remote) || uv_stream_get_write_queue_size((uv_stream_t*)&remote_ctx->remote) > 0) {
+        uv_prepare_stop(handle);
+        return;
+    }
+    remote_flush_closes(remote_ctx);
+    int r = sched_write(&remote_ctx->sched, (uv_stream_t*)&remote_ctx->remote, remote_ctx->crypto, remote_ctx, remote_write_cb);
+    if (remote_ctx->sched.count == 0)
+        uv_prepare_stop(handle);
+    if (r)
+        HANDLECLOSE_RC(&remote_ctx->remote, remote_ctx);
+}
+
+// the closes queued during this loop iteration leave as one frame, ahead of
+// the rest of the flush
+static void remote_flush_closes(remote_ctx_t* remote_ctx)
+{
+    if (remote_ctx->close_count == 0)
+        return;
+    char* pkt_buf = malloc(WIRE_HDR_MAX + remote_ctx->close_count * WIRE_VARINT_MAX);
+    char* payload = pkt_buf + WIRE_HDR_MAX;
+    int len = wire_close_batch_write(payload, remote_ctx->close_ids, remote_ctx->close_count);
+    int hdr_len = wire_hdr_len(remote_ctx->compact_tx, HELLO_SESSION, len);
+    wire_hdr_write(payload - hdr_len, remote_ctx->compact_tx, HELLO_SESSION, CTL_CLOSE_BATCH, 0, len);
+    remote_ctx->close_count = 0;
+    remote_send_frame(remote_ctx, NULL, NULL, pkt_buf, payload - hdr_len, hdr_len + len);
+}
+
+static void send_EOF_packet(socks_handshake_t* socks_hsctx, remote_ctx_t* remote_ctx)
+{
+    // both FINs crossed, js-server ends the session on its own. Nor is
+    // there anyone to tell while the connection is down
+    if ((socks_hsctx->fin_tx && socks_hsctx->shut) || remote_ctx->connected != RC_OK)
+        return;
+
+    // a session with nothing left in the scheduler cannot be overtaken by
+    // its close, which may then travel with the others of this iteration
+    if (remote_ctx->peer_close_batch && (socks_hsctx->flow == NULL || socks_hsctx->flow->frames.count == 0)) {
+        if (remote_ctx->close_count == WIRE_CLOSE_BATCH_MAX)
+            remote_flush_closes(remote_ctx);
+        remote_ctx->close_ids[remote_ctx->close_count++] = socks_hsctx->session_id;
+        if (!uv_is_active((uv_handle_t*)remote_ctx->flush_handle))
+            uv_prepare_start(remote_ctx->flush_handle, remote_flush_cb);
+        return;
+    }
+
+    char* pkt_buf = malloc(WIRE_HDR_MAX);
+    int len = wire_hdr_write(pkt_buf, remote_ctx->compact_tx, socks_hsctx->session_id, CTL_CLOSE, 0, 0);
+
+    // behind whatever the session still has queued
+    remote_send_frame(remote_ctx, socks_hsctx->flow, NULL, pkt_buf, pkt_buf, len);
+}
+
+// tell js-server how many bytes of this session were written to the client,
+// which grants it credit to send that much more
+static void send_window_update(socks_handshake_t* socks_hsctx, remote_ctx_t* remote_ctx)
+{
+    char* pkt_buf = malloc(WIRE_HDR_MAX + WINDOW_LEN);
+    uint32_t consumed = htonl(socks_hsctx->rx_bytes);
+    int offset = wire_hdr_write(pkt_buf, remote_ctx->compact_tx, socks_hsctx->session_id, CTL_WINDOW_UPDATE, 0, WINDOW_LEN);
+    set_payload(pkt_buf, &consumed, WINDOW_LEN, offset);
+    socks_hsctx->rx_reported = socks_hsctx->rx_bytes;
+
+    remote_send_frame(remote_ctx, NULL, NULL, pkt_buf, pkt_buf, offset);
+}
+
+// how much of the session we received and wrote, or the end of the list
+// on session 0
+static void send_resume(remote_ctx_t* remote_ctx, int session_id, uint32_t received, uint32_t written)
+{
+    char* pkt_buf = malloc(WIRE_HDR_MAX + RESUME_LEN);
+    uint32_t received_n = htonl(received);
+    uint32_t written_n = htonl(written);
+    int offset = wire_hdr_write(pkt_buf, remote_ctx->compact_tx, session_id, CTL_RESUME, 0, RESUME_LEN);
+    set_payload(pkt_buf, &received_n, sizeof(received_n), offset);
+    set_payload(pkt_buf, &written_n, sizeof(written_n), offset);
+    remote_send_frame(remote_ctx, NULL, NULL, pkt_buf, pkt_buf, offset);
+}
+
+// a link that stopped answering is declared dead and goes the way of one
+// whose write failed, its sessions wait for the reconnect
+static void remote_ping_cb(uv_timer_t* handle)
+{
+    remote_ctx_t* remote_ctx = (remote_ctx_t*)handle->data;
+    if (remote_ctx->connected != RC_OK || !remote_ctx->peer_pings)
+        return;
+    if (remote_ctx->ping.missed >= PING_MAX_MISSED) {
+        LOGW("pool connection id: %d missed %d pongs (srtt %llu us), reconnecting", remote_ctx->rc_index,
+            remote_ctx->ping.missed, (unsigned long long)remote_ctx->ping.srtt);
         HANDLECLOSE_RC(&remote_ctx->remote, remote_ctx);
+        return;
     }
+    char stamp[PING_LEN];
+    size_t len;
+    ping_stamp(stamp);
+    char* pkt_buf = ping_frame_new(remote_ctx->compact_tx, CTL_PING, stamp, &len);
+    remote_send_frame(remote_ctx, NULL, NULL, pkt_buf, pkt_buf, len);
+    remote_ctx->ping.missed++;
 }
 
 // this will cause corruption because remote_ctx_long is not existed.
@@ -92,37 +367,68 @@ static void socks_after_close_cb(uv_handle_t* handle)
         if (socks_hsctx->remote_long != NULL) {
             send_EOF_packet(socks_hsctx, socks_hsctx->remote_long);
             RB_REMOVE(socks_map_tree, &socks_hsctx->remote_long->socks_map, socks_hsctx);
+            session_id_release(&socks_hsctx->remote_long->ids, socks_hsctx->session_id);
         }
-        // add a comment
+        // the flow is freed by the scheduler once its frames are out
+        sched_flow_detach(socks_hsctx->flow);
+        zframe_free(socks_hsctx->z);
+        replay_free(&socks_hsctx->replay);
         free(socks_hsctx);
     }
     else
         LOGD("socks_after_close_cb: socks_hsctx == NULL?");
 }
 
-static void socks_after_shutdown_cb(uv_shutdown_t* req, int status)
+// js-server's FIN: the client's write side is shut down once everything
+// before it is written. The session ends without a CTL_CLOSE when both
+// directions are done
+static void socks_fin_shutdown_cb(uv_shutdown_t* req, int status)
 {
-    LOGD("socks_after_shutdown_cb");
     socks_handshake_t* socks_hsctx = (socks_handshake_t*)req->data;
-    uv_close((uv_handle_t*)&socks_hsctx->server, socks_after_close_cb);
     free(req);
+    if (status) {
+        if (status != UV_ECANCELED)
+            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+        return;
+    }
+    socks_hsctx->shut = 1;
+    if (socks_hsctx->fin_tx)
+        HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
 }
 
-static void socks_write_cb(uv_write_t* req, int status)
+static void socks_recv_fin(socks_handshake_t* socks_hsctx)
 {
-    write_req_t* wr = (write_req_t*)req;
-    socks_handshake_t* socks_hsctx = (socks_handshake_t*)req->data;
-    if (status) {
-        if (status != UV_ECANCELED) {
-            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
-            LOGW("socks write error status: %s", uv_err_name(status));
-        }
-        else
-            LOGW("socks write canceled due to closing connection");
+    socks_hsctx->fin_rx = 1;
+    uv_shutdown_t* req = malloc(sizeof(uv_shutdown_t));
+    req->data = socks_hsctx;
+    if (uv_shutdown(req, (uv_stream_t*)&socks_hsctx->server, socks_fin_shutdown_cb)) {
+        free(req);
+        HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
     }
-    /* Free the read/write buffer and the request */
-    free(wr->buf.base);
-    free(wr);
+}
+
+// the client is done sending: FIN rides on the session's last queued frame,
+// or on an empty one when everything went out already
+static void socks_send_fin(socks_handshake_t* socks_hsctx, remote_ctx_t* remote_ctx)
+{
+    socks_hsctx->fin_tx = 1;
+    frame_t* tail = list_get_tail_elem(&socks_hsctx->flow->frames);
+    if (tail != NULL) {
+        // queued frames are compact, the scheduler drains before the switch
+        tail->buf.base[0] |= WIRE_FLAG_FIN;
+        return;
+    }
+    char* pkt_buf = malloc(WIRE_HDR_MAX);
+    int len = wire_hdr_write(pkt_buf, 1, socks_hsctx->session_id, CTL_NORMAL, WIRE_FLAG_FIN, 0);
+    remote_send_frame(remote_ctx, socks_hsctx->flow, NULL, pkt_buf, pkt_buf, len);
+}
+
+static void socks_after_shutdown_cb(uv_shutdown_t* req, int status)
+{
+    LOGD("socks_after_shutdown_cb");
+    socks_handshake_t* socks_hsctx = (socks_handshake_t*)req->data;
+    uv_close((uv_handle_t*)&socks_hsctx->server, socks_after_close_cb);
+    free(req);
 }
 
 static void remote_exception(remote_ctx_t* remote_ctx)
@@ -131,15 +437,33 @@ static void remote_exception(remote_ctx_t* remote_ctx)
     uv_read_stop((uv_stream_t*)&remote_ctx->remote);
     if (!uv_is_closing((uv_handle_t*)&remote_ctx->remote)) {
         socks_handshake_t* socks_hsctx = NULL;
+        socks_handshake_t* next = NULL;
+        int resume = conf.resume_timeout && remote_ctx->peer_resume;
+        remote_ctx->connected = RC_CLOSING;
+        uv_timer_stop(remote_ctx->ping_timer);
 
         /* traverse the whole map to stop SOCKS5 reading bufs*/
-        RB_FOREACH(socks_hsctx, socks_map_tree, &remote_ctx->socks_map)
-        {
-            if (socks_hsctx != NULL) {
-                uv_read_stop((uv_stream_t*)&socks_hsctx->server);
-                socks_hsctx->remote_long = NULL;
-                HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+        for (socks_hsctx = RB_MIN(socks_map_tree, &remote_ctx->socks_map); socks_hsctx != NULL; socks_hsctx = next) {
+            next = RB_NEXT(socks_map_tree, &remote_ctx->socks_map, socks_hsctx);
+            uv_read_stop((uv_stream_t*)&socks_hsctx->server);
+            // whatever it had queued is in its replay buffer
+            int pinned = socks_hsctx->flow->pinned;
+            sched_flow_detach(socks_hsctx->flow);
+            socks_hsctx->flow = NULL;
+            if (resume && socks_hsctx->init && !uv_is_closing((uv_handle_t*)&socks_hsctx->server)) {
+                // the session waits for the next connection of this pool
+                // slot, a fresh compression stream and all
+                socks_hsctx->suspended = 1;
+                socks_hsctx->read_paused = 1;
+                socks_hsctx->flow = sched_flow_new(pinned);
+                zframe_free(socks_hsctx->z);
+                socks_hsctx->z = NULL;
+                continue;
             }
+            RB_REMOVE(socks_map_tree, &remote_ctx->socks_map, socks_hsctx);
+            session_id_release(&remote_ctx->ids, socks_hsctx->session_id);
+            socks_hsctx->remote_long = NULL;
+            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
         }
         uv_close((uv_handle_t*)&remote_ctx->remote, remote_after_close_cb);
     }
@@ -148,111 +472,329 @@ static void remote_exception(remote_ctx_t* remote_ctx)
 static void remote_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 {
     remote_ctx_t* ctx = (remote_ctx_t*)handle->data;
-    *buf = uv_buf_init(ctx->recv_buffer, ctx->expect_to_recv);
+    size_t min_space = MIN_READ_SPACE;
+    if (ctx->crypto && ctx->recv_slab) {
+        // make room for the rest of the record in one go
+        size_t pending = ctx->recv_slab->wpos - ctx->recv_slab->rpos;
+        size_t need = crypto_need(ctx->crypto);
+        if (need > pending + min_space)
+            min_space = need - pending;
+    }
+    ctx->recv_slab = slab_reserve(ctx->recv_slab, RECV_SLAB_SIZE, min_space);
+    *buf = uv_buf_init(ctx->recv_slab->data + ctx->recv_slab->wpos, ctx->recv_slab->size - ctx->recv_slab->wpos);
     assert(buf->base != NULL);
 }
 
-static void remote_read_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
+static void socks_slab_write_cb(uv_write_t* req, int status)
 {
-    remote_ctx_t* ctx = (remote_ctx_t*)client->data;
-    if (verbose)
-        LOGD("nread = %d\n", nread);
-    if (unlikely(nread <= 0)) {
-        if (nread == 0)
-            return;
-        HANDLECLOSE_RC(client, ctx);
+    slab_write_req_t* wr = (slab_write_req_t*)req;
+    socks_handshake_t* socks_hsctx = (socks_handshake_t*)req->data;
+    if (status) {
+        if (status != UV_ECANCELED) {
+            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+            LOGW("socks write error status: %s", uv_err_name(status));
+        }
+        else
+            LOGW("socks write canceled due to closing connection");
     }
     else {
-        if (!ctx->reset) {
-            if (verbose)
-                LOGD("reset packet and buffer\n");
-            ctx->reset = 1;
-            ctx->buf_len = 0;
-            ctx->offset = 0;
-            memset(&ctx->tmp_packet, 0, sizeof(tmp_packet_t));
-            ctx->stage = 0;
+        socks_hsctx->rx_bytes += wr->buf.len;
+        if (socks_hsctx->rx_bytes - socks_hsctx->rx_reported >= WINDOW_UPDATE_THRESHOLD
+            && socks_hsctx->remote_long != NULL && !uv_is_closing((uv_handle_t*)&socks_hsctx->server))
+            send_window_update(socks_hsctx, socks_hsctx->remote_long);
+    }
+    slab_unref(wr->slab);
+    free(wr);
+}
+
+// the session is closed in js-server
+static void remote_close_session(remote_ctx_t* ctx, int session_id)
+{
+    socks_handshake_t* exist_ctx = NULL;
+    socks_handshake_t find_ctx;
+    find_ctx.session_id = session_id;
+
+    /* using Apple's map (rb-tree) structure */
+    exist_ctx = RB_FIND(socks_map_tree, &ctx->socks_map, &find_ctx);
+    if (exist_ctx != NULL) {
+        HANDLECLOSE(&exist_ctx->server, socks_after_close_cb);
+    }
+}
+
+// js-server kept the session: resend what it did not receive and carry on
+static void socks_resume(remote_ctx_t* ctx, socks_handshake_t* socks_hsctx, uint32_t received, uint32_t written)
+{
+    socks_hsctx->suspended = 0;
+    if (!replay_covers(&socks_hsctx->replay, received)) {
+        LOGW("js-server cannot resume session id = %d from byte %u", socks_hsctx->session_id, received);
+        HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+        return;
+    }
+    socks_hsctx->tx_acked = written;
+    replay_ack(&socks_hsctx->replay, written);
+    uint32_t from = received;
+    while (from != socks_hsctx->tx_bytes) {
+        char* mem = malloc(WIRE_HDR_MAX + ctx->max_frame);
+        size_t len = replay_copy(&socks_hsctx->replay, from, mem + WIRE_HDR_MAX, ctx->max_frame);
+        int hdr_len = wire_hdr_len(ctx->compact_tx, socks_hsctx->session_id, len);
+        char* pkt_buf = mem + WIRE_HDR_MAX - hdr_len;
+        wire_hdr_write(pkt_buf, ctx->compact_tx, socks_hsctx->session_id, CTL_NORMAL, 0, len);
+        remote_send_frame(ctx, socks_hsctx->flow, NULL, mem, pkt_buf, hdr_len + len);
+        from += len;
+    }
+    if (socks_hsctx->fin_tx && ctx->compact_tx)
+        socks_send_fin(socks_hsctx, ctx);
+    else if (!socks_hsctx->fin_tx && socks_hsctx->tx_bytes - socks_hsctx->tx_acked < SESSION_WINDOW) {
+        socks_hsctx->read_paused = 0;
+        uv_read_start((uv_stream_t*)&socks_hsctx->server, socks_handshake_alloc_cb, socks_handshake_read_cb);
+    }
+}
+
+// the connection is up again: sessions that survived the previous one tell
+// js-server how much of each they got, all of them end up closed if it
+// does not resume sessions
+static void remote_resume_sessions(remote_ctx_t* ctx)
+{
+    socks_handshake_t* socks_hsctx = NULL;
+    uv_timer_stop(ctx->retry_timer);
+    ctx->resume_deadline = 0;
+    if (!ctx->peer_resume) {
+        remote_drop_sessions(ctx);
+        return;
+    }
+    int count = 0;
+    RB_FOREACH(socks_hsctx, socks_map_tree, &ctx->socks_map)
+    {
+        if (socks_hsctx->suspended) {
+            send_resume(ctx, socks_hsctx->session_id, socks_hsctx->rx_seq, socks_hsctx->rx_bytes);
+            socks_hsctx->rx_reported = socks_hsctx->rx_bytes;
+            count++;
         }
+    }
+    send_resume(ctx, HELLO_SESSION, 0, 0);
+    if (count)
+        LOGI("resuming %d sessions (pool connection id: %d)", count, ctx->rc_index);
+}
 
-        if (verbose)
-            LOGD("buf_len before = %d\n", ctx->buf_len);
-        memcpy(ctx->packet_buf + ctx->buf_len, buf->base, nread); // copy current buf to packet_buf
-        ctx->buf_len += nread; // record how much data we put in the packet_buf
-        if (verbose)
-            LOGD("buf_len after = %d\n", ctx->buf_len);
-
-        if (ctx->stage == 0) {
-            if (likely(ctx->buf_len == HDR_LEN)) {
-                get_header(&ctx->tmp_packet.session_id, ctx->packet_buf, ID_LEN, ctx->offset);
-                ctx->tmp_packet.session_id = ntohl((uint32_t)ctx->tmp_packet.session_id);
-                LOGD("session_id = %d\n", ctx->tmp_packet.session_id);
-                get_header(&ctx->tmp_packet.rsv, ctx->packet_buf, RSV_LEN, ctx->offset);
-                get_header(&ctx->tmp_packet.datalen, ctx->packet_buf, DATALEN_LEN, ctx->offset);
-                ctx->tmp_packet.datalen = ntohs((uint16_t)ctx->tmp_packet.datalen);
-                if (verbose)
-                    LOGD("datalen = %d\n", ctx->tmp_packet.datalen);
-                ctx->expect_to_recv = ctx->tmp_packet.datalen;
-                ctx->stage = 1;
-
-                if (ctx->tmp_packet.rsv != CTL_NORMAL) {
-                    ctx->reset = 0;
-                    ctx->expect_to_recv = HDR_LEN;
-                    if (CTL_CLOSE == ctx->tmp_packet.rsv) {
-                        LOGD("received a CTL_CLOSE(0x04) packet -- session in js-server is closed");
-                        socks_handshake_t* exist_ctx = NULL;
-                        socks_handshake_t find_ctx;
-                        find_ctx.session_id = ctx->tmp_packet.session_id;
-
-                        /* using Apple's map (rb-tree) structure */
-                        exist_ctx = RB_FIND(socks_map_tree, &ctx->socks_map, &find_ctx);
-                        if (exist_ctx != NULL) {
-                            HANDLECLOSE(&exist_ctx->server, socks_after_close_cb);
-                        }
-                    }
-                    else if (CTL_CLOSE_ACK == ctx->tmp_packet.rsv) {
-                        // add this session id to available session list
-                        LOGW("Received a CTL_CLOSE_ACK packet");
-                        session_t* avl_session = calloc(1, sizeof(session_t));
-                        avl_session->session_id = ctx->tmp_packet.session_id;
-                        list_add_to_tail(&ctx->avl_session_list, avl_session);
-                    }
+// handle one complete frame, ctx->tmp_packet holds the parsed header
+static void remote_handle_packet(remote_ctx_t* ctx, char* payload)
+{
+    if (ctx->tmp_packet.rsv != CTL_NORMAL) {
+        if (CTL_CLOSE == ctx->tmp_packet.rsv) {
+            LOGD("received a CTL_CLOSE(0x04) packet -- session in js-server is closed");
+            remote_close_session(ctx, ctx->tmp_packet.session_id);
+        }
+        else if (CTL_CLOSE_BATCH == ctx->tmp_packet.rsv) {
+            size_t pos = 0;
+            uint32_t session_id;
+            while (pos < ctx->tmp_packet.datalen) {
+                int n = wire_close_batch_next(payload + pos, ctx->tmp_packet.datalen - pos, &session_id);
+                if (n < 0) {
+                    LOGW("malformed CTL_CLOSE_BATCH from js-server");
+                    break;
                 }
+                pos += n;
+                remote_close_session(ctx, (int)session_id);
+            }
+        }
+        else if (CTL_HELLO == ctx->tmp_packet.rsv && ctx->tmp_packet.datalen >= HELLO_MIN_LEN) {
+            uint32_t max_frame, features = 0;
+            memcpy(&max_frame, payload + 4, sizeof(max_frame));
+            max_frame = ntohl(max_frame);
+            if (ctx->tmp_packet.datalen >= HELLO_V2_LEN) {
+                memcpy(&features, payload + 8, sizeof(features));
+                features = ntohl(features);
             }
-            else {
-                LOGD("< header length... gather more");
-                ctx->expect_to_recv = HDR_LEN - ctx->buf_len;
+            ctx->max_frame = max_frame < MAX_FRAME_PAYLOAD ? max_frame : MAX_FRAME_PAYLOAD;
+            if (ctx->max_frame < LEGACY_FRAME_PAYLOAD)
+                ctx->max_frame = LEGACY_FRAME_PAYLOAD;
+            LOGI("js-server accepts frames of up to %d bytes (pool connection id: %d)", (int)ctx->max_frame, ctx->rc_index);
+            if (features & HELLO_F_SWITCH)
+                ctx->compact_rx = 1;
+            ctx->peer_inflates = (features & HELLO_F_DEFLATE) != 0;
+            ctx->peer_close_batch = (features & HELLO_F_CLOSE_BATCH) != 0;
+            ctx->peer_half_close = (features & HELLO_F_HALF_CLOSE) != 0;
+            ctx->peer_resume = (features & HELLO_F_RESUME) != 0;
+            ctx->peer_pings = (features & HELLO_F_PING) != 0;
+            if ((features & HELLO_F_COMPACT) && !ctx->compact_tx && remote_switch_compact(ctx)) {
+                HANDLECLOSE_RC(&ctx->remote, ctx);
                 return;
             }
+            if (conf.resume_timeout)
+                remote_resume_sessions(ctx);
         }
-        else if (ctx->stage == 1) {
-            if (ctx->buf_len == HDR_LEN + ctx->tmp_packet.datalen) {
-                ctx->reset = 0;
-                socks_handshake_t* socks = NULL;
-                socks_handshake_t find_ctx;
-                find_ctx.session_id = ctx->tmp_packet.session_id;
-                socks = RB_FIND(socks_map_tree, &ctx->socks_map, &find_ctx);
-                if (socks != NULL) {
-                    char* response = malloc(ctx->tmp_packet.datalen);
-                    get_payload(response, ctx->packet_buf, ctx->tmp_packet.datalen, ctx->offset);
-                    write_req_t* wr = malloc(sizeof(write_req_t));
-                    wr->req.data = socks;
-                    wr->buf = uv_buf_init(response, ctx->tmp_packet.datalen);
-                    int r = uv_write(&wr->req, (uv_stream_t*)&socks->server, &wr->buf, 1, socks_write_cb);
-                    UV_WRITE_CHECK(r, wr, &socks->server, socks_after_close_cb);
-                }
-                else {
-                    LOGW("remote_read_cb found nothing in the map\n");
+        else if (CTL_RESUME == ctx->tmp_packet.rsv && ctx->tmp_packet.datalen == RESUME_LEN) {
+            socks_handshake_t* exist_ctx = NULL;
+            socks_handshake_t find_ctx;
+            find_ctx.session_id = ctx->tmp_packet.session_id;
+            exist_ctx = RB_FIND(socks_map_tree, &ctx->socks_map, &find_ctx);
+            if (exist_ctx != NULL && exist_ctx->suspended && !uv_is_closing((uv_handle_t*)&exist_ctx->server)) {
+                uint32_t received, written;
+                memcpy(&received, payload, sizeof(received));
+                memcpy(&written, payload + sizeof(received), sizeof(written));
+                socks_resume(ctx, exist_ctx, ntohl(received), ntohl(written));
+            }
+        }
+        else if (CTL_PING == ctx->tmp_packet.rsv && ctx->tmp_packet.datalen == PING_LEN) {
+            size_t len;
+            char* pkt_buf = ping_frame_new(ctx->compact_tx, CTL_PONG, payload, &len);
+            remote_send_frame(ctx, NULL, NULL, pkt_buf, pkt_buf, len);
+        }
+        else if (CTL_PONG == ctx->tmp_packet.rsv && ctx->tmp_packet.datalen == PING_LEN) {
+            if (ping_answered(&ctx->ping, payload) == 0 && verbose)
+                LOGD("pool connection id: %d rtt %llu us srtt %llu us jitter %llu us", ctx->rc_index,
+                    (unsigned long long)ctx->ping.last, (unsigned long long)ctx->ping.srtt, (unsigned long long)ctx->ping.rttvar);
+        }
+        else if (CTL_WINDOW_UPDATE == ctx->tmp_packet.rsv && ctx->tmp_packet.datalen == WINDOW_LEN) {
+            socks_handshake_t* exist_ctx = NULL;
+            socks_handshake_t find_ctx;
+            find_ctx.session_id = ctx->tmp_packet.session_id;
+            exist_ctx = RB_FIND(socks_map_tree, &ctx->socks_map, &find_ctx);
+            if (exist_ctx != NULL) {
+                uint32_t consumed;
+                memcpy(&consumed, payload, WINDOW_LEN);
+                exist_ctx->tx_acked = ntohl(consumed);
+                replay_ack(&exist_ctx->replay, exist_ctx->tx_acked);
+                if (exist_ctx->read_paused && !exist_ctx->fin_tx && !exist_ctx->suspended && exist_ctx->tx_bytes - exist_ctx->tx_acked < SESSION_WINDOW
+                    && !uv_is_closing((uv_handle_t*)&exist_ctx->server)) {
+                    exist_ctx->read_paused = 0;
+                    uv_read_start((uv_stream_t*)&exist_ctx->server, socks_handshake_alloc_cb, socks_handshake_read_cb);
                 }
-                ctx->expect_to_recv = HDR_LEN;
             }
-            else if (ctx->buf_len < HDR_LEN + ctx->tmp_packet.datalen) {
-                LOGD("< datalen... gather more");
-                ctx->expect_to_recv = HDR_LEN + ctx->tmp_packet.datalen - ctx->buf_len;
+        }
+        return;
+    }
+
+    socks_handshake_t* socks = NULL;
+    socks_handshake_t find_ctx;
+    find_ctx.session_id = ctx->tmp_packet.session_id;
+    socks = RB_FIND(socks_map_tree, &ctx->socks_map, &find_ctx);
+    if (socks != NULL) {
+        // the payload is written straight out of the receive slab, inflated
+        // payloads out of a slab of their own
+        slab_t* slab = NULL;
+        size_t len = ctx->tmp_packet.datalen;
+        if (ctx->tmp_packet.flags & WIRE_FLAG_ZRESET)
+            zframe_reset_rx(socks->z);
+        if (ctx->tmp_packet.flags & WIRE_FLAG_COMPRESSED) {
+            char* out = NULL;
+            int n = zframe_inflate(&socks->z, payload, len, &out);
+            if (n < 0) {
+                LOGW("corrupt compressed frame for session id = %d", socks->session_id);
+                HANDLECLOSE(&socks->server, socks_after_close_cb);
                 return;
             }
-            else {
-                LOGD("impossible! should never reach here (> datalen)\n");
+            if (n > 0) {
+                slab = slab_new(n);
+                memcpy(slab->data, out, n);
+                payload = slab->data;
+            }
+            len = n;
+        }
+        else if (len > 0)
+            slab = slab_ref(ctx->recv_slab);
+        socks->rx_seq += len;
+        if (len > 0) {
+            slab_write_req_t* wr = malloc(sizeof(slab_write_req_t));
+            wr->req.data = socks;
+            wr->slab = slab;
+            wr->buf = uv_buf_init(payload, len);
+            int r = uv_write(&wr->req, (uv_stream_t*)&socks->server, &wr->buf, 1, socks_slab_write_cb);
+            if (r) {
+                slab_unref(wr->slab);
+                free(wr);
+                HANDLECLOSE(&socks->server, socks_after_close_cb);
+                return;
             }
         }
+        if ((ctx->tmp_packet.flags & WIRE_FLAG_FIN) && !socks->fin_rx)
+            socks_recv_fin(socks);
+    }
+    else {
+        LOGW("remote_read_cb found nothing in the map\n");
+    }
+}
+
+// dispatch the complete frames in [data, data + len). Returns the bytes they
+// took up, -1 for a malformed header
+static int remote_parse_frames(remote_ctx_t* ctx, char* data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        wire_hdr_t hdr;
+        char* packet_buf = data + pos;
+        size_t avail = len - pos;
+        // the format may change after a hello, so parse one frame at a time
+        int hdr_len = wire_hdr_parse(packet_buf, avail, ctx->compact_rx, &hdr);
+        if (hdr_len < 0)
+            return -1;
+        if (hdr_len == 0 || avail < hdr_len + hdr.len)
+            break; // partial frame, wait for more
+
+        ctx->tmp_packet.session_id = hdr.session_id;
+        ctx->tmp_packet.rsv = hdr.type;
+        ctx->tmp_packet.flags = hdr.flags;
+        ctx->tmp_packet.datalen = hdr.len;
+        if (verbose)
+            LOGD("session_id = %d datalen = %d\n", ctx->tmp_packet.session_id, ctx->tmp_packet.datalen);
+        pos += hdr_len + hdr.len;
+        remote_handle_packet(ctx, packet_buf + hdr_len);
+        if (uv_is_closing((uv_handle_t*)&ctx->remote))
+            break;
+    }
+    return (int)pos;
+}
+
+// every complete frame in the slab is dispatched in one callback, a trailing
+// partial frame is kept for the next read. On an encrypted connection the
+// frames come in records, each opened in place and holding whole frames
+static void remote_read_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
+{
+    remote_ctx_t* ctx = (remote_ctx_t*)client->data;
+    if (verbose)
+        LOGD("nread = %d\n", nread);
+    if (unlikely(nread <= 0)) {
+        if (nread == 0)
+            return;
+        HANDLECLOSE_RC(client, ctx);
+        return;
+    }
+
+    slab_t* slab = ctx->recv_slab;
+    slab->wpos += nread;
+    if (ctx->crypto == NULL) {
+        int n = remote_parse_frames(ctx, slab->data + slab->rpos, slab->wpos - slab->rpos);
+        if (n < 0) {
+            LOGW("malformed frame header from js-server");
+            HANDLECLOSE_RC(client, ctx);
+            return;
+        }
+        slab->rpos += n;
+        return;
+    }
+
+    while (slab->wpos > slab->rpos) {
+        char* plain = NULL;
+        size_t plain_len = 0;
+        int n = crypto_open(ctx->crypto, slab->data + slab->rpos, slab->wpos - slab->rpos, &plain, &plain_len);
+        if (n < 0) {
+            LOGW("record from js-server does not authenticate, check method and password");
+            HANDLECLOSE_RC(client, ctx);
+            return;
+        }
+        if (n == 0)
+            break; // partial record
+        slab->rpos += n;
+        if (plain_len == 0)
+            continue;
+        int used = remote_parse_frames(ctx, plain, plain_len);
+        if (uv_is_closing((uv_handle_t*)&ctx->remote))
+            return;
+        if (used != (int)plain_len) {
+            LOGW("record from js-server does not end on a frame boundary");
+            HANDLECLOSE_RC(client, ctx);
+            return;
+        }
     }
 }
 
@@ -269,6 +811,10 @@ static void connect_to_remote_cb(uv_connect_t* req, int status)
     }
     uv_read_start(req->handle, remote_alloc_cb, remote_read_cb);
     ctx->connected = RC_OK;
+    ctx->max_frame = LEGACY_FRAME_PAYLOAD; // until js-server answers the hello
+    send_hello(ctx, HELLO_FEATURES);
+    if (conf.keepalive)
+        uv_timer_start(ctx->ping_timer, remote_ping_cb, conf.keepalive, conf.keepalive);
     LOGI("Connected to gateway (pool connection id: %d)", ctx->rc_index);
     free(req);
 }
@@ -287,6 +833,20 @@ static int try_to_connect_remote(remote_ctx_t* ctx)
     return uv_tcp_connect(remote_conn_req, &ctx->remote, (struct sockaddr*)&remote_addr, connect_to_remote_cb);
 }
 
+// a connection that went a whole keepalive interval without a pong is
+// probably half-open: pass it over for one that answers, if any
+static remote_ctx_t* remote_pick(server_ctx_t* listener, remote_ctx_t* remote_ctx)
+{
+    if (remote_ctx->connected != RC_OK || !ping_suspect(&remote_ctx->ping))
+        return remote_ctx;
+    for (int i = 0; i < listener->rc_pool_size; i++) {
+        remote_ctx_t* other = listener->remote_long[i];
+        if (other != NULL && other->connected == RC_OK && !ping_suspect(&other->ping))
+            return other;
+    }
+    return remote_ctx;
+}
+
 // socks accept callback
 static void socks_accept_cb(uv_stream_t* server, int status)
 {
@@ -325,7 +885,7 @@ static void socks_accept_cb(uv_stream_t* server, int status)
 
     if (likely(listener->remote_long[round_robin_index] != NULL)) {
 
-        remote_ctx_t* remote_ctx = listener->remote_long[round_robin_index];
+        remote_ctx_t* remote_ctx = remote_pick(listener, listener->remote_long[round_robin_index]);
         socks_hsctx->remote_long = remote_ctx;
 
         switch (remote_ctx->connected) {
@@ -336,28 +896,19 @@ static void socks_accept_cb(uv_stream_t* server, int status)
             return;
             break;
         case RC_OK:
+            socks_hsctx->flow = sched_flow_new(0);
             uv_read_start((uv_stream_t*)&socks_hsctx->server, socks_handshake_alloc_cb,
                 socks_handshake_read_cb);
             break;
         case RC_ESTABLISHING:
+        case RC_CLOSING:
             socks_hsctx->remote_long = NULL;
             uv_close((uv_handle_t*)&socks_hsctx->server, socks_after_close_cb);
             return;
             break;
         }
 
-        session_t* avl_session = list_get_head_elem(&socks_hsctx->remote_long->avl_session_list);
-        if (NULL != avl_session) {
-            socks_hsctx->session_id = avl_session->session_id;
-            list_remove_elem(avl_session);
-            free(avl_session);
-            avl_session = NULL;
-        }
-        else {
-            socks_hsctx->session_id = ++socks_hsctx->remote_long->sid;
-            if (socks_hsctx->remote_long->sid == INT_MAX)
-                socks_hsctx->remote_long->sid = 0;
-        }
+        socks_hsctx->session_id = session_id_alloc(&socks_hsctx->remote_long->ids);
 
         socks_handshake_t* cr = RB_INSERT(socks_map_tree, &socks_hsctx->remote_long->socks_map, socks_hsctx);
         if (cr) {
@@ -365,185 +916,342 @@ static void socks_accept_cb(uv_stream_t* server, int status)
             assert(0);
         }
         LOGW("Insert session id = %d into map", socks_hsctx->session_id);
+        if (socks_hsctx->stage == 2)
+            socks_send_init(socks_hsctx);
     }
 
     if (++round_robin_index == listener->rc_pool_size)
         round_robin_index = 0;
 }
 
+// the destination part of a CTL_INIT, written to end right at payload.
+// Compact frames name destinations js-server has seen on this connection by
+// their table index and (re)define a table entry for the others
+static int write_init_addr(remote_ctx_t* remote_ctx, socks_handshake_t* socks_hsctx, char* payload, uint8_t* flags)
+{
+    int addr_len = ATYP_LEN + ADDRLEN_LEN + socks_hsctx->addrlen + PORT_LEN;
+    int index = -1;
+    if (remote_ctx->compact_tx) {
+        for (int i = 0; i < ADDR_TABLE_SIZE; i++) {
+            dest_t* dest = &remote_ctx->addr_table[i];
+            if (dest->atyp == socks_hsctx->atyp && dest->addrlen == (uint8_t)socks_hsctx->addrlen
+                && memcmp(dest->port, socks_hsctx->port, PORT_LEN) == 0
+                && memcmp(dest->host, socks_hsctx->host, dest->addrlen) == 0) {
+                index = i;
+                break;
+            }
+        }
+        if (index >= 0) {
+            payload[-ADDR_INDEX_LEN] = (char)index;
+            return ADDR_INDEX_LEN;
+        }
+        index = remote_ctx->addr_next;
+        remote_ctx->addr_next = (remote_ctx->addr_next + 1) % ADDR_TABLE_SIZE;
+        dest_t* dest = &remote_ctx->addr_table[index];
+        dest->atyp = socks_hsctx->atyp;
+        dest->addrlen = socks_hsctx->addrlen;
+        memcpy(dest->host, socks_hsctx->host, dest->addrlen);
+        memcpy(dest->port, socks_hsctx->port, PORT_LEN);
+        *flags |= WIRE_FLAG_ADDR_DEFINE;
+    }
+
+    int offset = 0;
+    char* addr = payload - addr_len;
+    set_header(addr, &socks_hsctx->atyp, ATYP_LEN, offset);
+    set_header(addr, &socks_hsctx->addrlen, ADDRLEN_LEN, offset);
+    set_header(addr, &socks_hsctx->host, socks_hsctx->addrlen, offset);
+    set_header(addr, &socks_hsctx->port, PORT_LEN, offset);
+    if (index < 0)
+        return addr_len;
+    addr[-ADDR_INDEX_LEN] = (char)index;
+    return ADDR_INDEX_LEN + addr_len;
+}
+
+// the CTL_INIT leaves as soon as the destination is known, without waiting
+// for the client's first payload: js-server resolves and connects while the
+// client is still on its way, and destinations that speak first (SMTP, SSH)
+// get their banner through. It goes on the control queue, which leaves
+// in order ahead of both lanes: the session's payload cannot overtake it,
+// nor can a later INIT referring to (or redefining) the address table
+// entry it defines once the session's flow is demoted to the bulk lane
+static void socks_send_init(socks_handshake_t* socks_hsctx)
+{
+    remote_ctx_t* remote_ctx = socks_hsctx->remote_long;
+    uint8_t flags = 0;
+    socks_hsctx->init = 1;
+    LOGW("Init with session id = %d", socks_hsctx->session_id);
+    socks_hsctx->flow->pinned = is_interactive_port(&conf, ntohs(*(uint16_t*)socks_hsctx->port));
+    char* mem = malloc(HEADROOM);
+    char* payload = mem + HEADROOM;
+    payload -= write_init_addr(remote_ctx, socks_hsctx, payload, &flags);
+    size_t datalen = mem + HEADROOM - payload;
+    int hdr_len = wire_hdr_len(remote_ctx->compact_tx, socks_hsctx->session_id, datalen);
+    char* pkt_buf = payload - hdr_len;
+    wire_hdr_write(pkt_buf, remote_ctx->compact_tx, socks_hsctx->session_id, CTL_INIT, flags, datalen);
+    remote_send_frame(remote_ctx, NULL, NULL, mem, pkt_buf, hdr_len + datalen);
+}
+
+// reads come from read_pools and land HEADROOM bytes into the block so that
+// the frame header can be written right in front of the payload and the
+// block queued as it is. The read size follows the session: bulk transfers
+// climb to the largest frame js-server accepts, quiet ones fall back
 static void socks_handshake_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 {
-    *buf = uv_buf_init((char*)malloc(BUF_SIZE), BUF_SIZE);
-    assert(buf->base != NULL);
+    socks_handshake_t* socks_hsctx = (socks_handshake_t*)handle->data;
+    read_alloc(&read_pools, socks_hsctx->read_class, buf);
+}
+
+// the read buffer with the client's payload at payload goes out as a data
+// frame of the session, the frame header is written into its headroom
+static void socks_send_payload(socks_handshake_t* socks_hsctx, const uv_buf_t* buf, char* payload, size_t len)
+{
+    remote_ctx_t* remote_ctx = socks_hsctx->remote_long;
+    uint8_t flags = 0;
+    // nothing is kept unless js-server resumes sessions, which it has not
+    // said yet on a connection whose hello is unanswered
+    if (conf.resume_timeout && remote_ctx->peer_resume)
+        replay_append(&socks_hsctx->replay, payload, len);
+    else
+        replay_skip(&socks_hsctx->replay, len);
+
+    size_t datalen = len;
+    char* mem = buf->base - HEADROOM;
+    buf_pool_t* pool = &read_pools.pools[socks_hsctx->read_class];
+    if (conf.compress_level && remote_ctx->compact_tx && remote_ctx->peer_inflates
+        && zframe_worth(&socks_hsctx->z, payload, len)) {
+        // the compressed payload goes into a block of the same class
+        char* zmem = buf_pool_get(pool);
+        int zlen = zframe_deflate(socks_hsctx->z, conf.compress_level, payload, len,
+            zmem + HEADROOM, read_class_size(socks_hsctx->read_class));
+        if (zlen >= 0) {
+            buf_pool_put(pool, mem);
+            mem = zmem;
+            payload = zmem + HEADROOM;
+            datalen = zlen;
+            flags |= WIRE_FLAG_COMPRESSED;
+        }
+        else {
+            buf_pool_put(pool, zmem);
+            flags |= WIRE_FLAG_ZRESET;
+        }
+    }
+
+    int hdr_len = wire_hdr_len(remote_ctx->compact_tx, socks_hsctx->session_id, datalen);
+    char* pkt_buf = payload - hdr_len;
+    wire_hdr_write(pkt_buf, remote_ctx->compact_tx, socks_hsctx->session_id, CTL_NORMAL, flags, datalen);
+    if (verbose)
+        SHOW_BUFFER(pkt_buf, hdr_len + datalen);
+
+    // the read buffer itself goes out, it is freed after the write
+    remote_send_frame(remote_ctx, socks_hsctx->flow, pool, mem, pkt_buf, hdr_len + datalen);
+    socks_hsctx->read_class = read_class_adapt(socks_hsctx->read_class, len, remote_ctx->max_frame);
+
+    // out of credit: stop reading the client until js-server has
+    // written enough of this session to its destination
+    socks_hsctx->tx_bytes += len;
+    if (socks_hsctx->tx_bytes - socks_hsctx->tx_acked >= SESSION_WINDOW) {
+        socks_hsctx->read_paused = 1;
+        uv_read_stop((uv_stream_t*)&socks_hsctx->server);
+    }
+}
+
+// one handshake message of the current stage at the front of data: returns
+// the bytes it takes, 0 while it is incomplete and -1 for something that is
+// not SOCKS5. Its reply is pointed to by reply, a refusal ends the session
+// once it is written
+static int socks_handshake_step(socks_handshake_t* socks_hsctx, const uint8_t* data, size_t len, uv_buf_t* reply)
+{
+    if (len < 2)
+        return 0;
+    if (data[0] != SVERSION)
+        return -1;
+
+    if (socks_hsctx->stage == 0) {
+        // VER NMETHODS METHODS
+        size_t need = 2 + data[1];
+        if (len < need)
+            return 0;
+        *reply = uv_buf_init((char*)socks_method_refused, sizeof(socks_method_refused));
+        socks_hsctx->refused = 1;
+        for (int i = 0; i < data[1]; i++) {
+            if (data[2 + i] == METHOD_NOAUTH) {
+                *reply = uv_buf_init((char*)socks_method_noauth, sizeof(socks_method_noauth));
+                socks_hsctx->refused = 0;
+                socks_hsctx->stage = 1;
+                break;
+            }
+        }
+        return need;
+    }
+
+    // VER CMD RSV ATYP DST.ADDR DST.PORT
+    if (len < SOCKS5_REQ_HDR_LEN + 1)
+        return 0;
+    size_t host_off;
+    size_t addrlen;
+    if (data[3] == ATYP_IPV4) {
+        host_off = SOCKS5_REQ_HDR_LEN;
+        addrlen = 4;
+    }
+    else if (data[3] == ATYP_DOMAIN) {
+        host_off = SOCKS5_REQ_HDR_LEN + 1;
+        addrlen = data[SOCKS5_REQ_HDR_LEN];
+    }
+    else if (data[3] == ATYP_IPV6) {
+        host_off = SOCKS5_REQ_HDR_LEN;
+        addrlen = 16;
+    }
+    else {
+        // the rest cannot be parsed, nor does it matter
+        LOGD("ERROR: unexpected atyp");
+        *reply = uv_buf_init((char*)socks_reply_atyp, sizeof(socks_reply_atyp));
+        socks_hsctx->refused = 1;
+        return len;
+    }
+    size_t need = host_off + addrlen + PORT_LEN;
+    if (len < need)
+        return 0;
+    if (data[1] != CONNECT) {
+        *reply = uv_buf_init((char*)socks_reply_cmd, sizeof(socks_reply_cmd));
+        socks_hsctx->refused = 1;
+        return need;
+    }
+    socks_hsctx->atyp = data[3];
+    socks_hsctx->addrlen = addrlen;
+    memcpy(socks_hsctx->host, data + host_off, addrlen);
+    memcpy(socks_hsctx->port, data + host_off + addrlen, PORT_LEN); // network order
+    *reply = uv_buf_init((char*)socks_reply_ok, sizeof(socks_reply_ok));
+    socks_hsctx->stage = 2;
+    return need;
+}
+
+static void socks_reply_cb(uv_write_t* req, int status)
+{
+    socks_handshake_t* socks_hsctx = (socks_handshake_t*)req->data;
+    if (status == UV_ECANCELED) {
+        LOGW("socks write canceled due to closing connection");
+        return;
+    }
+    if (status)
+        LOGW("socks write error status: %s", uv_err_name(status));
+    if (status || socks_hsctx->refused)
+        HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+}
+
+// clients may split handshake messages across reads as well as pipeline
+// the greeting, the CONNECT request and their first payload in one.
+// A partial message waits in hs_buf, the replies to one read leave in one
+// write and what follows the CONNECT request is the session's first data
+// frame. Takes over buf
+static void socks_handshake_input(socks_handshake_t* socks_hsctx, const uv_buf_t* buf, size_t nread)
+{
+    uv_buf_t replies[2];
+    int nreplies = 0;
+    char* data = buf->base;
+    size_t len = nread;
+    total_read += nread;
+    while (socks_hsctx->stage < 2 && !socks_hsctx->refused && len > 0) {
+        char* msg = data;
+        size_t held = socks_hsctx->hs_len;
+        size_t avail = len;
+        if (held > 0) {
+            size_t take = len < SOCKS5_HS_MAX - held ? len : SOCKS5_HS_MAX - held;
+            memcpy(socks_hsctx->hs_buf + held, data, take);
+            msg = socks_hsctx->hs_buf;
+            avail = held + take;
+        }
+        int n = socks_handshake_step(socks_hsctx, (uint8_t*)msg, avail, &replies[nreplies]);
+        if (n < 0) {
+            LOGD("Not a SOCKS5 request, drop n close");
+            read_release(&read_pools, socks_hsctx->read_class, buf);
+            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+            return;
+        }
+        if (n == 0) {
+            // SOCKS5_HS_MAX holds the longest message, so there was room
+            if (held == 0)
+                memcpy(socks_hsctx->hs_buf, data, len);
+            socks_hsctx->hs_len = avail;
+            len = 0;
+            break;
+        }
+        // a message held in part always continues into this read
+        nreplies++;
+        socks_hsctx->hs_len = 0;
+        data += n - held;
+        len -= n - held;
+    }
+
+    if (nreplies > 0) {
+        uv_write_t* req = &socks_hsctx->hs_req[socks_hsctx->hs_writes++];
+        req->data = socks_hsctx;
+        if (uv_write(req, (uv_stream_t*)&socks_hsctx->server, replies, nreplies, socks_reply_cb)) {
+            read_release(&read_pools, socks_hsctx->read_class, buf);
+            HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+            return;
+        }
+    }
+    if (socks_hsctx->refused) {
+        uv_read_stop((uv_stream_t*)&socks_hsctx->server);
+        read_release(&read_pools, socks_hsctx->read_class, buf);
+        return;
+    }
+    if (socks_hsctx->stage == 2 && nreplies > 0)
+        socks_send_init(socks_hsctx);
+    if (socks_hsctx->stage == 2 && len > 0)
+        socks_send_payload(socks_hsctx, buf, data, len);
+    else
+        read_release(&read_pools, socks_hsctx->read_class, buf);
 }
 
 static void socks_handshake_read_cb(uv_stream_t* client, ssize_t nread, const uv_buf_t* buf)
 {
     if (verbose)
         LOGD("nread = %d", nread);
+    socks_handshake_t* socks_hsctx = client->data;
     if (unlikely(nread <= 0)) {
-        if (buf->len)
-            free(buf->base);
+        read_release(&read_pools, socks_hsctx->read_class, buf);
         if (nread == 0)
             return;
-        socks_handshake_t* socks_hsctx = client->data;
+        remote_ctx_t* remote_ctx = socks_hsctx->remote_long;
+        if (nread == UV_EOF && socks_hsctx->stage == 2 && socks_hsctx->init && !socks_hsctx->closing
+            && remote_ctx != NULL && remote_ctx->compact_tx && remote_ctx->peer_half_close) {
+            // half-close: js-server may still have data for the client
+            uv_read_stop(client);
+            socks_send_fin(socks_hsctx, remote_ctx);
+            if (socks_hsctx->shut)
+                HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
+            return;
+        }
         HANDLECLOSE(&socks_hsctx->server, socks_after_close_cb);
         // for debug
         LOGD("A socks5 connection is closed\n");
+        return;
     }
-    else {
-        socks_handshake_t* socks_hsctx = client->data;
-        if (likely(socks_hsctx->stage == 2)) {
-            if (!socks_hsctx->init) {
-                socks_hsctx->init = 1;
-                LOGW("Init with session id = %d", socks_hsctx->session_id);
-                int offset = 0;
-                char* pkt_buf = malloc(ID_LEN + RSV_LEN + DATALEN_LEN + ATYP_LEN + ADDRLEN_LEN
-                    + socks_hsctx->addrlen + PORT_LEN + nread);
-                char rsv = CTL_INIT;
-                uint32_t id_to_send = htonl((uint32_t)(socks_hsctx->session_id));
-                uint16_t datalen_to_send = htons((uint16_t)(ATYP_LEN + ADDRLEN_LEN + socks_hsctx->addrlen + PORT_LEN + nread));
-                set_header(pkt_buf, &id_to_send, ID_LEN, offset);
-                set_header(pkt_buf, &rsv, RSV_LEN, offset);
-                set_header(pkt_buf, &datalen_to_send, DATALEN_LEN, offset);
-                set_header(pkt_buf, &socks_hsctx->atyp, ATYP_LEN, offset);
-                LOGD("pkt_maker atyp %d", socks_hsctx->atyp);
-                set_header(pkt_buf, &socks_hsctx->addrlen, ADDRLEN_LEN, offset);
-                set_header(pkt_buf, &socks_hsctx->host, socks_hsctx->addrlen, offset);
-                set_header(pkt_buf, &socks_hsctx->port, PORT_LEN, offset);
-                set_payload(pkt_buf, buf->base, nread, offset);
-                //SHOW_BUFFER(pkt_buf, nread);
-                if (verbose)
-                    LOGD("now here is buf\n");
-                if (verbose)
-                    SHOW_BUFFER(buf->base, ID_LEN + RSV_LEN + DATALEN_LEN + ATYP_LEN
-                            + ADDRLEN_LEN + socks_hsctx->addrlen + PORT_LEN + nread);
-                if (socks_hsctx->remote_long != NULL) {
-                    write_req_t* wr = (write_req_t*)malloc(sizeof(write_req_t));
-                    wr->req.data = socks_hsctx->remote_long;
-                    wr->buf = uv_buf_init(pkt_buf, ID_LEN + RSV_LEN + DATALEN_LEN + ATYP_LEN
-                            + ADDRLEN_LEN + socks_hsctx->addrlen + PORT_LEN + (unsigned int)nread);
-                    int r = uv_write(&wr->req, (uv_stream_t*)&socks_hsctx->remote_long->remote, &wr->buf, 1, remote_write_cb);
-                    if (r) {
-                        free(wr->buf.base);
-                        free(wr);
-                        HANDLECLOSE_RC(&socks_hsctx->remote_long->remote, socks_hsctx->remote_long);
-                    }
-                }
-                // do not forget freeing buffers
-            }
-            else {
-                // redundant?
-                if (socks_hsctx->closing == 1) {
-                    free(buf->base);
-                    return;
-                }
-                int offset = 0;
-                char* pkt_buf = calloc(1, ID_LEN + RSV_LEN + DATALEN_LEN + nread);
-                char rsv = CTL_NORMAL;
-                uint32_t id_to_send = ntohl((uint32_t)(socks_hsctx->session_id));
-                uint16_t datalen_to_send = ntohs((uint16_t)nread);
-                set_header(pkt_buf, &id_to_send, ID_LEN, offset);
-                set_header(pkt_buf, &rsv, RSV_LEN, offset);
-                set_header(pkt_buf, &datalen_to_send, DATALEN_LEN, offset);
-                set_header(pkt_buf, buf->base, nread, offset);
-                if (verbose)
-                    SHOW_BUFFER(pkt_buf, nread);
-
-                // to add a pointer to refer to long remote connection
-                if (socks_hsctx->remote_long != NULL) {
-                    write_req_t* wr = (write_req_t*)malloc(sizeof(write_req_t));
-                    wr->req.data = socks_hsctx->remote_long;
-                    wr->buf = uv_buf_init(pkt_buf, ID_LEN + RSV_LEN + DATALEN_LEN + (unsigned int)nread);
-                    int r = uv_write(&wr->req, (uv_stream_t*)&socks_hsctx->remote_long->remote, &wr->buf, 1, remote_write_cb);
-                    if (r) {
-                        free(wr->buf.base);
-                        free(wr);
-                        HANDLECLOSE_RC(&socks_hsctx->remote_long->remote, socks_hsctx->remote_long);
-                    }
-                }
-                // do not forget free buffers
-            }
-        }
 
-        if (socks_hsctx->stage == 0) {
-            // received the first SOCKS5 request = in stage 0
-            if (verbose)
-                LOGD("%ld bytes read\n", nread);
-            total_read += nread;
-            char socks_first_req[SOCKS5_FISRT_REQ_SIZE] = { 0x05, 0x01, 0x00 }; // refer to SOCKS5 protocol
-            method_select_response_t* socks_first_resp = malloc(sizeof(method_select_response_t));
-            socks_first_resp->ver = SVERSION;
-            socks_first_resp->method = HEXZERO;
-            int r = memcmp(socks_first_req, buf->base, SOCKS5_FISRT_REQ_SIZE);
-            if (r)
-                LOGD("Not a SOCKS5 request, drop n close");
-
-            write_req_t* wr = (write_req_t*)malloc(sizeof(write_req_t));
-            wr->req.data = socks_hsctx;
-            wr->buf = uv_buf_init((char*)socks_first_resp, sizeof(method_select_response_t));
-            uv_write(&wr->req, client, &wr->buf, 1 /*nbufs*/, socks_write_cb);
-            UV_WRITE_CHECK(r, wr, client, socks_after_close_cb);
-            socks_hsctx->stage = 1;
-            // sent the 1st response -> switch to the stage 1
-        }
-        else if (socks_hsctx->stage == 1) {
-            // received 2nd request in stage 1
-            // here we have to parse the requested domain or ip address, then we store it in hsctx
-            socks5_req_or_resp_t* req = (socks5_req_or_resp_t*)buf->base;
-            char* addr_ptr = &req->atyp + 1;
-            if (req->atyp == ATYP_IPV4) {
-
-                // client requests a ipv4 address
-                socks_hsctx->atyp = ATYP_IPV4;
-                socks_hsctx->addrlen = 4;
-                memcpy(socks_hsctx->host, addr_ptr, 4); // ipv4 copied
-                addr_ptr += 4;
-                memcpy(socks_hsctx->port, addr_ptr, 2); // port copied in network order
-                //                uint16_t p = ntohs(*(uint16_t *)(socks_hsctx->port));
-            }
-            else if (req->atyp == ATYP_DOMAIN) {
-                if (verbose)
-                    LOGD("atyp == 3\n");
-                socks_hsctx->atyp = ATYP_DOMAIN;
-                socks_hsctx->addrlen = *(addr_ptr++);
-                memcpy(socks_hsctx->host, addr_ptr, socks_hsctx->addrlen); // domain name copied
-                addr_ptr += socks_hsctx->addrlen;
-                memcpy(socks_hsctx->port, addr_ptr, 2); // port copied
-            }
-            else
-                LOGD("ERROR: unexpected atyp");
-
-            socks5_req_or_resp_t* resp = calloc(1, sizeof(socks5_req_or_resp_t));
-            memcpy(resp, req, sizeof(socks5_req_or_resp_t) - 4);
-            // only copy the first 4 bytes to save time
-
-            resp->cmd_or_resp = REP_OK;
-            resp->atyp = ATYP_OK;
-
-            write_req_t* wr = (write_req_t*)malloc(sizeof(write_req_t));
-            wr->req.data = socks_hsctx;
-            wr->buf = uv_buf_init((char*)resp, sizeof(socks5_req_or_resp_t));
-            int r = uv_write(&wr->req, client, &wr->buf, 1, socks_write_cb);
-            UV_WRITE_CHECK(r, wr, client, socks_after_close_cb);
-            socks_hsctx->stage = 2;
-        }
-
-        free(buf->base);
+    // redundant?
+    if (socks_hsctx->closing == 1 || socks_hsctx->remote_long == NULL) {
+        read_release(&read_pools, socks_hsctx->read_class, buf);
+        return;
     }
+    if (likely(socks_hsctx->stage == 2))
+        socks_send_payload(socks_hsctx, buf, buf->base, nread);
+    else
+        socks_handshake_input(socks_hsctx, buf, nread);
 }
 
 static void remote_write_cb(uv_write_t* req, int status)
 {
-    write_req_t* wr = (write_req_t*)req;
+    batch_write_req_t* wr = (batch_write_req_t*)req;
     remote_ctx_t* remote_ctx = req->data;
     if (status) {
         HANDLECLOSE_RC(&remote_ctx->remote, remote_ctx);
     }
     assert(wr->req.type == UV_WRITE);
-    /* Free the read/write buffer and the request */
-    free(wr->buf.base);
-    free(wr);
+    /* Free the frames and the request */
+    batch_write_free(wr);
+    if ((remote_ctx->sched.count > 0 || remote_ctx->close_count > 0) && !uv_is_closing((uv_handle_t*)&remote_ctx->remote))
+        uv_prepare_start(remote_ctx->flush_handle, remote_flush_cb);
 }
 
 static remote_ctx_t* create_new_long_connection(server_ctx_t* listener, int index)
@@ -553,14 +1261,25 @@ static remote_ctx_t* create_new_long_connection(server_ctx_t* listener, int inde
         FATAL("Not enough memory");
     }
     remote_ctx_long->rc_index = index;
-    remote_ctx_long->expect_to_recv = HDR_LEN;
     remote_ctx_long->remote.data = remote_ctx_long;
     remote_ctx_long->listen = listener;
     remote_ctx_long->connected = RC_OFF;
 
     RB_INIT(&remote_ctx_long->socks_map);
+    sched_init(&remote_ctx_long->sched);
+    if (crypto_enabled())
+        remote_ctx_long->crypto = crypto_new();
+    remote_ctx_long->flush_handle = malloc(sizeof(uv_prepare_t));
+    remote_ctx_long->flush_handle->data = remote_ctx_long;
+    uv_prepare_init(loop, remote_ctx_long->flush_handle);
+    remote_ctx_long->retry_timer = malloc(sizeof(uv_timer_t));
+    remote_ctx_long->retry_timer->data = remote_ctx_long;
+    uv_timer_init(loop, remote_ctx_long->retry_timer);
+    remote_ctx_long->ping_timer = malloc(sizeof(uv_timer_t));
+    remote_ctx_long->ping_timer->data = remote_ctx_long;
+    uv_timer_init(loop, remote_ctx_long->ping_timer);
     uv_tcp_init(loop, &remote_ctx_long->remote);
-    list_init(&remote_ctx_long->avl_session_list);
+    remote_ctx_long->ids.used = 1; // session 0 carries the hellos
     uv_tcp_nodelay(&remote_ctx_long->remote, 1);
     return remote_ctx_long;
 }
@@ -569,6 +1288,8 @@ int main(int argc, char** argv)
 {
     memset(&conf, '\0', sizeof(conf));
     conf.pool_size = 5; // default pool size = 5
+    conf.resume_timeout = RESUME_TIMEOUT_DEFAULT;
+    conf.keepalive = KEEPALIVE_DEFAULT;
     int c, option_index = 0, daemon = 0;
     char* configfile = NULL;
     opterr = 0;
@@ -614,6 +1335,11 @@ int main(int argc, char** argv)
 
     LOGI("Backend mode = %d (1 = ON, 0 = OFF)", conf.backend_mode);
     LOGI("Connection Pool size = %d", conf.pool_size);
+    if (conf.method != NULL) {
+        if (conf.password == NULL || crypto_setup(conf.method, conf.password))
+            FATAL("Unknown method or no password for the long connection");
+        LOGI("Long connections are encrypted with %s", conf.method);
+    }
 
     if (opterr || argc == 1 || conf.serverport == 0 || conf.server_address == NULL || conf.localport == 0 || conf.local_address == NULL) {
         printf("Error: 1) pass wrong or null args to the program.\n");
@@ -633,6 +1359,7 @@ int main(int argc, char** argv)
 
     loop = malloc(sizeof *loop);
     uv_loop_init(loop);
+    read_pools_init(&read_pools, HEADROOM, MAX_IDLE_BUFS);
 
     char* locallog = "/tmp/local.log";
 
@@ -645,6 +1372,8 @@ int main(int argc, char** argv)
         ERROR("too large pool size!");
     for (int i = 0; i < listener->rc_pool_size; ++i) {
         listener->remote_long[i] = create_new_long_connection(listener, i);
+        if (uv_random(NULL, NULL, &listener->remote_long[i]->token, sizeof(uint64_t), 0, NULL))
+            FATAL("No randomness for the pool connection token");
         try_to_connect_remote(listener->remote_long[i]);
     }
 
@@ -2,16 +2,69 @@
 #define LOCAL_H_
 #include "c_map.h"
 #include "tree.h"
+#include "buffer.h"
+#include "flowsched.h"
+#include "wire.h"
+#include "zframe.h"
+#include "replay.h"
+#include "ping.h"
+#include "socks5.h"
 
-#define INT_MAX 2147483647
 #define BUF_SIZE 2048
 #define CTL_CLOSE 0x04
 #define CTL_INIT 0x01
 #define CTL_NORMAL 0
-#define CTL_CLOSE_ACK 0x03
+#define CTL_CLOSE_ACK 0x03 // ignored, sent by js-server before session ids had generations
+#define CTL_WINDOW_UPDATE 0x05
+#define CTL_HELLO 0x06
+#define CTL_CLOSE_BATCH 0x07 // see wire.h
+#define CTL_RESUME 0x08 // see HELLO_F_RESUME
+#define CTL_PING 0x09 // see ping.h
+#define CTL_PONG 0x0a
+
+// sent on session 0 right after a long connection is up, answered by
+// js-server with its own. The payload starts like an INIT with an
+// unsupported address type (0x04 IPv6, empty address) so that servers
+// predating it ignore the session; then a 16-bit protocol version, the
+// largest frame payload the sender accepts, from version 2 on a feature
+// mask and from version 3 on the 64-bit token of our pool connection, the
+// same across its reconnects (js-server sends zeros). Hellos always use the
+// legacy header
+#define HELLO_SESSION 0
+#define HELLO_MIN_LEN 8 // version 1 stops after the frame size
+#define HELLO_V2_LEN 12 // ... version 2 after the feature mask
+#define HELLO_LEN 20
+#define PROTO_VERSION 3
+#define HELLO_F_COMPACT 0x01 // the sender parses compact headers (wire.h)
+#define HELLO_F_SWITCH 0x02 // the sender's frames after this hello are compact
+#define HELLO_F_DEFLATE 0x04 // the sender inflates compressed frames (zframe.h)
+#define HELLO_F_CLOSE_BATCH 0x08 // the sender takes CTL_CLOSE_BATCH frames
+#define HELLO_F_HALF_CLOSE 0x10 // the sender takes FIN flags (wire.h)
+#define HELLO_F_RESUME 0x20 // the sender keeps sessions across reconnects, when configured to
+#define HELLO_F_PING 0x40 // the sender answers CTL_PING
+#define HELLO_FEATURES (HELLO_F_COMPACT | HELLO_F_DEFLATE | HELLO_F_CLOSE_BATCH | HELLO_F_HALF_CLOSE | HELLO_F_PING)
+#define MAX_FRAME_PAYLOAD READ_SIZE_MAX
+#define LEGACY_FRAME_PAYLOAD BUF_SIZE // what peers without CTL_HELLO accept
+
+// per-session flow control, a peer may have at most SESSION_WINDOW payload
+// bytes of a session that were not written out by the other end yet
+#define SESSION_WINDOW (256 * 1024)
+#define WINDOW_UPDATE_THRESHOLD (SESSION_WINDOW / 4)
+#define WINDOW_LEN 4
+
+// sessions survive a broken long connection for conf.resume_timeout. After
+// the hellos of the new connection we send a CTL_RESUME per session with
+// the payload bytes we received and wrote of it, then an empty one on
+// session 0. js-server answers each it still has with its own and both
+// sides resend the rest from their replay buffers
+#define RESUME_LEN 8
+#define RESUME_TIMEOUT_DEFAULT 0 // off unless configured, replay buffers copy every payload byte
+#define RECONNECT_DELAY 1000 // between attempts to bring a connection back
 
 // packet related MACROs
 #define MAX_PKT_SIZE 8192
+#define RECV_SLAB_SIZE (128 * 1024) // room for at least one max-sized frame plus slack
+#define MIN_READ_SPACE (16 * 1024) // move on to a new slab below this tail space
 #define ID_LEN 4
 #define PKT_LEN 2
 #define RSV_LEN 1
@@ -21,11 +74,16 @@
 #define PORT_LEN 2
 #define HDR_LEN (ID_LEN + RSV_LEN + DATALEN_LEN)
 #define EXP_TO_RECV_LEN (ID_LEN + RSV_LEN + DATALEN_LEN)
+#define MAX_ADDR_LEN 255
+// room in front of client reads for the largest header, a CTL_INIT one
+#define HEADROOM (WIRE_HDR_MAX + ADDR_INDEX_LEN + ATYP_LEN + ADDRLEN_LEN + MAX_ADDR_LEN + PORT_LEN)
+#define MAX_IDLE_BUFS 1024
 
 // remote connection status MACROs
 #define RC_OFF 0
 #define RC_ESTABLISHING 1
 #define RC_OK 2
+#define RC_CLOSING 3
 #define MAX_RC_NUM 100
 
 typedef struct {
@@ -33,6 +91,13 @@ typedef struct {
     uv_buf_t buf;
 } write_req_t;
 
+// a write whose buffer is a payload slice of a receive slab
+typedef struct {
+    uv_write_t req;
+    uv_buf_t buf;
+    slab_t* slab;
+} slab_write_req_t;
+
 typedef struct server_ctx {
     uv_tcp_t server;
     int stage;
@@ -54,6 +119,7 @@ typedef struct send_queue {
 typedef struct tmp_packet {
     int session_id;
     char rsv;
+    uint8_t flags;
     uint16_t datalen;
     char* data;
 } tmp_packet_t;
@@ -67,9 +133,28 @@ typedef struct socks_handshake {
     int session_id;
     int closing;
     int closed;
+    int fin_tx; // the client sent EOF, our FIN is queued
+    int fin_rx; // js-server's FIN arrived, the client's write side is shut down
+    int shut; // ... and the shutdown completed
     char addrlen;
     char host[256]; // to support ipv6
     char port[16];
+    char hs_buf[SOCKS5_HS_MAX]; // a handshake message split across reads
+    int hs_len;
+    uv_write_t hs_req[2]; // a reply write per handshake stage at most
+    int hs_writes;
+    int refused; // the last reply refuses the client, close once it is out
+    uint32_t tx_bytes; // payload bytes sent to js-server
+    uint32_t tx_acked; // ... of which js-server reported written
+    uint32_t rx_bytes; // payload bytes written to the client
+    uint32_t rx_reported; // ... as last reported in a window update
+    uint32_t rx_seq; // payload bytes received from js-server
+    replay_t replay; // sent payload js-server has not written yet
+    int suspended; // on a connection that broke, waiting for CTL_RESUME
+    int read_paused;
+    int read_class; // size class of the next client read
+    zframe_t* z; // compression state, once the session compressed anything
+    sched_flow_t* flow; // frames queued on remote_long
     struct remote_ctx* remote_long;
     struct socks_handshake* prev;
     struct socks_handshake* next;
@@ -81,15 +166,23 @@ typedef struct socks_connection_list {
     socks_handshake_t head;
 } socks_connection_list_t;
 
-typedef struct session {
-    int session_id;
-    struct session* prev;
-    struct session* next;
-} session_t;
+// session ids of a long connection are index << SESSION_GEN_BITS | generation.
+// A closed session's index goes back to a ring and is handed out again
+// oldest first with its generation bumped, so frames js-server sent before
+// it saw our CTL_CLOSE match no session and are dropped
+#define SESSION_GEN_BITS 6
+#define SESSION_GEN_MASK ((1 << SESSION_GEN_BITS) - 1)
+#define SESSION_IDS_MIN 64 // initial capacity
+#define SESSION_IDS_REST 8
 
-typedef struct avl_session_list {
-    session_t head;
-} avl_session_list_t;
+typedef struct session_ids {
+    uint8_t* gen; // current generation of each index
+    uint32_t* ring; // free indices, oldest first
+    uint32_t cap; // of both arrays
+    uint32_t used; // indices handed out at least once, index 0 is the hello's
+    uint32_t head; // of ring
+    uint32_t free; // indices in ring
+} session_ids_t;
 
 typedef struct remote_ctx {
     uv_tcp_t remote;
@@ -98,17 +191,31 @@ typedef struct remote_ctx {
     size_t buffer_len;
     struct socks_map_tree socks_map;
     server_ctx_t* listen;
-    char packet_buf[MAX_PKT_SIZE];
-    char recv_buffer[MAX_PKT_SIZE];
+    slab_t* recv_slab;
+    scheduler_t sched;
+    uv_prepare_t* flush_handle;
     tmp_packet_t tmp_packet;
-    int buf_len;
-    int reset;
-    int offset;
-    int expect_to_recv;
-    uint32_t sid;
-    avl_session_list_t avl_session_list;
+    session_ids_t ids;
     int connected;
     int rc_index;
+    size_t max_frame; // largest frame payload js-server accepts
+    int compact_tx; // frames we send use the compact header
+    int compact_rx; // ... and the ones we receive
+    int peer_inflates; // js-server takes compressed frames
+    dest_t addr_table[ADDR_TABLE_SIZE]; // destinations js-server knows by index
+    int addr_next; // entry to recycle for the next new destination
+    crypto_t* crypto; // NULL when the long connection is not encrypted
+    int peer_close_batch; // js-server takes CTL_CLOSE_BATCH
+    int peer_half_close; // js-server takes FIN flags
+    uint32_t close_ids[WIRE_CLOSE_BATCH_MAX]; // closes leaving with the next flush
+    int close_count;
+    uint64_t token; // names the pool slot to js-server, kept across reconnects
+    int peer_resume; // js-server keeps sessions across reconnects
+    uint64_t resume_deadline; // uv_now() by which suspended sessions give up
+    uv_timer_t* retry_timer;
+    int peer_pings; // js-server answers CTL_PING
+    ping_stats_t ping; // round trip times of this connection
+    uv_timer_t* ping_timer;
 } remote_ctx_t;
 
 #endif
\ No newline at end of file
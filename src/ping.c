@@ -0,0 +1,61 @@
+//
+//  ping.c
+//  jedisocks
+//
+//  Keepalive of a long connection: each side sends a CTL_PING on session 0
+//  every conf.keepalive ms and the other echoes its payload in a CTL_PONG.
+//  The echoed send time gives the round trip time, smoothed the way TCP
+//  does (RFC 6298); a link that leaves PING_MAX_MISSED pings unanswered is
+//  declared dead.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+#include "utils.h"
+#include "wire.h"
+#include "ping.h"
+
+// a CTL_PING or CTL_PONG frame carrying stamp, freed with free() once written
+char* ping_frame_new(int compact, uint8_t type, const char* stamp, size_t* len)
+{
+    char* pkt_buf = malloc(WIRE_HDR_MAX + PING_LEN);
+    int hdr_len = wire_hdr_write(pkt_buf, compact, 0, type, 0, PING_LEN);
+    memcpy(pkt_buf + hdr_len, stamp, PING_LEN);
+    *len = hdr_len + PING_LEN;
+    return pkt_buf;
+}
+
+void ping_stamp(char* stamp)
+{
+    uint64_t now = uv_hrtime();
+    memcpy(stamp, &now, PING_LEN);
+}
+
+// a pong came back with stamp. Returns 0 unless the stamp is not one of ours
+int ping_answered(ping_stats_t* stats, const char* stamp)
+{
+    uint64_t sent, now = uv_hrtime();
+    memcpy(&sent, stamp, PING_LEN);
+    if (sent > now)
+        return -1;
+    uint64_t rtt = (now - sent) / 1000;
+    if (stats->samples++ == 0) {
+        stats->srtt = rtt;
+        stats->rttvar = rtt / 2;
+    }
+    else {
+        uint64_t delta = stats->srtt > rtt ? stats->srtt - rtt : rtt - stats->srtt;
+        stats->rttvar = (3 * stats->rttvar + delta) / 4;
+        stats->srtt = (7 * stats->srtt + rtt) / 8;
+    }
+    stats->last = rtt;
+    stats->missed = 0;
+    return 0;
+}
+
+// probably half-open, new sessions are better off elsewhere
+int ping_suspect(const ping_stats_t* stats)
+{
+    return stats->missed >= PING_SUSPECT_MISSED;
+}
@@ -0,0 +1,34 @@
+//
+//  ping.h
+//  jedisocks
+//
+//  Keepalive of a long connection: each side sends a CTL_PING on session 0
+//  every conf.keepalive ms and the other echoes its payload in a CTL_PONG.
+//  The echoed send time gives the round trip time, smoothed the way TCP
+//  does (RFC 6298); a link that leaves PING_MAX_MISSED pings unanswered is
+//  declared dead.
+//
+
+#ifndef jedisocks_ping_h
+#define jedisocks_ping_h
+#include <stddef.h>
+#include <stdint.h>
+
+#define PING_LEN 8 // the sender's uv_hrtime(), opaque to the other side
+#define PING_MAX_MISSED 3
+#define PING_SUSPECT_MISSED 2 // a whole interval without an answer
+#define KEEPALIVE_DEFAULT 10000
+
+typedef struct ping_stats {
+    uint64_t srtt; // smoothed round trip time, microseconds
+    uint64_t rttvar; // ... and its mean deviation, the jitter
+    uint64_t last; // latest sample
+    uint32_t samples;
+    int missed; // pings sent since the last pong
+} ping_stats_t;
+
+extern char* ping_frame_new(int compact, uint8_t type, const char* stamp, size_t* len);
+extern void ping_stamp(char* stamp);
+extern int ping_answered(ping_stats_t* stats, const char* stamp);
+extern int ping_suspect(const ping_stats_t* stats);
+#endif
@@ -0,0 +1,98 @@
+//
+//  replay.c
+//  jedisocks
+//
+//  The payload a session sent on its long connection that the peer has not
+//  reported written yet, kept to be sent again on the connection replacing
+//  a broken one. Offsets are the session's 32-bit byte counters.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "replay.h"
+
+// the ring is unwrapped into the new buffer while growing it
+static void replay_grow(replay_t* r, uint32_t need)
+{
+    uint32_t cap = r->cap ? r->cap : REPLAY_MIN;
+    while (cap < need)
+        cap *= 2;
+    char* data = malloc(cap);
+    if (data == NULL)
+        FATAL("Not enough memory");
+    replay_copy(r, r->seq, data, r->len);
+    free(r->data);
+    r->data = data;
+    r->cap = cap;
+    r->head = 0;
+}
+
+// flow control keeps a session's unacknowledged bytes within its window
+// plus one read, which bounds the ring
+void replay_append(replay_t* r, const char* data, size_t len)
+{
+    if (r->len + len > r->cap)
+        replay_grow(r, r->len + (uint32_t)len);
+    uint32_t tail = (r->head + r->len) & (r->cap - 1);
+    size_t first = r->cap - tail < len ? r->cap - tail : len;
+    memcpy(r->data + tail, data, first);
+    memcpy(r->data, data + first, len - first);
+    r->len += len;
+}
+
+// len bytes went out without being kept, the stream cannot be resumed from
+// before them
+void replay_skip(replay_t* r, size_t len)
+{
+    r->seq += r->len + (uint32_t)len;
+    r->head = 0;
+    r->len = 0;
+}
+
+// the peer wrote everything before acked, those bytes are never needed again
+void replay_ack(replay_t* r, uint32_t acked)
+{
+    uint32_t n = acked - r->seq;
+    if (n > r->len)
+        return; // stale or bogus, the counters only move forward
+    r->head = (r->head + n) & (r->cap - 1);
+    r->len -= n;
+    r->seq = acked;
+    if (r->len == 0 && r->cap > REPLAY_KEEP) {
+        free(r->data);
+        r->data = NULL;
+        r->cap = 0;
+        r->head = 0;
+    }
+}
+
+// the stream can be resumed from offset from
+int replay_covers(const replay_t* r, uint32_t from)
+{
+    return (uint32_t)(from - r->seq) <= r->len;
+}
+
+// copy up to cap bytes starting at stream offset from, which the replay must
+// cover. Returns the bytes copied
+size_t replay_copy(const replay_t* r, uint32_t from, char* dst, size_t cap)
+{
+    uint32_t skip = from - r->seq;
+    size_t len = r->len - skip < cap ? r->len - skip : cap;
+    if (len == 0)
+        return 0;
+    uint32_t pos = (r->head + skip) & (r->cap - 1);
+    size_t first = r->cap - pos < len ? r->cap - pos : len;
+    memcpy(dst, r->data + pos, first);
+    memcpy(dst + first, r->data, len - first);
+    return len;
+}
+
+void replay_free(replay_t* r)
+{
+    free(r->data);
+    r->data = NULL;
+    r->cap = 0;
+    r->head = 0;
+    r->len = 0;
+}
@@ -0,0 +1,33 @@
+//
+//  replay.h
+//  jedisocks
+//
+//  The payload a session sent on its long connection that the peer has not
+//  reported written yet, kept to be sent again on the connection replacing
+//  a broken one. Offsets are the session's 32-bit byte counters.
+//
+
+#ifndef jedisocks_replay_h
+#define jedisocks_replay_h
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPLAY_MIN (16 * 1024) // initial capacity
+#define REPLAY_KEEP (64 * 1024) // larger buffers are freed once drained
+
+// a ring over data, the oldest byte held is byte seq of the stream
+typedef struct replay {
+    char* data;
+    uint32_t cap; // a power of two
+    uint32_t head; // position of byte seq in data
+    uint32_t len;
+    uint32_t seq;
+} replay_t;
+
+extern void replay_append(replay_t* r, const char* data, size_t len);
+extern void replay_skip(replay_t* r, size_t len);
+extern void replay_ack(replay_t* r, uint32_t acked);
+extern int replay_covers(const replay_t* r, uint32_t from);
+extern size_t replay_copy(const replay_t* r, uint32_t from, char* dst, size_t cap);
+extern void replay_free(replay_t* r);
+#endif
@@ -0,0 +1,710 @@
+//
+//  resolver.c
+//  jedisocks
+//
+//  A DNS client on the event loop. The A and AAAA questions of a name go
+//  out together over UDP to the nameservers of /etc/resolv.conf (or the one
+//  configured), retried round robin on a per-attempt timeout; a truncated
+//  answer is asked again over TCP. Each query asks from sockets of its own,
+//  so every query leaves from a fresh ephemeral port, with random ids. Names
+//  in /etc/hosts are answered without asking anyone.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <uv.h>
+#include "utils.h"
+#include "resolver.h"
+
+#define DNS_HDR_LEN 12
+#define DNS_RR_LEN 10 // type, class, TTL and data length behind the owner name
+#define DNS_TYPE_A 1
+#define DNS_TYPE_CNAME 5
+#define DNS_TYPE_AAAA 28
+#define DNS_TYPE_OPT 41
+#define DNS_CLASS_IN 1
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_TC 0x0200
+#define DNS_FLAG_RD 0x0100
+#define DNS_RCODE_MASK 0x000f
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_MAX_POINTERS 16 // compression pointers followed in one name
+#define DNS_TCP_MAX (2 + 65535) // length prefix and the largest message
+
+typedef struct resolver_server {
+    struct sockaddr_storage addr;
+    struct sockaddr_storage any; // what queries to it bind to
+} resolver_server_t;
+
+typedef struct resolver_host {
+    char name[256]; // lowercase
+    dns_addr_t addr;
+} resolver_host_t;
+
+typedef struct {
+    uv_udp_send_t req;
+    char buf[RESOLVER_QUERY_MAX];
+} resolver_send_t;
+
+typedef struct {
+    uv_write_t req;
+    char buf[2 + RESOLVER_QUERY_MAX];
+} resolver_write_t;
+
+static uv_loop_t* resolver_loop;
+static resolver_server_t servers[RESOLVER_MAX_SERVERS];
+static int server_count;
+static int resolver_timeout = RESOLVER_TIMEOUT;
+static int resolver_attempts = RESOLVER_ATTEMPTS;
+static resolver_host_t* hosts;
+static int host_count;
+
+static void resolver_finish(resolver_query_t* query);
+static void resolver_tcp_start(resolver_question_t* q, resolver_server_t* server);
+
+static inline uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+int resolver_literal(const char* name, dns_addr_t* addr)
+{
+    memset(addr, 0, sizeof(dns_addr_t));
+    if (uv_inet_pton(AF_INET, name, addr->addr) == 0) {
+        addr->family = AF_INET;
+        return 1;
+    }
+    if (uv_inet_pton(AF_INET6, name, addr->addr) == 0) {
+        addr->family = AF_INET6;
+        return 1;
+    }
+    return 0;
+}
+
+// port is in network order
+void resolver_sockaddr(const dns_addr_t* addr, const char* port, struct sockaddr_storage* sa)
+{
+    memset(sa, 0, sizeof(*sa));
+    if (addr->family == AF_INET6) {
+        struct sockaddr_in6* sin6 = (struct sockaddr_in6*)sa;
+        sin6->sin6_family = AF_INET6;
+        memcpy(&sin6->sin6_addr, addr->addr, 16);
+        memcpy(&sin6->sin6_port, port, 2);
+    }
+    else {
+        struct sockaddr_in* sin = (struct sockaddr_in*)sa;
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr.s_addr, addr->addr, 4);
+        memcpy(&sin->sin_port, port, 2);
+    }
+}
+
+// a question for name, which must be a lowercase name without the trailing
+// dot. Returns its length, -1 for a name DNS cannot carry
+static int resolver_build(char* buf, const char* name, uint16_t id, uint16_t qtype)
+{
+    uint8_t* p = (uint8_t*)buf;
+    memset(p, 0, DNS_HDR_LEN);
+    put16(p, id);
+    put16(p + 2, DNS_FLAG_RD);
+    put16(p + 4, 1); // a question
+    put16(p + 10, 1); // ... and the OPT record
+    size_t pos = DNS_HDR_LEN;
+    const char* label = name;
+    while (*label) {
+        const char* dot = strchr(label, '.');
+        size_t len = dot ? (size_t)(dot - label) : strlen(label);
+        if (len == 0 || len > 63 || pos + 1 + len > DNS_HDR_LEN + 254)
+            return -1;
+        p[pos++] = (uint8_t)len;
+        memcpy(p + pos, label, len);
+        pos += len;
+        label += dot ? len + 1 : len;
+    }
+    if (pos == DNS_HDR_LEN)
+        return -1;
+    p[pos++] = 0;
+    put16(p + pos, qtype);
+    put16(p + pos + 2, DNS_CLASS_IN);
+    pos += 4;
+    // EDNS0: root owner, the UDP payload size in place of the class, no
+    // extended flags nor data
+    p[pos++] = 0;
+    put16(p + pos, DNS_TYPE_OPT);
+    put16(p + pos + 2, RESOLVER_UDP_SIZE);
+    memset(p + pos + 4, 0, 6);
+    pos += DNS_RR_LEN;
+    return (int)pos;
+}
+
+// the name at pos of msg in dotted lowercase form. Returns the position
+// behind it, -1 for a malformed name
+static int dns_read_name(const uint8_t* msg, size_t len, size_t pos, char* out)
+{
+    size_t out_len = 0;
+    int next = -1;
+    int jumps = 0;
+    for (;;) {
+        if (pos >= len)
+            return -1;
+        uint8_t label = msg[pos];
+        if ((label & 0xc0) == 0xc0) {
+            if (pos + 1 >= len || ++jumps > DNS_MAX_POINTERS)
+                return -1;
+            if (next < 0)
+                next = (int)pos + 2;
+            pos = (size_t)(label & 0x3f) << 8 | msg[pos + 1];
+            continue;
+        }
+        if (label & 0xc0)
+            return -1;
+        pos++;
+        if (label == 0)
+            break;
+        if (pos + label > len || out_len + label + 2 > 256)
+            return -1;
+        if (out_len > 0)
+            out[out_len++] = '.';
+        for (int i = 0; i < label; i++)
+            out[out_len++] = tolower(msg[pos + i]);
+        pos += label;
+    }
+    out[out_len] = '\0';
+    return next >= 0 ? next : (int)pos;
+}
+
+// ids come from the kernel's random source, a spoofer can neither predict
+// one from those it saw nor narrow it down by the source port
+static uint16_t resolver_random_id(void)
+{
+    uint16_t id;
+    if (uv_random(NULL, NULL, &id, sizeof(id), 0, NULL))
+        id = (uint16_t)(uv_hrtime() >> 4); // the port still has to be guessed
+    return id;
+}
+
+static int resolver_from(const resolver_server_t* server, const struct sockaddr* addr)
+{
+    if (addr->sa_family != server->addr.ss_family)
+        return 0;
+    if (addr->sa_family == AF_INET) {
+        const struct sockaddr_in* a = (const struct sockaddr_in*)addr;
+        const struct sockaddr_in* b = (const struct sockaddr_in*)&server->addr;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    const struct sockaddr_in6* a = (const struct sockaddr_in6*)addr;
+    const struct sockaddr_in6* b = (const struct sockaddr_in6*)&server->addr;
+    return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, 16) == 0;
+}
+
+static void resolver_release(resolver_query_t* query)
+{
+    if (--query->handles == 0)
+        free(query);
+}
+
+static void resolver_udp_close_cb(uv_handle_t* handle)
+{
+    resolver_query_t* query = (resolver_query_t*)handle->data;
+    free(handle);
+    resolver_release(query);
+}
+
+static void resolver_udp_close(resolver_query_t* query)
+{
+    for (int i = 0; i < 2; i++) {
+        if (query->udp[i] != NULL)
+            uv_close((uv_handle_t*)query->udp[i], resolver_udp_close_cb);
+        query->udp[i] = NULL;
+    }
+}
+
+static void resolver_udp_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf);
+static void resolver_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags);
+
+// the socket of the query for the family of server, bound to a port the
+// kernel picks at random. NULL when none can be opened
+static uv_udp_t* resolver_udp(resolver_query_t* query, resolver_server_t* server)
+{
+    int i = server->addr.ss_family == AF_INET6;
+    uv_udp_t* udp = query->udp[i];
+    if (udp != NULL)
+        return udp;
+    udp = malloc(sizeof(uv_udp_t));
+    uv_udp_init(resolver_loop, udp);
+    udp->data = query;
+    query->handles++;
+    int r = uv_udp_bind(udp, (struct sockaddr*)&server->any, 0);
+    if (r == 0)
+        r = uv_udp_recv_start(udp, resolver_udp_alloc_cb, resolver_udp_recv_cb);
+    if (r) {
+        LOGW("dns: cannot open a socket: %s", uv_strerror(r));
+        uv_close((uv_handle_t*)udp, resolver_udp_close_cb);
+        return NULL;
+    }
+    query->udp[i] = udp;
+    return udp;
+}
+
+static void resolver_send_cb(uv_udp_send_t* req, int status)
+{
+    free(req);
+}
+
+// a failed send is left to the timeout, which moves on to the next server
+static void resolver_send(resolver_question_t* q, resolver_server_t* server)
+{
+    uv_udp_t* udp = resolver_udp(q->query, server);
+    if (udp == NULL)
+        return;
+    resolver_send_t* send = malloc(sizeof(resolver_send_t));
+    int len = resolver_build(send->buf, q->query->name, q->id, q->qtype);
+    uv_buf_t buf = uv_buf_init(send->buf, len);
+    if (uv_udp_send(&send->req, udp, &buf, 1, (struct sockaddr*)&server->addr, resolver_send_cb))
+        free(send);
+}
+
+static void resolver_timeout_cb(uv_timer_t* handle);
+
+// the questions still unanswered go to the server of this attempt
+static void resolver_transmit(resolver_query_t* query)
+{
+    resolver_server_t* server = &servers[query->attempt % server_count];
+    for (int i = 0; i < 2; i++) {
+        resolver_question_t* q = &query->questions[i];
+        if (!q->done && q->tcp == NULL)
+            resolver_send(q, server);
+    }
+    uv_timer_start(&query->timer, resolver_timeout_cb, resolver_timeout, 0);
+}
+
+static void resolver_timeout_cb(uv_timer_t* handle)
+{
+    resolver_query_t* query = (resolver_query_t*)handle->data;
+    if (++query->attempt < resolver_attempts * server_count) {
+        resolver_transmit(query);
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        resolver_question_t* q = &query->questions[i];
+        if (!q->done) {
+            q->done = 1;
+            q->status = UV_ETIMEDOUT;
+        }
+    }
+    resolver_finish(query);
+}
+
+static void resolver_add(resolver_query_t* query, uint16_t qtype, const uint8_t* data, uint16_t len)
+{
+    dns_addr_t addr;
+    memset(&addr, 0, sizeof(addr));
+    if (qtype == DNS_TYPE_A && len == 4)
+        addr.family = AF_INET;
+    else if (qtype == DNS_TYPE_AAAA && len == 16)
+        addr.family = AF_INET6;
+    else
+        return;
+    memcpy(addr.addr, data, len);
+    for (int i = 0; i < query->count; i++) {
+        if (memcmp(&query->addrs[i], &addr, sizeof(addr)) == 0)
+            return;
+    }
+    if (query->count < DNS_MAX_ADDRS)
+        query->addrs[query->count++] = addr;
+}
+
+// an answer to q, from server over UDP or over TCP. Answers that do not
+// match the question are ignored, they may be spoofed or late
+static void resolver_answer(resolver_question_t* q, resolver_server_t* server, const uint8_t* msg, size_t len, int over_tcp)
+{
+    resolver_query_t* query = q->query;
+    char name[256];
+    if (len < DNS_HDR_LEN)
+        return;
+    uint16_t flags = get16(msg + 2);
+    if (get16(msg) != q->id || !(flags & DNS_FLAG_QR) || get16(msg + 4) != 1)
+        return;
+    int pos = dns_read_name(msg, len, DNS_HDR_LEN, name);
+    if (pos < 0 || (size_t)pos + 4 > len || strcmp(name, query->name) != 0 || get16(msg + pos) != q->qtype)
+        return;
+    pos += 4;
+    if ((flags & DNS_FLAG_TC) && !over_tcp) {
+        resolver_tcp_start(q, server);
+        return;
+    }
+
+    int rcode = flags & DNS_RCODE_MASK;
+    q->status = 0;
+    if (rcode == DNS_RCODE_NXDOMAIN)
+        q->status = UV_EAI_NONAME;
+    else if (rcode != 0)
+        q->status = UV_EAI_FAIL;
+    else {
+        // the records of our type, and the CNAMEs leading to them
+        int found = 0;
+        int count = get16(msg + 6);
+        for (int i = 0; i < count; i++) {
+            pos = dns_read_name(msg, len, pos, name);
+            if (pos < 0 || (size_t)pos + DNS_RR_LEN > len)
+                break;
+            uint16_t type = get16(msg + pos);
+            uint16_t class = get16(msg + pos + 2);
+            uint32_t ttl = get32(msg + pos + 4);
+            uint16_t rdlen = get16(msg + pos + 8);
+            pos += DNS_RR_LEN;
+            if ((size_t)pos + rdlen > len)
+                break;
+            if (class == DNS_CLASS_IN && (type == q->qtype || type == DNS_TYPE_CNAME)) {
+                if (ttl < query->ttl)
+                    query->ttl = ttl;
+                if (type == q->qtype) {
+                    resolver_add(query, type, msg + pos, rdlen);
+                    found++;
+                }
+            }
+            pos += rdlen;
+        }
+        if (found == 0)
+            q->status = UV_EAI_NODATA;
+    }
+    q->done = 1;
+    if (query->questions[0].done && query->questions[1].done)
+        resolver_finish(query);
+}
+
+static void resolver_udp_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    // answers are parsed right away, one buffer does for all of them
+    static char answer[65536];
+    *buf = uv_buf_init(answer, sizeof(answer));
+}
+
+// the answer may come from any server the query asked, late ones included
+static void resolver_udp_recv_cb(uv_udp_t* handle, ssize_t nread, const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags)
+{
+    resolver_query_t* query = (resolver_query_t*)handle->data;
+    if (nread < DNS_HDR_LEN || addr == NULL)
+        return;
+    resolver_server_t* server = NULL;
+    for (int i = 0; i < server_count && server == NULL; i++) {
+        if (resolver_from(&servers[i], addr))
+            server = &servers[i];
+    }
+    if (server == NULL)
+        return;
+    uint16_t id = get16((uint8_t*)buf->base);
+    for (int i = 0; i < 2; i++) {
+        resolver_question_t* q = &query->questions[i];
+        if (q->id == id && !q->done && q->tcp == NULL) {
+            resolver_answer(q, server, (uint8_t*)buf->base, nread, 0);
+            return;
+        }
+    }
+}
+
+static void resolver_tcp_close_cb(uv_handle_t* handle)
+{
+    resolver_question_t* q = (resolver_question_t*)handle->data;
+    free(q->tcp_buf);
+    q->tcp_buf = NULL;
+    free(handle);
+    resolver_release(q->query);
+}
+
+static void resolver_tcp_close(resolver_question_t* q)
+{
+    if (q->tcp == NULL)
+        return;
+    uv_close((uv_handle_t*)q->tcp, resolver_tcp_close_cb);
+    q->tcp = NULL;
+}
+
+static void resolver_tcp_fail(resolver_question_t* q, int status)
+{
+    q->done = 1;
+    q->status = status;
+    resolver_tcp_close(q);
+    if (q->query->questions[0].done && q->query->questions[1].done)
+        resolver_finish(q->query);
+}
+
+static void resolver_tcp_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+{
+    resolver_question_t* q = (resolver_question_t*)handle->data;
+    if (q->tcp_buf == NULL)
+        q->tcp_buf = malloc(DNS_TCP_MAX);
+    *buf = uv_buf_init(q->tcp_buf + q->tcp_len, DNS_TCP_MAX - q->tcp_len);
+}
+
+static void resolver_tcp_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
+{
+    resolver_question_t* q = (resolver_question_t*)stream->data;
+    if (nread < 0) {
+        resolver_tcp_fail(q, UV_EAI_FAIL);
+        return;
+    }
+    q->tcp_len += nread;
+    if (q->tcp_len < 2 || q->tcp_len < 2 + (size_t)get16((uint8_t*)q->tcp_buf))
+        return;
+    uv_read_stop(stream);
+    resolver_answer(q, NULL, (uint8_t*)q->tcp_buf + 2, get16((uint8_t*)q->tcp_buf), 1);
+    if (!q->done)
+        resolver_tcp_fail(q, UV_EAI_FAIL);
+    else
+        resolver_tcp_close(q);
+}
+
+static void resolver_tcp_write_cb(uv_write_t* req, int status)
+{
+    // a failed write shows as a failed read
+    free(req);
+}
+
+static void resolver_tcp_connect_cb(uv_connect_t* req, int status)
+{
+    resolver_question_t* q = (resolver_question_t*)req->data;
+    free(req);
+    if (status == UV_ECANCELED)
+        return;
+    if (status) {
+        resolver_tcp_fail(q, status);
+        return;
+    }
+    resolver_write_t* wr = malloc(sizeof(resolver_write_t));
+    int len = resolver_build(wr->buf + 2, q->query->name, q->id, q->qtype);
+    put16((uint8_t*)wr->buf, (uint16_t)len);
+    uv_buf_t buf = uv_buf_init(wr->buf, len + 2);
+    if (uv_write(&wr->req, (uv_stream_t*)q->tcp, &buf, 1, resolver_tcp_write_cb)) {
+        free(wr);
+        resolver_tcp_fail(q, UV_EAI_FAIL);
+        return;
+    }
+    uv_read_start((uv_stream_t*)q->tcp, resolver_tcp_alloc_cb, resolver_tcp_read_cb);
+}
+
+// the answer did not fit a datagram, ask the server that said so over TCP
+static void resolver_tcp_start(resolver_question_t* q, resolver_server_t* server)
+{
+    q->tcp = malloc(sizeof(uv_tcp_t));
+    q->tcp->data = q;
+    uv_tcp_init(resolver_loop, q->tcp);
+    q->query->handles++;
+    uv_connect_t* req = malloc(sizeof(uv_connect_t));
+    req->data = q;
+    if (uv_tcp_connect(req, q->tcp, (struct sockaddr*)&server->addr, resolver_tcp_connect_cb)) {
+        free(req);
+        resolver_tcp_fail(q, UV_EAI_FAIL);
+    }
+}
+
+static void resolver_timer_close_cb(uv_handle_t* handle)
+{
+    resolver_release((resolver_query_t*)handle->data);
+}
+
+// addresses of either family make a success, otherwise NXDOMAIN wins over
+// other failures
+static void resolver_finish(resolver_query_t* query)
+{
+    int status = 0;
+    uv_timer_stop(&query->timer);
+    resolver_udp_close(query);
+    for (int i = 0; i < 2; i++) {
+        resolver_question_t* q = &query->questions[i];
+        resolver_tcp_close(q);
+        if (q->status != 0 && (status == 0 || q->status == UV_EAI_NONAME))
+            status = q->status;
+    }
+    if (query->count > 0)
+        status = 0;
+    else if (status == 0)
+        status = UV_EAI_NODATA;
+    if (query->cb != NULL)
+        query->cb(query->data, status, query->addrs, query->count, query->ttl);
+    uv_close((uv_handle_t*)&query->timer, resolver_timer_close_cb);
+}
+
+// NULL for a name DNS cannot carry, cb is not called then
+resolver_query_t* resolver_start(const char* name, resolver_cb cb, void* data)
+{
+    char probe[RESOLVER_QUERY_MAX];
+    resolver_query_t* query = calloc(1, sizeof(resolver_query_t));
+    size_t len = strlen(name);
+    if (len >= sizeof(query->name)) {
+        free(query);
+        return NULL;
+    }
+    for (size_t i = 0; i <= len; i++)
+        query->name[i] = tolower((unsigned char)name[i]);
+    if (len > 0 && query->name[len - 1] == '.')
+        query->name[len - 1] = '\0';
+    if (resolver_build(probe, query->name, 0, DNS_TYPE_A) < 0) {
+        free(query);
+        return NULL;
+    }
+
+    query->cb = cb;
+    query->data = data;
+    query->ttl = UINT32_MAX;
+    query->questions[0].qtype = DNS_TYPE_A;
+    query->questions[1].qtype = DNS_TYPE_AAAA;
+    query->questions[0].id = resolver_random_id();
+    do
+        query->questions[1].id = resolver_random_id();
+    while (query->questions[1].id == query->questions[0].id);
+    query->questions[0].query = query;
+    query->questions[1].query = query;
+    uv_timer_init(resolver_loop, &query->timer);
+    query->timer.data = query;
+    query->handles = 1;
+    resolver_transmit(query);
+    return query;
+}
+
+// the query ends without calling back
+void resolver_cancel(resolver_query_t* query)
+{
+    query->cb = NULL;
+    resolver_finish(query);
+}
+
+int resolver_hosts(const char* name, dns_addr_t* addrs, int max)
+{
+    int count = 0;
+    for (int i = 0; i < host_count && count < max; i++) {
+        if (strcasecmp(hosts[i].name, name) == 0)
+            addrs[count++] = hosts[i].addr;
+    }
+    return count;
+}
+
+static void resolver_add_server(const char* host, int port)
+{
+    if (server_count == RESOLVER_MAX_SERVERS)
+        return;
+    resolver_server_t* server = &servers[server_count];
+    memset(server, 0, sizeof(resolver_server_t));
+    if (uv_ip4_addr(host, port, (struct sockaddr_in*)&server->addr) == 0)
+        uv_ip4_addr("0.0.0.0", 0, (struct sockaddr_in*)&server->any);
+    else if (uv_ip6_addr(host, port, (struct sockaddr_in6*)&server->addr) == 0)
+        uv_ip6_addr("::", 0, (struct sockaddr_in6*)&server->any);
+    else {
+        LOGW("dns: ignoring nameserver %s", host);
+        return;
+    }
+    server_count++;
+}
+
+// host, host:port, [host] or [host]:port
+static void resolver_parse_server(const char* spec)
+{
+    char host[64] = { 0 };
+    int port = RESOLVER_PORT;
+    const char* colon = strrchr(spec, ':');
+    if (spec[0] == '[') {
+        const char* end = strchr(spec, ']');
+        if (end == NULL || end - spec - 1 >= (int)sizeof(host)) {
+            LOGW("dns: ignoring nameserver %s", spec);
+            return;
+        }
+        memcpy(host, spec + 1, end - spec - 1);
+        if (end[1] == ':')
+            port = atoi(end + 2);
+    }
+    else if (colon != NULL && strchr(spec, ':') == colon) {
+        memcpy(host, spec, colon - spec < (int)sizeof(host) - 1 ? colon - spec : (int)sizeof(host) - 1);
+        port = atoi(colon + 1);
+    }
+    else
+        strncpy(host, spec, sizeof(host) - 1);
+    resolver_add_server(host, port);
+}
+
+static void resolver_read_conf(const char* path)
+{
+    char line[512];
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* save = NULL;
+        char* key = strtok_r(line, " \t\r\n", &save);
+        if (key == NULL)
+            continue;
+        if (strcmp(key, "nameserver") == 0) {
+            char* host = strtok_r(NULL, " \t\r\n", &save);
+            if (host != NULL)
+                resolver_add_server(host, RESOLVER_PORT);
+        }
+        else if (strcmp(key, "options") == 0) {
+            char* opt;
+            while ((opt = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+                if (strncmp(opt, "timeout:", 8) == 0 && atoi(opt + 8) > 0)
+                    resolver_timeout = 1000 * atoi(opt + 8);
+                else if (strncmp(opt, "attempts:", 9) == 0 && atoi(opt + 9) > 0)
+                    resolver_attempts = atoi(opt + 9);
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void resolver_read_hosts(const char* path)
+{
+    char line[512];
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char* hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        char* save = NULL;
+        char* addr_str = strtok_r(line, " \t\r\n", &save);
+        dns_addr_t addr;
+        if (addr_str == NULL || !resolver_literal(addr_str, &addr))
+            continue;
+        char* name;
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            size_t len = strlen(name);
+            if (len >= sizeof(hosts->name))
+                continue;
+            hosts = realloc(hosts, (host_count + 1) * sizeof(resolver_host_t));
+            resolver_host_t* host = &hosts[host_count++];
+            for (size_t i = 0; i <= len; i++)
+                host->name[i] = tolower((unsigned char)name[i]);
+            host->addr = addr;
+        }
+    }
+    fclose(f);
+}
+
+// nameserver overrides resolv.conf when set
+void resolver_init(uv_loop_t* loop, const char* nameserver)
+{
+    resolver_loop = loop;
+    resolver_read_hosts(RESOLVER_HOSTS);
+    if (nameserver != NULL)
+        resolver_parse_server(nameserver);
+    else
+        resolver_read_conf(RESOLVER_CONF);
+    if (server_count == 0)
+        resolver_add_server("127.0.0.1", RESOLVER_PORT); // what libc falls back to
+    LOGI("dns: %d nameserver(s), %d ms per attempt, %d attempts, %d names from %s",
+        server_count, resolver_timeout, resolver_attempts, host_count, RESOLVER_HOSTS);
+}
@@ -0,0 +1,68 @@
+//
+//  resolver.h
+//  jedisocks
+//
+//  A DNS client on the event loop. The A and AAAA questions of a name go
+//  out together over UDP to the nameservers of /etc/resolv.conf (or the one
+//  configured), retried round robin on a per-attempt timeout; a truncated
+//  answer is asked again over TCP. Each query asks from sockets of its own,
+//  so every query leaves from a fresh ephemeral port, with random ids. Names
+//  in /etc/hosts are answered without asking anyone.
+//
+
+#ifndef jedisocks_resolver_h
+#define jedisocks_resolver_h
+#include <stdint.h>
+#include <uv.h>
+
+#define DNS_MAX_ADDRS 8 // kept per name
+#define RESOLVER_CONF "/etc/resolv.conf"
+#define RESOLVER_HOSTS "/etc/hosts"
+#define RESOLVER_MAX_SERVERS 3 // as many as resolv.conf honours
+#define RESOLVER_PORT 53
+#define RESOLVER_TIMEOUT 2000 // per attempt, unless resolv.conf says otherwise
+#define RESOLVER_ATTEMPTS 2 // rounds over the servers, likewise
+#define RESOLVER_UDP_SIZE 1232 // answer size advertised with EDNS0
+#define RESOLVER_QUERY_MAX 300 // a question for the longest name, with its OPT record
+
+typedef struct dns_addr {
+    int family; // AF_INET or AF_INET6
+    uint8_t addr[16]; // network order
+} dns_addr_t;
+
+// status is 0 or a libuv error, addrs only live through the call and ttl
+// is the smallest of the records in seconds
+typedef void (*resolver_cb)(void* data, int status, const dns_addr_t* addrs, int count, uint32_t ttl);
+
+typedef struct resolver_question {
+    uint16_t id;
+    uint16_t qtype;
+    int done;
+    int status;
+    uv_tcp_t* tcp; // asked again over TCP after a truncated answer
+    char* tcp_buf; // ... where the answer is read, behind its length
+    size_t tcp_len;
+    struct resolver_query* query;
+} resolver_question_t;
+
+typedef struct resolver_query {
+    char name[256];
+    resolver_question_t questions[2]; // A and AAAA
+    uv_udp_t* udp[2]; // the IPv4 and IPv6 sockets it asks from, opened on first use
+    uv_timer_t timer; // of the current attempt
+    int attempt;
+    int handles; // open handles, the query is freed once they are closed
+    dns_addr_t addrs[DNS_MAX_ADDRS];
+    int count;
+    uint32_t ttl;
+    resolver_cb cb; // NULL once cancelled
+    void* data;
+} resolver_query_t;
+
+extern void resolver_init(uv_loop_t* loop, const char* nameserver);
+extern int resolver_literal(const char* name, dns_addr_t* addr);
+extern void resolver_sockaddr(const dns_addr_t* addr, const char* port, struct sockaddr_storage* sa);
+extern int resolver_hosts(const char* name, dns_addr_t* addrs, int max);
+extern resolver_query_t* resolver_start(const char* name, resolver_cb cb, void* data);
+extern void resolver_cancel(resolver_query_t* query);
+#endif
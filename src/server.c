@@ -16,6 +16,10 @@ int verbose = 0;
 int log_to_file = 1;
 conf_t conf;
 remote_ctx_t find_ctx;
+read_pools_t read_pools;
+buf_pool_t slice_pool;
+server_list_t servers; // every long connection
+resume_group_list_t resume_groups;
 
 // callback functions
 static void remote_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf);
@@ -23,16 +27,28 @@ static void remote_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* b
 static void server_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf);
 static void server_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf);
 static void remote_write_cb(uv_write_t* req, int status);
+static void remote_send_pending(remote_ctx_t* remote_ctx);
+static void remote_after_shutdown_cb(uv_shutdown_t* req, int status);
+static void remote_send_fin(remote_ctx_t* remote_ctx);
 static void remote_after_close_cb(uv_handle_t* handle);
-static void remote_addr_resolved_cb(uv_getaddrinfo_t* resolver, int status, struct addrinfo* res);
+static void remote_addr_resolved_cb(void* data, int status, const dns_addr_t* addrs, int count);
 static void remote_on_connect_cb(uv_connect_t* req, int status);
 static void server_write_cb(uv_write_t* req, int status);
 static void remote_timeout_cb(uv_timer_t* handle);
 
 // customized functions
 static int try_to_connect_remote(remote_ctx_t* remote_ctx);
-static void send_control_packet(const uint32_t session_id, server_ctx_t* server_ctx, const uint8_t cmd);
+static int remote_connect(remote_ctx_t* remote_ctx, const dns_addr_t* addrs, int count);
+static void race_end(connect_race_t* race);
+static void send_control_packet(const uint32_t session_id, server_ctx_t* server_ctx, sched_flow_t* flow, const uint8_t cmd);
 static void server_exception(server_ctx_t* server_ctx);
+static void server_send_frame(server_ctx_t* server_ctx, sched_flow_t* flow, buf_pool_t* pool, char* mem, char* pkt_buf, size_t len);
+static void send_hello(server_ctx_t* server_ctx, uint32_t features);
+static void server_flush_cb(uv_prepare_t* handle);
+static void server_flush_closes(server_ctx_t* server_ctx);
+static void server_close_session(server_ctx_t* ctx, int session_id);
+static void resume_group_expire_cb(uv_timer_t* handle);
+static void remote_close(remote_ctx_t* remote_ctx);
 
 static inline int
 session_cmp(const remote_ctx_t* tree_a, const remote_ctx_t* tree_b)
@@ -45,17 +61,25 @@ session_cmp(const remote_ctx_t* tree_a, const remote_ctx_t* tree_b)
 RB_PROTOTYPE(remote_map_tree, remote_ctx, rb_link, session_cmp);
 RB_GENERATE(remote_map_tree, remote_ctx, rb_link, session_cmp);
 
+// a session still waiting for the name of its destination drops the
+// lookup and goes right away
+static void remote_close(remote_ctx_t* remote_ctx)
+{
+    if (uv_is_closing((uv_handle_t*)&remote_ctx->handle))
+        return;
+    if (remote_ctx->lookup != NULL) {
+        dns_cancel(remote_ctx->lookup);
+        remote_ctx->lookup = NULL;
+    }
+    uv_close((uv_handle_t*)&remote_ctx->handle, remote_after_close_cb);
+}
+
 static void remote_timeout_cb(uv_timer_t* handle)
 {
     LOGW("remote timeout, ready to close remote connection");
     remote_ctx_t* remote_ctx = handle->data;
     if (remote_ctx != NULL) {
-        if (!uv_is_closing((uv_handle_t*)&remote_ctx->handle)) {
-            if (remote_ctx->resolved == 1)
-                uv_close((uv_handle_t*)&remote_ctx->handle, remote_after_close_cb);
-            else
-                remote_ctx->closing = 1;
-        }
+        remote_close(remote_ctx);
     }
 }
 
@@ -64,13 +88,79 @@ static void remote_timer_after_close_cb(uv_handle_t* handle)
     free(handle);
 }
 
+static void flush_handle_after_close_cb(uv_handle_t* handle)
+{
+    free(handle);
+}
+
 static void server_after_close_cb(uv_handle_t* handle)
 {
     server_ctx_t* server_ctx = (server_ctx_t*)handle->data;
+    uv_prepare_stop(server_ctx->flush_handle);
+    uv_close((uv_handle_t*)server_ctx->flush_handle, flush_handle_after_close_cb);
+    uv_close((uv_handle_t*)server_ctx->ping_timer, remote_timer_after_close_cb);
+    sched_clear(&server_ctx->sched);
+    slab_unref(server_ctx->recv_slab);
+    crypto_free(server_ctx->crypto);
+    list_remove_elem(server_ctx);
     free(server_ctx);
     LOGW("server_ctx is closed! Wait clients to establish new long connection...");
 }
 
+static resume_group_t* resume_group_new(uint64_t token)
+{
+    resume_group_t* group = calloc(1, sizeof(resume_group_t));
+    group->token = token;
+    RB_INIT(&group->remote_map);
+    group->timer = malloc(sizeof(uv_timer_t));
+    group->timer->data = group;
+    uv_timer_init(loop, group->timer);
+    uv_timer_start(group->timer, resume_group_expire_cb, conf.resume_timeout, 0);
+    list_add_to_tail(&resume_groups, group);
+    return group;
+}
+
+static void resume_group_free(resume_group_t* group)
+{
+    list_remove_elem(group);
+    uv_timer_stop(group->timer);
+    uv_close((uv_handle_t*)group->timer, remote_timer_after_close_cb);
+    free(group);
+}
+
+// js-local did not come back in time
+static void resume_group_expire_cb(uv_timer_t* handle)
+{
+    resume_group_t* group = (resume_group_t*)handle->data;
+    remote_ctx_t* remote_ctx = NULL;
+    LOGW("%s", "sessions of a broken long connection were not resumed, closing them");
+    while ((remote_ctx = RB_MIN(remote_map_tree, &group->remote_map))) {
+        RB_REMOVE(remote_map_tree, &group->remote_map, remote_ctx);
+        remote_ctx->group = NULL;
+        remote_close(remote_ctx);
+    }
+    resume_group_free(group);
+}
+
+// the session outlives its long connection until js-local resumes it on a
+// new one or the group expires. Destination reads stop, writes of what
+// already arrived go on
+static void server_orphan_session(resume_group_t* group, remote_ctx_t* remote_ctx)
+{
+    int pinned = remote_ctx->flow->pinned;
+    uv_read_stop((uv_stream_t*)&remote_ctx->handle);
+    remote_ctx->read_paused = 1;
+    remote_ctx->suspended = 1;
+    remote_ctx->server_ctx = NULL;
+    remote_ctx->group = group;
+    // its queued frames are in the replay buffer
+    sched_flow_detach(remote_ctx->flow);
+    remote_ctx->flow = sched_flow_new(pinned);
+    zframe_free(remote_ctx->z);
+    remote_ctx->z = NULL;
+    RB_INSERT(remote_map_tree, &group->remote_map, remote_ctx);
+}
+
 static void server_exception(server_ctx_t* server_ctx)
 {
     LOGW("Freeing remote long connection...");
@@ -78,37 +168,192 @@ static void server_exception(server_ctx_t* server_ctx)
     if (!uv_is_closing((uv_handle_t*)&server_ctx->handle)) {
 
         remote_ctx_t* remote_ctx = NULL;
-        RB_FOREACH(remote_ctx, remote_map_tree, &server_ctx->remote_map)
-        {
-            if (remote_ctx != NULL) {
+        uv_timer_stop(server_ctx->ping_timer);
+        remote_ctx_t* next = NULL;
+        resume_group_t* group = NULL;
+        if (conf.resume_timeout && server_ctx->peer_resume && server_ctx->token)
+            group = resume_group_new(server_ctx->token);
+        for (remote_ctx = RB_MIN(remote_map_tree, &server_ctx->remote_map); remote_ctx != NULL; remote_ctx = next) {
+            next = RB_NEXT(remote_map_tree, &server_ctx->remote_map, remote_ctx);
+            if (group != NULL && !uv_is_closing((uv_handle_t*)&remote_ctx->handle) && remote_ctx->closing == 0) {
+                RB_REMOVE(remote_map_tree, &server_ctx->remote_map, remote_ctx);
+                server_orphan_session(group, remote_ctx);
+            }
+            else {
                 uv_read_stop((uv_stream_t*)&remote_ctx->handle);
                 remote_ctx->server_ctx = NULL;
-                if (!uv_is_closing((uv_handle_t*)&remote_ctx->handle) && (remote_ctx->resolved == 1)) {
-                    LOGW("server_exception remote_ctx = %x session_id = %d type = %d", remote_ctx, remote_ctx->session_id, remote_ctx->handle.type);
-                    uv_close((uv_handle_t*)&remote_ctx->handle, remote_after_close_cb);
-                }
+                sched_flow_detach(remote_ctx->flow);
+                remote_ctx->flow = NULL;
+                LOGW("server_exception remote_ctx = %x session_id = %d type = %d", remote_ctx, remote_ctx->session_id, remote_ctx->handle.type);
+                remote_close(remote_ctx);
             }
         }
+        if (group != NULL && RB_EMPTY(&group->remote_map))
+            resume_group_free(group);
 
         uv_close((uv_handle_t*)&server_ctx->handle, server_after_close_cb);
     }
 }
 
-static void send_control_packet(const uint32_t session_id, server_ctx_t* server_ctx, const uint8_t cmd)
+static void send_control_packet(const uint32_t session_id, server_ctx_t* server_ctx, sched_flow_t* flow, const uint8_t cmd)
 {
-    int offset = 0;
-    char* pkt_buf = malloc(HDRLEN);
-    uint32_t session_id_tmp = htonl((uint32_t)session_id);
-    uint16_t datalen = 0;
-    uint8_t rsv = cmd;
+    // a close that cannot overtake anything of its session waits for the
+    // flush and leaves with the other closes of this loop iteration
+    if (cmd == CTL_CLOSE && server_ctx->peer_close_batch && (flow == NULL || flow->frames.count == 0)) {
+        if (server_ctx->close_count == WIRE_CLOSE_BATCH_MAX)
+            server_flush_closes(server_ctx);
+        server_ctx->close_ids[server_ctx->close_count++] = session_id;
+        if (!uv_is_active((uv_handle_t*)server_ctx->flush_handle))
+            uv_prepare_start(server_ctx->flush_handle, server_flush_cb);
+        return;
+    }
+
+    char* pkt_buf = malloc(WIRE_HDR_MAX);
+    int len = wire_hdr_write(pkt_buf, server_ctx->compact_tx, session_id, cmd, 0, 0);
     LOGW("sent control packet session_id = %d", session_id);
 
-    set_header(pkt_buf, &session_id_tmp, ID_LEN, offset);
+    server_send_frame(server_ctx, flow, NULL, pkt_buf, pkt_buf, len);
+}
+
+// tell js-local how many bytes of this session were written to the
+// destination, which grants it credit to send that much more
+static void send_window_update(remote_ctx_t* remote_ctx)
+{
+    server_ctx_t* server_ctx = remote_ctx->server_ctx;
+    char* pkt_buf = malloc(WIRE_HDR_MAX + WINDOW_LEN);
+    uint32_t consumed = htonl(remote_ctx->rx_bytes);
+    int offset = wire_hdr_write(pkt_buf, server_ctx->compact_tx, remote_ctx->session_id, CTL_WINDOW_UPDATE, 0, WINDOW_LEN);
+    set_payload(pkt_buf, &consumed, WINDOW_LEN, offset);
+    remote_ctx->rx_reported = remote_ctx->rx_bytes;
+
+    server_send_frame(server_ctx, NULL, NULL, pkt_buf, pkt_buf, offset);
+}
+
+// how much of the session we received and wrote, the answer to js-local's
+// CTL_RESUME
+static void send_resume(remote_ctx_t* remote_ctx)
+{
+    server_ctx_t* server_ctx = remote_ctx->server_ctx;
+    char* pkt_buf = malloc(WIRE_HDR_MAX + RESUME_LEN);
+    uint32_t received = htonl(remote_ctx->rx_seq);
+    uint32_t written = htonl(remote_ctx->rx_bytes);
+    int offset = wire_hdr_write(pkt_buf, server_ctx->compact_tx, remote_ctx->session_id, CTL_RESUME, 0, RESUME_LEN);
+    set_payload(pkt_buf, &received, sizeof(received), offset);
+    set_payload(pkt_buf, &written, sizeof(written), offset);
+    remote_ctx->rx_reported = remote_ctx->rx_bytes;
+
+    server_send_frame(server_ctx, NULL, NULL, pkt_buf, pkt_buf, offset);
+}
+
+// js-local went quiet: a dead link breaks like one whose read failed, its
+// sessions wait for js-local to come back
+static void server_ping_cb(uv_timer_t* handle)
+{
+    server_ctx_t* server_ctx = (server_ctx_t*)handle->data;
+    if (!server_ctx->peer_pings)
+        return;
+    if (server_ctx->ping.missed >= PING_MAX_MISSED) {
+        LOGW("long connection missed %d pongs (srtt %llu us), closing it", server_ctx->ping.missed,
+            (unsigned long long)server_ctx->ping.srtt);
+        server_exception(server_ctx);
+        return;
+    }
+    char stamp[PING_LEN];
+    size_t len;
+    ping_stamp(stamp);
+    char* pkt_buf = ping_frame_new(server_ctx->compact_tx, CTL_PING, stamp, &len);
+    server_send_frame(server_ctx, NULL, NULL, pkt_buf, pkt_buf, len);
+    server_ctx->ping.missed++;
+}
+
+// a pong carries our stamp back, a ping gets its own echoed
+static void server_handle_ping(server_ctx_t* ctx, char* packet_buf)
+{
+    char* payload = packet_buf + ctx->packet.offset;
+    if (ctx->packet.datalen != PING_LEN)
+        return;
+    if (ctx->packet.rsv == CTL_PING) {
+        size_t len;
+        char* pkt_buf = ping_frame_new(ctx->compact_tx, CTL_PONG, payload, &len);
+        server_send_frame(ctx, NULL, NULL, pkt_buf, pkt_buf, len);
+    }
+    else if (ping_answered(&ctx->ping, payload) == 0)
+        LOGD("long connection rtt %llu us srtt %llu us jitter %llu us", (unsigned long long)ctx->ping.last,
+            (unsigned long long)ctx->ping.srtt, (unsigned long long)ctx->ping.rttvar);
+}
+
+static void send_hello(server_ctx_t* server_ctx, uint32_t features)
+{
+    int offset = 0;
+    char* pkt_buf = malloc(HDRLEN + HELLO_LEN);
+    uint32_t session_id = htonl(HELLO_SESSION);
+    uint8_t rsv = CTL_HELLO;
+    uint16_t datalen = htons(HELLO_LEN);
+    uint8_t atyp = 0x04;
+    uint8_t addrlen = 0;
+    uint16_t version = htons(PROTO_VERSION);
+    uint32_t max_frame = htonl(MAX_FRAME_PAYLOAD);
+    uint32_t features_n;
+    uint64_t token = 0;
+
+    if (conf.resume_timeout)
+        features |= HELLO_F_RESUME;
+    features_n = htonl(features);
+    set_header(pkt_buf, &session_id, ID_LEN, offset);
     set_header(pkt_buf, &rsv, RSV_LEN, offset);
     set_header(pkt_buf, &datalen, DATALEN_LEN, offset);
+    set_payload(pkt_buf, &atyp, ATYP_LEN, offset);
+    set_payload(pkt_buf, &addrlen, ADDRLEN_LEN, offset);
+    set_payload(pkt_buf, &version, sizeof(version), offset);
+    set_payload(pkt_buf, &max_frame, sizeof(max_frame), offset);
+    set_payload(pkt_buf, &features_n, sizeof(features_n), offset);
+    set_payload(pkt_buf, &token, sizeof(token), offset);
+    server_send_frame(server_ctx, NULL, NULL, pkt_buf, pkt_buf, HDRLEN + HELLO_LEN);
+}
 
-    write_req_t* wr = ALLOCATE_W_REQ(server_ctx, pkt_buf, HDRLEN);
-    uv_write(&wr->req, (uv_stream_t*)&server_ctx->handle, &wr->buf, 1, server_write_cb);
+// frames for the long connection are queued on the session's flow (control
+// frames on no flow at all) and leave in a single write per loop iteration,
+// flushed right before the loop polls for I/O again
+static void server_send_frame(server_ctx_t* server_ctx, sched_flow_t* flow, buf_pool_t* pool, char* mem, char* pkt_buf, size_t len)
+{
+    sched_push(&server_ctx->sched, flow, pool, mem, pkt_buf, len);
+    if (!uv_is_active((uv_handle_t*)server_ctx->flush_handle))
+        uv_prepare_start(server_ctx->flush_handle, server_flush_cb);
+}
+
+// the closes queued during this loop iteration as one CTL_CLOSE_BATCH
+static void server_flush_closes(server_ctx_t* server_ctx)
+{
+    if (server_ctx->close_count == 0)
+        return;
+    char* pkt_buf = malloc(WIRE_HDR_MAX + server_ctx->close_count * WIRE_VARINT_MAX);
+    char* payload = pkt_buf + WIRE_HDR_MAX;
+    int len = wire_close_batch_write(payload, server_ctx->close_ids, server_ctx->close_count);
+    int hdr_len = wire_hdr_len(server_ctx->compact_tx, HELLO_SESSION, len);
+    wire_hdr_write(payload - hdr_len, server_ctx->compact_tx, HELLO_SESSION, CTL_CLOSE_BATCH, 0, len);
+    server_ctx->close_count = 0;
+    server_send_frame(server_ctx, NULL, NULL, pkt_buf, payload - hdr_len, hdr_len + len);
+}
+
+// nothing is handed to libuv while an earlier batch is still stuck in the
+// socket, so the scheduler keeps deciding who goes next; server_write_cb
+// restarts the flush
+static void server_flush_cb(uv_prepare_t* handle)
+{
+    server_ctx_t* server_ctx = (server_ctx_t*)handle->data;
+    if ((server_ctx->sched.count == 0 && server_ctx->close_count == 0) || uv_is_closing((uv_handle_t*)&server_ctx->handle)
+        || uv_stream_get_write_queue_size((uv_stream_t*)&server_ctx->handle) > 0) {
+        uv_prepare_stop(handle);
+        return;
+    }
+    server_flush_closes(server_ctx);
+    int r = sched_write(&server_ctx->sched, (uv_stream_t*)&server_ctx->handle, server_ctx->crypto, server_ctx, server_write_cb);
+    if (server_ctx->sched.count == 0)
+        uv_prepare_stop(handle);
+    if (r) {
+        LOGW("write to long connection failed %d", r);
+        server_exception(server_ctx);
+    }
 }
 
 static void remote_after_close_cb(uv_handle_t* handle)
@@ -116,22 +361,30 @@ static void remote_after_close_cb(uv_handle_t* handle)
     remote_ctx_t* remote_ctx = (remote_ctx_t*)handle->data;
     LOGW("remote_close_cb remote_ctx = %x session_id = %d", remote_ctx, remote_ctx->session_id);
     if (remote_ctx != NULL) {
+        if (remote_ctx->race != NULL)
+            race_end(remote_ctx->race);
         uv_timer_stop(remote_ctx->http_timeout);
         remote_ctx->http_timeout->data = NULL;
         uv_close(remote_ctx->http_timeout, remote_timer_after_close_cb);
         remote_ctx->http_timeout = NULL;
         if ((remote_ctx->server_ctx != NULL)) {
             RB_REMOVE(remote_map_tree, &remote_ctx->server_ctx->remote_map, remote_ctx);
-            if (CTL_CLOSE == remote_ctx->ctl_cmd)
-                send_control_packet(remote_ctx->session_id, remote_ctx->server_ctx, CTL_CLOSE_ACK);
-            else if (CTL_NORMAL == remote_ctx->ctl_cmd)
-                send_control_packet(remote_ctx->session_id, remote_ctx->server_ctx, CTL_CLOSE);
+            // a session js-local closed needs no answer, it does not reuse
+            // the id before bumping its generation. Nor does one whose FINs
+            // crossed
+            if (CTL_NORMAL == remote_ctx->ctl_cmd && !(remote_ctx->fin_tx && remote_ctx->shut))
+                send_control_packet(remote_ctx->session_id, remote_ctx->server_ctx, remote_ctx->flow, CTL_CLOSE);
         }
+        else if (remote_ctx->group != NULL)
+            RB_REMOVE(remote_map_tree, &remote_ctx->group->remote_map, remote_ctx);
+        sched_flow_detach(remote_ctx->flow);
+        zframe_free(remote_ctx->z);
+        replay_free(&remote_ctx->replay);
         pending_packet_t* packet_to_free = NULL;
         while ((packet_to_free = list_get_head_elem(&remote_ctx->send_queue))) {
             list_remove_elem(packet_to_free);
-            free(packet_to_free->data);
-            free(packet_to_free);
+            slab_unref(packet_to_free->slab);
+            buf_pool_put(&slice_pool, (char*)packet_to_free);
         }
 
         free(remote_ctx);
@@ -139,10 +392,14 @@ static void remote_after_close_cb(uv_handle_t* handle)
 }
 
 // Notice: watch out each callback function, inappropriate free() leads to disaster
+// destination reads come from read_pools and land HEADROOM bytes into the
+// block, the frame header is written in front of them and the block goes back
+// to its pool once the frame is written to the long connection. The read size
+// grows with bulk transfers up to the largest frame js-local accepts
 static void remote_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 {
-    *buf = uv_buf_init((char*)malloc(BUF_SIZE), BUF_SIZE);
-    assert(buf->base != NULL);
+    remote_ctx_t* remote_ctx = (remote_ctx_t*)handle->data;
+    read_alloc(&read_pools, remote_ctx->read_class, buf);
 }
 
 static void remote_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
@@ -150,10 +407,18 @@ static void remote_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* b
     remote_ctx_t* remote_ctx = (remote_ctx_t*)stream->data;
     if (unlikely(nread <= 0)) {
         LOGD("remote_read_cb: nread <= 0");
-        if (buf->len)
-            free(buf->base);
+        read_release(&read_pools, remote_ctx->read_class, buf);
         if (nread == 0)
             return;
+        server_ctx_t* server_ctx = remote_ctx->server_ctx;
+        if (nread == UV_EOF && server_ctx != NULL && server_ctx->compact_tx && server_ctx->peer_half_close) {
+            // half-close: js-local may still have data for the destination
+            uv_read_stop(stream);
+            remote_send_fin(remote_ctx);
+            if (remote_ctx->shut)
+                HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+            return;
+        }
         remote_ctx->connected = 0;
         HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
     }
@@ -161,30 +426,56 @@ static void remote_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* b
         uv_timer_again(remote_ctx->http_timeout);
         server_ctx_t* server_ctx = remote_ctx->server_ctx;
         if (server_ctx == NULL) {
-            free(buf->base);
+            read_release(&read_pools, remote_ctx->read_class, buf);
             return;
         }
 
-        int offset = 0;
-        int packet_len = ID_LEN + RSV_LEN + DATALEN_LEN + nread;
-        char* pkt_buf = malloc(packet_len);
-        uint32_t session_id = htonl((uint32_t)remote_ctx->session_id);
-        uint16_t datalen = htons((uint16_t)nread);
-        uint8_t rsv = CTL_NORMAL;
-        set_header(pkt_buf, &session_id, ID_LEN, offset);
-        set_header(pkt_buf, &rsv, RSV_LEN, offset);
-        set_header(pkt_buf, &datalen, DATALEN_LEN, offset);
-        set_payload(pkt_buf, buf->base, nread, offset);
-        write_req_t* req = ALLOCATE_W_REQ(server_ctx, pkt_buf, packet_len);
-        uv_write(&req->req, (uv_stream_t*)&remote_ctx->server_ctx->handle, &req->buf, 1, server_write_cb);
+        char* mem = buf->base - HEADROOM;
+        char* payload = buf->base;
+        size_t datalen = nread;
+        uint8_t flags = 0;
+        buf_pool_t* pool = &read_pools.pools[remote_ctx->read_class];
+        if (conf.resume_timeout && server_ctx->peer_resume)
+            replay_append(&remote_ctx->replay, payload, nread);
+        if (conf.compress_level && server_ctx->compact_tx && server_ctx->peer_inflates
+            && zframe_worth(&remote_ctx->z, payload, nread)) {
+            // the compressed payload goes into a block of the same class
+            char* zmem = buf_pool_get(pool);
+            int zlen = zframe_deflate(remote_ctx->z, conf.compress_level, payload, nread,
+                zmem + HEADROOM, read_class_size(remote_ctx->read_class));
+            if (zlen >= 0) {
+                buf_pool_put(pool, mem);
+                mem = zmem;
+                payload = zmem + HEADROOM;
+                datalen = zlen;
+                flags |= WIRE_FLAG_COMPRESSED;
+            }
+            else {
+                buf_pool_put(pool, zmem);
+                flags |= WIRE_FLAG_ZRESET;
+            }
+        }
+
+        int hdr_len = wire_hdr_len(server_ctx->compact_tx, remote_ctx->session_id, datalen);
+        char* pkt_buf = payload - hdr_len;
+        wire_hdr_write(pkt_buf, server_ctx->compact_tx, remote_ctx->session_id, CTL_NORMAL, flags, datalen);
+        server_send_frame(server_ctx, remote_ctx->flow, pool, mem, pkt_buf, hdr_len + datalen);
+        remote_ctx->read_class = read_class_adapt(remote_ctx->read_class, nread, server_ctx->max_frame);
+
+        // out of credit: stop reading the destination until js-local has
+        // written enough of this session to its client
+        remote_ctx->tx_bytes += nread;
+        if (remote_ctx->tx_bytes - remote_ctx->tx_acked >= SESSION_WINDOW) {
+            remote_ctx->read_paused = 1;
+            uv_read_stop(stream);
+        }
         LOGW("remote_read_cb remote_ctx = %x session_id = %d type = %d", remote_ctx, remote_ctx->session_id, remote_ctx->handle.type);
-        free(buf->base);
     }
 }
 
 static void server_write_cb(uv_write_t* req, int status)
 {
-    write_req_t* wr = (write_req_t*)req;
+    batch_write_req_t* wr = (batch_write_req_t*)req;
     server_ctx_t* server_ctx = (server_ctx_t*)req->data;
     if (status) {
         if (status != UV_ECANCELED) {
@@ -196,55 +487,140 @@ static void server_write_cb(uv_write_t* req, int status)
         // allow below lines to be executed to free bufs
     }
     assert(wr->req.type == UV_WRITE);
+    batch_write_free(wr);
+    if ((server_ctx->sched.count > 0 || server_ctx->close_count > 0) && !uv_is_closing((uv_handle_t*)&server_ctx->handle))
+        uv_prepare_start(server_ctx->flush_handle, server_flush_cb);
+}
+
+// bytes of a session js-server holds but has not written to the destination
+static size_t remote_backlog(remote_ctx_t* remote_ctx)
+{
+    return remote_ctx->queued_bytes + uv_stream_get_write_queue_size((uv_stream_t*)&remote_ctx->handle);
+}
+
+// credit is withheld once the backlog crosses the high watermark and only
+// handed back out when it has drained below the low one
+static void remote_update_backlog(remote_ctx_t* remote_ctx)
+{
+    size_t backlog = remote_backlog(remote_ctx);
+    if (backlog >= BACKLOG_HIGH_WATERMARK) {
+        if (!remote_ctx->backlogged)
+            LOGD("session id = %d backlog %zu above high watermark", remote_ctx->session_id, backlog);
+        remote_ctx->backlogged = 1;
+    }
+    else if (backlog <= BACKLOG_LOW_WATERMARK) {
+        remote_ctx->backlogged = 0;
+    }
+}
+
+// hand every queued slice to the destination, each one is its own request
+static void remote_send_pending(remote_ctx_t* remote_ctx)
+{
+    pending_packet_t* packet = NULL;
+    while ((packet = list_get_head_elem(&remote_ctx->send_queue))) {
+        list_remove_elem(packet);
+        remote_ctx->queued_bytes -= packet->buf.len;
+        packet->req.data = remote_ctx;
+        int r = uv_write(&packet->req, (uv_stream_t*)&remote_ctx->handle, &packet->buf, 1, remote_write_cb);
+        if (r) {
+            slab_unref(packet->slab);
+            buf_pool_put(&slice_pool, (char*)packet);
+            HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+            return;
+        }
+    }
+    if (remote_ctx->fin_rx && !remote_ctx->shutting) {
+        // js-local's FIN: shut the write side once the queued writes are done
+        uv_shutdown_t* req = malloc(sizeof(uv_shutdown_t));
+        req->data = remote_ctx;
+        remote_ctx->shutting = 1;
+        if (uv_shutdown(req, (uv_stream_t*)&remote_ctx->handle, remote_after_shutdown_cb)) {
+            free(req);
+            HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+        }
+    }
+}
+
+// the session ends without a CTL_CLOSE once both directions are done
+static void remote_after_shutdown_cb(uv_shutdown_t* req, int status)
+{
+    remote_ctx_t* remote_ctx = (remote_ctx_t*)req->data;
+    free(req);
+    if (status) {
+        if (status != UV_ECANCELED)
+            HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+        return;
+    }
+    remote_ctx->shut = 1;
+    if (remote_ctx->fin_tx)
+        HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+}
 
-    if (wr->buf.base != NULL) {
-        free(wr->buf.base);
+// the destination is done sending: FIN rides on the session's last queued
+// frame, or on an empty one when everything went out already
+static void remote_send_fin(remote_ctx_t* remote_ctx)
+{
+    server_ctx_t* server_ctx = remote_ctx->server_ctx;
+    remote_ctx->fin_tx = 1;
+    frame_t* tail = list_get_tail_elem(&remote_ctx->flow->frames);
+    if (tail != NULL) {
+        // queued frames are compact, the scheduler drains before the switch
+        tail->buf.base[0] |= WIRE_FLAG_FIN;
+        return;
     }
-    free(wr);
+    char* pkt_buf = malloc(WIRE_HDR_MAX);
+    int len = wire_hdr_write(pkt_buf, 1, remote_ctx->session_id, CTL_NORMAL, WIRE_FLAG_FIN, 0);
+    server_send_frame(server_ctx, remote_ctx->flow, NULL, pkt_buf, pkt_buf, len);
 }
 
 static void remote_write_cb(uv_write_t* req, int status)
 {
-    write_req_t* wr = (write_req_t*)req;
+    pending_packet_t* packet = (pending_packet_t*)req;
     remote_ctx_t* remote_ctx = (remote_ctx_t*)req->data;
+    assert(packet->req.type == UV_WRITE);
+
+    // the slice is done with either way, drop its hold on the receive slab
+    size_t written = packet->buf.len;
+    slab_unref(packet->slab);
+    buf_pool_put(&slice_pool, (char*)packet);
+
     if (status) {
         LOGW("remote_write_cb error session id = %d", remote_ctx->session_id);
         if (status != UV_ECANCELED) {
             remote_ctx->connected = 0;
             HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
         }
-
-        free(wr->buf.base);
-        free(wr);
         LOGD("remote write failed!");
         return;
     }
 
-    assert(wr->req.type == UV_WRITE);
     LOGW("uv_timer_again remote_ctx = %x", remote_ctx);
     uv_timer_again(remote_ctx->http_timeout);
-    pending_packet_t* packet = list_get_head_elem(&remote_ctx->send_queue);
-    if (packet) {
-        write_req_t* wr = ALLOCATE_W_REQ(remote_ctx, packet->data, packet->payloadlen);
-        int r = uv_write(&wr->req, (uv_stream_t*)&remote_ctx->handle, &wr->buf, 1, remote_write_cb);
-        UV_WRITE_CHECK(r, wr, &remote_ctx->handle, remote_after_close_cb);
-        list_remove_elem(packet);
-        free(packet);
-    }
-    else {
-        if (verbose)
-            LOGD("got nothing to send");
-    }
-
-    free(wr->buf.base);
-    free(wr);
+    remote_ctx->rx_bytes += written;
+    remote_update_backlog(remote_ctx);
+    if (!remote_ctx->backlogged && remote_ctx->rx_bytes - remote_ctx->rx_reported >= WINDOW_UPDATE_THRESHOLD
+        && remote_ctx->server_ctx != NULL)
+        send_window_update(remote_ctx);
     LOGW("remote_write_cb remote_ctx = %x session_id = %d type = %d", remote_ctx, remote_ctx->session_id, remote_ctx->handle.type);
 }
 
+static void remote_connected(remote_ctx_t* remote_ctx)
+{
+    connpool_used(&remote_ctx->addr, remote_ctx->port);
+    remote_ctx->connected = 1;
+    if (remote_ctx->suspended)
+        remote_ctx->read_paused = 1; // until js-local resumes the session
+    else
+        uv_read_start((uv_stream_t*)&remote_ctx->handle, remote_alloc_cb, remote_read_cb);
+    remote_send_pending(remote_ctx);
+}
+
 static void remote_on_connect_cb(uv_connect_t* req, int status)
 {
     LOGD("remote server is connected");
     remote_ctx_t* remote_ctx = (remote_ctx_t*)req->data;
+    if (remote_ctx->named && status != UV_ECANCELED)
+        dns_connected(remote_ctx->host, status == 0);
     if (status) {
         if (status != UV_ECANCELED) {
             LOGD("error in remote_on_connect");
@@ -254,75 +630,177 @@ static void remote_on_connect_cb(uv_connect_t* req, int status)
         return;
     }
 
-    remote_ctx->connected = 1;
-    uv_read_start((uv_stream_t*)&remote_ctx->handle, remote_alloc_cb, remote_read_cb);
-
-    pending_packet_t* packet = list_get_head_elem(&remote_ctx->send_queue);
-    if (packet) {
-        write_req_t* wr = ALLOCATE_W_REQ(remote_ctx, packet->data, packet->payloadlen);
-        int r = uv_write(&wr->req, (uv_stream_t*)&remote_ctx->handle, &wr->buf, 1, remote_write_cb);
-        UV_WRITE_CHECK(r, wr, &remote_ctx->handle, remote_after_close_cb);
-        list_remove_elem(packet);
-        free(packet);
-    }
-
+    remote_connected(remote_ctx);
     free(req);
 }
 
 static int try_to_connect_remote(remote_ctx_t* remote_ctx)
 {
     LOGW("try to connect to remote");
-    struct sockaddr_in remote_addr;
-    memset(&remote_addr, 0, sizeof(remote_addr));
-    remote_addr.sin_family = AF_INET;
-    memcpy(&remote_addr.sin_addr.s_addr, remote_ctx->host, 4);
-    remote_addr.sin_port = *(uint16_t*)remote_ctx->port; // notice: packet.port is in network order
+    struct sockaddr_storage remote_addr;
+    resolver_sockaddr(&remote_ctx->addr, remote_ctx->port, &remote_addr); // notice: packet.port is in network order
     uv_connect_t* remote_conn_req = (uv_connect_t*)malloc(sizeof(uv_connect_t));
     uv_tcp_nodelay(&remote_ctx->handle, 1);
     remote_conn_req->data = remote_ctx;
     return uv_tcp_connect(remote_conn_req, &remote_ctx->handle, (struct sockaddr*)&remote_addr, remote_on_connect_cb);
 }
 
-static void remote_addr_resolved_cb(uv_getaddrinfo_t* resolver, int status, struct addrinfo* res)
+static void race_after_close_cb(uv_handle_t* handle)
 {
-    remote_ctx_t* remote_ctx = (remote_ctx_t*)resolver->data;
-    if (status < 0) {
-        LOGD("error DNS resolve ");
-        if (status != UV_ECANCELED) {
-            remote_ctx->resolved = 0;
-            HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
-        }
+    connect_race_t* race = (connect_race_t*)handle->data;
+    if (--race->handles == 0)
+        free(race);
+}
 
-        free(resolver);
-        return;
+// closes what is left of the race, the session no longer knows it
+static void race_end(connect_race_t* race)
+{
+    race->remote_ctx->race = NULL;
+    race->remote_ctx = NULL;
+    uv_timer_stop(&race->timer);
+    uv_close((uv_handle_t*)&race->timer, race_after_close_cb);
+    for (int i = 0; i < race->next; i++) {
+        if (!uv_is_closing((uv_handle_t*)&race->attempts[i].handle))
+            uv_close((uv_handle_t*)&race->attempts[i].handle, race_after_close_cb);
     }
+}
 
-    if (remote_ctx->closing == 1) {
-        remote_ctx->resolved = 0;
-        HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
-        uv_freeaddrinfo(res);
-        free(resolver);
+// every address failed
+static void race_lost(connect_race_t* race)
+{
+    remote_ctx_t* remote_ctx = race->remote_ctx;
+    LOGD("no address of session id = %d could be connected", remote_ctx->session_id);
+    if (remote_ctx->named)
+        dns_connected(remote_ctx->host, 0);
+    race_end(race);
+    HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+}
+
+static void race_connect_cb(uv_connect_t* req, int status);
+static void race_timer_cb(uv_timer_t* handle);
+
+// starts the next attempt, skipping addresses that fail right away
+static void race_next(connect_race_t* race)
+{
+    uv_timer_stop(&race->timer);
+    while (race->next < race->count) {
+        connect_attempt_t* attempt = &race->attempts[race->next];
+        attempt->race = race;
+        attempt->index = race->next++;
+        attempt->req.data = attempt;
+        uv_tcp_init(loop, &attempt->handle);
+        attempt->handle.data = race;
+        race->handles++;
+        uv_tcp_nodelay(&attempt->handle, 1);
+        struct sockaddr_storage addr;
+        resolver_sockaddr(&race->addrs[attempt->index], race->remote_ctx->port, &addr);
+        int r = uv_tcp_connect(&attempt->req, &attempt->handle, (struct sockaddr*)&addr, race_connect_cb);
+        if (r == 0) {
+            race->pending++;
+            if (race->next < race->count)
+                uv_timer_start(&race->timer, race_timer_cb, CONNECT_ATTEMPT_DELAY, 0);
+            return;
+        }
+        LOGD("connect to address %d of session id = %d: %s", attempt->index, race->remote_ctx->session_id, uv_strerror(r));
+        uv_close((uv_handle_t*)&attempt->handle, race_after_close_cb);
+    }
+    if (race->pending == 0)
+        race_lost(race);
+}
+
+static void race_timer_cb(uv_timer_t* handle)
+{
+    race_next((connect_race_t*)handle->data);
+}
+
+// the winner's socket moves to the session's handle, which has none yet
+static void race_connect_cb(uv_connect_t* req, int status)
+{
+    connect_attempt_t* attempt = (connect_attempt_t*)req->data;
+    connect_race_t* race = attempt->race;
+    race->pending--;
+    if (race->remote_ctx == NULL)
+        return; // closed by race_end()
+
+    remote_ctx_t* remote_ctx = race->remote_ctx;
+    uv_os_fd_t fd = -1;
+    if (status == 0 && uv_fileno((uv_handle_t*)&attempt->handle, &fd) == 0)
+        fd = dup(fd);
+    if (status == 0 && (fd < 0 || uv_tcp_open(&remote_ctx->handle, fd))) {
+        if (fd >= 0)
+            close(fd);
+        status = UV_EBADF;
+    }
+    if (status) {
+        LOGD("connect to address %d of session id = %d: %s", attempt->index, remote_ctx->session_id, uv_strerror(status));
+        uv_close((uv_handle_t*)&attempt->handle, race_after_close_cb);
+        race_next(race);
         return;
     }
 
+    remote_ctx->addr = race->addrs[attempt->index];
+    race_end(race);
+    if (remote_ctx->named)
+        dns_connected(remote_ctx->host, 1);
+    remote_connected(remote_ctx);
+}
+
+// an idle pool connection to any of the addresses is taken as it is.
+// Otherwise a single address is dialed on the session's own handle,
+// several race for it (see CONNECT_ATTEMPT_DELAY), IPv6 ones first
+static int remote_connect(remote_ctx_t* remote_ctx, const dns_addr_t* addrs, int count)
+{
     remote_ctx->resolved = 1;
-    if (res->ai_family == AF_INET) {
-        memcpy(remote_ctx->host, &((struct sockaddr_in*)(res->ai_addr))->sin_addr.s_addr, 4);
-        remote_ctx->addrlen = 4;
+    for (int i = 0; i < count; i++) {
+        if (connpool_take(&addrs[i], remote_ctx->port, &remote_ctx->handle) == 0) {
+            remote_ctx->addr = addrs[i];
+            if (remote_ctx->named)
+                dns_connected(remote_ctx->host, 1);
+            remote_connected(remote_ctx);
+            return 0;
+        }
     }
-    else if (res->ai_family == AF_INET6) {
-        memcpy(remote_ctx->host, &((struct sockaddr_in6*)(res->ai_addr))->sin6_addr.s6_addr, 16);
-        remote_ctx->addrlen = 16;
+    if (count == 1) {
+        remote_ctx->addr = addrs[0];
+        return try_to_connect_remote(remote_ctx);
     }
-    else {
-        LOGD("DNS ai_family unrecognized");
+
+    connect_race_t* race = calloc(1, sizeof(connect_race_t));
+    const dns_addr_t* family[2][DNS_MAX_ADDRS];
+    int n[2] = { 0, 0 };
+    for (int i = 0; i < count && i < DNS_MAX_ADDRS; i++) {
+        int f = addrs[i].family == AF_INET;
+        family[f][n[f]++] = &addrs[i];
+    }
+    for (int i = 0; i < n[0] || i < n[1]; i++) {
+        if (i < n[0])
+            race->addrs[race->count++] = *family[0][i];
+        if (i < n[1])
+            race->addrs[race->count++] = *family[1][i];
+    }
+    race->remote_ctx = remote_ctx;
+    uv_timer_init(loop, &race->timer);
+    race->timer.data = race;
+    race->handles = 1;
+    remote_ctx->race = race;
+    race_next(race);
+    return 0;
+}
+
+static void remote_addr_resolved_cb(void* data, int status, const dns_addr_t* addrs, int count)
+{
+    remote_ctx_t* remote_ctx = (remote_ctx_t*)data;
+    remote_ctx->lookup = NULL;
+    if (status < 0) {
+        LOGD("error DNS resolve ");
+        remote_ctx->resolved = 0;
+        HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+        return;
     }
 
-    int r = try_to_connect_remote(remote_ctx);
+    int r = remote_connect(remote_ctx, addrs, count);
     if (r)
         HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
-    uv_freeaddrinfo(res);
-    free(resolver);
 }
 
 static void server_accept_cb(uv_stream_t* server, int status)
@@ -332,8 +810,20 @@ static void server_accept_cb(uv_stream_t* server, int status)
 
     server_ctx_t* ctx = calloc(1, sizeof(server_ctx_t));
     ctx->handle.data = ctx;
-    ctx->expect_to_recv = HDRLEN;
+    list_add_to_tail(&servers, ctx);
     RB_INIT(&ctx->remote_map);
+    sched_init(&ctx->sched);
+    ctx->max_frame = LEGACY_FRAME_PAYLOAD; // until js-local says hello
+    if (crypto_enabled())
+        ctx->crypto = crypto_new();
+    ctx->flush_handle = malloc(sizeof(uv_prepare_t));
+    ctx->flush_handle->data = ctx;
+    uv_prepare_init(loop, ctx->flush_handle);
+    ctx->ping_timer = malloc(sizeof(uv_timer_t));
+    ctx->ping_timer->data = ctx;
+    uv_timer_init(loop, ctx->ping_timer);
+    if (conf.keepalive)
+        uv_timer_start(ctx->ping_timer, server_ping_cb, conf.keepalive, conf.keepalive);
     uv_tcp_init(loop, &ctx->handle);
     uv_tcp_nodelay(&ctx->handle, 1);
 
@@ -350,16 +840,446 @@ static void server_accept_cb(uv_stream_t* server, int status)
 static void server_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf)
 {
     server_ctx_t* server_ctx = (server_ctx_t*)handle->data;
-    *buf = uv_buf_init(server_ctx->recv_buffer, server_ctx->expect_to_recv);
+    size_t min_space = MIN_READ_SPACE;
+    if (server_ctx->crypto && server_ctx->recv_slab) {
+        // make room for the rest of the record in one go
+        size_t pending = server_ctx->recv_slab->wpos - server_ctx->recv_slab->rpos;
+        size_t need = crypto_need(server_ctx->crypto);
+        if (need > pending + min_space)
+            min_space = need - pending;
+    }
+    server_ctx->recv_slab = slab_reserve(server_ctx->recv_slab, RECV_SLAB_SIZE, min_space);
+    *buf = uv_buf_init(server_ctx->recv_slab->data + server_ctx->recv_slab->wpos, server_ctx->recv_slab->size - server_ctx->recv_slab->wpos);
     assert(buf->base != NULL);
 }
 
+// queue a payload slice that stays in the receive slab until it is written
+static void queue_slice(slab_t* slab, remote_ctx_t* remote_ctx, char* payload, int len)
+{
+    if (len <= 0)
+        return;
+    pending_packet_t* packet = (pending_packet_t*)buf_pool_get(&slice_pool);
+    packet->slab = slab_ref(slab);
+    packet->buf = uv_buf_init(payload, len);
+    list_add_to_tail(&remote_ctx->send_queue, packet);
+    remote_ctx->queued_bytes += len;
+}
+
+// js-local wrote more of a session to its client, resume the destination
+// read if it was stopped for lack of credit
+static void server_handle_window_update(server_ctx_t* ctx, char* packet_buf)
+{
+    remote_ctx_t* exist_ctx = NULL;
+    find_ctx.session_id = ctx->packet.session_id;
+    exist_ctx = RB_FIND(remote_map_tree, &ctx->remote_map, &find_ctx);
+    if (exist_ctx == NULL || ctx->packet.datalen != WINDOW_LEN)
+        return;
+
+    uint32_t consumed;
+    get_payload(&consumed, packet_buf, WINDOW_LEN, ctx->packet.offset);
+    exist_ctx->tx_acked = ntohl(consumed);
+    replay_ack(&exist_ctx->replay, exist_ctx->tx_acked);
+    uv_timer_again(exist_ctx->http_timeout);
+    if (exist_ctx->read_paused && !exist_ctx->fin_tx && !exist_ctx->suspended && exist_ctx->tx_bytes - exist_ctx->tx_acked < SESSION_WINDOW
+        && exist_ctx->connected == 1 && !uv_is_closing((uv_handle_t*)&exist_ctx->handle)) {
+        exist_ctx->read_paused = 0;
+        uv_read_start((uv_stream_t*)&exist_ctx->handle, remote_alloc_cb, remote_read_cb);
+    }
+}
+
+// js-local is back with the token of a connection that broke: the sessions
+// left behind are ours again and wait for its CTL_RESUME. The old connection
+// may not even have noticed it is dead
+static void server_adopt_sessions(server_ctx_t* ctx)
+{
+    server_ctx_t* old = NULL;
+    resume_group_t* group = NULL;
+    remote_ctx_t* remote_ctx = NULL;
+    for (old = list_get_start(&servers); !list_elem_is_end(&servers, old); old = old->next) {
+        if (old != ctx && old->token == ctx->token && !uv_is_closing((uv_handle_t*)&old->handle)) {
+            LOGW("%s", "js-local replaced a long connection that still looked alive");
+            server_exception(old);
+            break;
+        }
+    }
+    for (group = list_get_start(&resume_groups); !list_elem_is_end(&resume_groups, group); group = group->next) {
+        if (group->token == ctx->token)
+            break;
+    }
+    if (list_elem_is_end(&resume_groups, group))
+        return;
+    while ((remote_ctx = RB_MIN(remote_map_tree, &group->remote_map))) {
+        RB_REMOVE(remote_map_tree, &group->remote_map, remote_ctx);
+        remote_ctx->group = NULL;
+        remote_ctx->server_ctx = ctx;
+        RB_INSERT(remote_map_tree, &ctx->remote_map, remote_ctx);
+    }
+    resume_group_free(group);
+}
+
+// js-local kept the session: tell it how much of it we got, resend what it
+// did not receive and carry on. The one on session 0 ends the list, sessions
+// it did not name are gone on its side
+static void server_handle_resume(server_ctx_t* ctx, char* packet_buf)
+{
+    remote_ctx_t* exist_ctx = NULL;
+    if (ctx->packet.session_id == HELLO_SESSION) {
+        RB_FOREACH(exist_ctx, remote_map_tree, &ctx->remote_map)
+        {
+            if (exist_ctx->suspended)
+                server_close_session(ctx, exist_ctx->session_id);
+        }
+        return;
+    }
+    if (ctx->packet.datalen != RESUME_LEN)
+        return;
+    find_ctx.session_id = ctx->packet.session_id;
+    exist_ctx = RB_FIND(remote_map_tree, &ctx->remote_map, &find_ctx);
+    if (exist_ctx == NULL) {
+        send_control_packet(ctx->packet.session_id, ctx, NULL, CTL_CLOSE);
+        return;
+    }
+    if (!exist_ctx->suspended || uv_is_closing((uv_handle_t*)&exist_ctx->handle))
+        return;
+
+    uint32_t received, written;
+    get_payload(&received, packet_buf, sizeof(received), ctx->packet.offset);
+    get_payload(&written, packet_buf, sizeof(written), ctx->packet.offset);
+    received = ntohl(received);
+    written = ntohl(written);
+    exist_ctx->suspended = 0;
+    uv_timer_again(exist_ctx->http_timeout);
+    if (!replay_covers(&exist_ctx->replay, received)) {
+        LOGW("cannot resume session id = %d from byte %u", exist_ctx->session_id, received);
+        exist_ctx->connected = 0;
+        HANDLECLOSE(&exist_ctx->handle, remote_after_close_cb);
+        return;
+    }
+    exist_ctx->tx_acked = written;
+    replay_ack(&exist_ctx->replay, written);
+    send_resume(exist_ctx);
+    while (received != exist_ctx->tx_bytes) {
+        char* mem = malloc(WIRE_HDR_MAX + ctx->max_frame);
+        size_t len = replay_copy(&exist_ctx->replay, received, mem + WIRE_HDR_MAX, ctx->max_frame);
+        int hdr_len = wire_hdr_len(ctx->compact_tx, exist_ctx->session_id, len);
+        char* pkt_buf = mem + WIRE_HDR_MAX - hdr_len;
+        wire_hdr_write(pkt_buf, ctx->compact_tx, exist_ctx->session_id, CTL_NORMAL, 0, len);
+        server_send_frame(ctx, exist_ctx->flow, NULL, mem, pkt_buf, hdr_len + len);
+        received += len;
+    }
+    if (exist_ctx->fin_tx && ctx->compact_tx)
+        remote_send_fin(exist_ctx);
+    else if (!exist_ctx->fin_tx && exist_ctx->connected == 1 && exist_ctx->tx_bytes - exist_ctx->tx_acked < SESSION_WINDOW) {
+        exist_ctx->read_paused = 0;
+        uv_read_start((uv_stream_t*)&exist_ctx->handle, remote_alloc_cb, remote_read_cb);
+    }
+}
+
+// js-local's hello: frames to it may now be as large as both sides accept
+// and use the compact header if it parses those. A second hello only tells
+// where js-local's own frames turn compact and is not answered
+static void server_handle_hello(server_ctx_t* ctx, char* packet_buf)
+{
+    if (ctx->packet.datalen < HELLO_MIN_LEN)
+        return;
+    char* payload = packet_buf + ctx->packet.offset;
+    uint32_t max_frame, features = 0;
+    memcpy(&max_frame, payload + 4, sizeof(max_frame));
+    max_frame = ntohl(max_frame);
+    if (ctx->packet.datalen >= HELLO_V2_LEN) {
+        memcpy(&features, payload + 8, sizeof(features));
+        features = ntohl(features);
+    }
+    ctx->max_frame = max_frame < MAX_FRAME_PAYLOAD ? max_frame : MAX_FRAME_PAYLOAD;
+    if (ctx->max_frame < LEGACY_FRAME_PAYLOAD)
+        ctx->max_frame = LEGACY_FRAME_PAYLOAD;
+    if (features & HELLO_F_SWITCH)
+        ctx->compact_rx = 1;
+    ctx->peer_inflates = (features & HELLO_F_DEFLATE) != 0;
+    ctx->peer_close_batch = (features & HELLO_F_CLOSE_BATCH) != 0;
+    ctx->peer_half_close = (features & HELLO_F_HALF_CLOSE) != 0;
+    ctx->peer_resume = (features & HELLO_F_RESUME) != 0;
+    ctx->peer_pings = (features & HELLO_F_PING) != 0;
+    if (ctx->hello_sent)
+        return;
+    LOGI("js-local accepts frames of up to %d bytes", (int)ctx->max_frame);
+    ctx->hello_sent = 1;
+    if (ctx->packet.datalen >= HELLO_LEN)
+        memcpy(&ctx->token, payload + HELLO_V2_LEN, sizeof(ctx->token));
+    if (conf.resume_timeout && ctx->peer_resume && ctx->token)
+        server_adopt_sessions(ctx);
+    if (!(features & HELLO_F_COMPACT)) {
+        send_hello(ctx, HELLO_FEATURES);
+        return;
+    }
+    // frames built in the legacy format go out before the switch
+    while (ctx->sched.count > 0) {
+        if (sched_write(&ctx->sched, (uv_stream_t*)&ctx->handle, ctx->crypto, ctx, server_write_cb)) {
+            server_exception(ctx);
+            return;
+        }
+    }
+    send_hello(ctx, HELLO_FEATURES | HELLO_F_SWITCH);
+    ctx->compact_tx = 1;
+}
+
+// the destination of a CTL_INIT: spelled out in legacy frames, a table
+// index (defining the entry first if flagged) in compact ones.
+// Returns -1 for an INIT that does not fit its frame or names an unknown
+// entry
+static int server_parse_dest(server_ctx_t* ctx, char* packet_buf, dest_t* dest)
+{
+    int end = ctx->packet.offset + ctx->packet.datalen;
+    dest_t* entry = dest;
+    if (ctx->compact_rx) {
+        if (ctx->packet.offset + ADDR_INDEX_LEN > end)
+            return -1;
+        uint8_t index = (uint8_t)packet_buf[ctx->packet.offset++];
+        if (index >= ADDR_TABLE_SIZE)
+            return -1;
+        entry = &ctx->addr_table[index];
+        if (!(ctx->packet.flags & WIRE_FLAG_ADDR_DEFINE)) {
+            if (entry->atyp == 0)
+                return -1;
+            *dest = *entry;
+            return 0;
+        }
+    }
+    if (ctx->packet.offset + ATYP_LEN + ADDRLEN_LEN > end)
+        return -1;
+    get_header(&entry->atyp, packet_buf, ATYP_LEN, ctx->packet.offset);
+    get_header(&entry->addrlen, packet_buf, ADDRLEN_LEN, ctx->packet.offset);
+    if (ctx->packet.offset + entry->addrlen + PORT_LEN > end)
+        return -1;
+    get_header(entry->host, packet_buf, entry->addrlen, ctx->packet.offset);
+    get_header(entry->port, packet_buf, PORT_LEN, ctx->packet.offset);
+    if (!(entry->atyp == 0x01 && entry->addrlen == 4) && !(entry->atyp == 0x04 && entry->addrlen == 16)
+        && !(entry->atyp == 0x03 && entry->addrlen > 0)) {
+        entry->atyp = 0; // not to be referred to later either
+        return -1;
+    }
+    if (entry != dest)
+        *dest = *entry;
+    return 0;
+}
+
+// js-local closed the session
+static void server_close_session(server_ctx_t* ctx, int session_id)
+{
+    remote_ctx_t* exist_ctx = NULL;
+    find_ctx.session_id = session_id;
+    exist_ctx = RB_FIND(remote_map_tree, &ctx->remote_map, &find_ctx);
+    if (exist_ctx != NULL) {
+        exist_ctx->ctl_cmd = CTL_CLOSE;
+        LOGW("exist session close remote_ctx = %x", exist_ctx);
+        uv_read_stop((uv_stream_t*)&exist_ctx->handle);
+        remote_close(exist_ctx);
+    }
+}
+
+// handle one complete frame, ctx->packet holds the parsed header
+static void server_handle_packet(server_ctx_t* ctx, char* packet_buf)
+{
+    if (ctx->packet.rsv == CTL_HELLO && ctx->packet.session_id == HELLO_SESSION) {
+        server_handle_hello(ctx, packet_buf);
+        return;
+    }
+
+    if (ctx->packet.rsv == CTL_WINDOW_UPDATE) {
+        server_handle_window_update(ctx, packet_buf);
+        return;
+    }
+
+    if (ctx->packet.rsv == CTL_RESUME) {
+        server_handle_resume(ctx, packet_buf);
+        return;
+    }
+
+    if (ctx->packet.rsv == CTL_PING || ctx->packet.rsv == CTL_PONG) {
+        server_handle_ping(ctx, packet_buf);
+        return;
+    }
+
+    if (ctx->packet.rsv == CTL_CLOSE) {
+        LOGW("received a packet with CTL_CLOSE (0x04) session id = %d", ctx->packet.session_id);
+        server_close_session(ctx, ctx->packet.session_id);
+        return;
+    }
+
+    if (ctx->packet.rsv == CTL_CLOSE_BATCH) {
+        char* payload = packet_buf + ctx->packet.offset;
+        size_t pos = 0;
+        uint32_t session_id;
+        while (pos < ctx->packet.datalen) {
+            int n = wire_close_batch_next(payload + pos, ctx->packet.datalen - pos, &session_id);
+            if (n < 0) {
+                LOGW("malformed CTL_CLOSE_BATCH from js-local");
+                break;
+            }
+            pos += n;
+            server_close_session(ctx, (int)session_id);
+        }
+        return;
+    }
+
+    remote_ctx_t* exist_ctx = NULL;
+    find_ctx.session_id = ctx->packet.session_id;
+    exist_ctx = RB_FIND(remote_map_tree, &ctx->remote_map, &find_ctx);
+    if (exist_ctx != NULL) {
+        uv_timer_again(exist_ctx->http_timeout);
+        LOGD("server_handle_packet: exist_ctx in session_id = %d, RSV = %d datalen = %d\n", ctx->packet.session_id, ctx->packet.rsv, ctx->packet.datalen);
+        if (ctx->packet.rsv == CTL_INIT) {
+            // only a generation that wrapped around a session still closing
+            LOGW("CTL_INIT for live session id = %d, dropped", ctx->packet.session_id);
+            return;
+        }
+        ctx->packet.payloadlen = ctx->packet.datalen;
+        LOGD("server_handle_packet: (request) packet.payloadlen = %d", ctx->packet.payloadlen);
+        if (ctx->packet.flags & WIRE_FLAG_ZRESET)
+            zframe_reset_rx(exist_ctx->z);
+        if (ctx->packet.flags & WIRE_FLAG_COMPRESSED) {
+            // inflated payloads are queued out of a slab of their own
+            char* out = NULL;
+            int n = zframe_inflate(&exist_ctx->z, packet_buf + ctx->packet.offset, ctx->packet.payloadlen, &out);
+            if (n < 0) {
+                LOGW("corrupt compressed frame for session id = %d", exist_ctx->session_id);
+                exist_ctx->connected = 0;
+                HANDLECLOSE(&exist_ctx->handle, remote_after_close_cb);
+                return;
+            }
+            slab_t* slab = slab_new(n);
+            memcpy(slab->data, out, n);
+            queue_slice(slab, exist_ctx, slab->data, n);
+            slab_unref(slab);
+            exist_ctx->rx_seq += n;
+        }
+        else {
+            queue_slice(ctx->recv_slab, exist_ctx, packet_buf + ctx->packet.offset, ctx->packet.payloadlen);
+            exist_ctx->rx_seq += ctx->packet.payloadlen;
+        }
+        if (ctx->packet.flags & WIRE_FLAG_FIN)
+            exist_ctx->fin_rx = 1;
+        LOGD("server_handle_packet: resovled = %d connected = %d", exist_ctx->resolved, exist_ctx->connected);
+        if (exist_ctx->resolved == 1 && exist_ctx->connected == 1) {
+            remote_send_pending(exist_ctx);
+        }
+        remote_update_backlog(exist_ctx);
+        if (remote_backlog(exist_ctx) > BACKLOG_HARD_LIMIT) {
+            // js-local ignores our credit, do not let it pin slabs forever
+            LOGW("session id = %d exceeds its window, closing", exist_ctx->session_id);
+            exist_ctx->connected = 0;
+            HANDLECLOSE(&exist_ctx->handle, remote_after_close_cb);
+            return;
+        }
+        else if (exist_ctx->connected == 0) {
+            LOGD("remote is closing");
+        }
+        LOGW("server_handle_packet:2 remote_ctx = %x session_id = %d type = %d", exist_ctx, exist_ctx->session_id, exist_ctx->handle.type);
+    }
+    else {
+        if (ctx->packet.rsv == CTL_NORMAL) {
+            LOGW("Received packet from freed session, just drop!");
+            return;
+        }
+        dest_t dest;
+        if (server_parse_dest(ctx, packet_buf, &dest)) {
+            LOGW("bad destination for session id = %d, closing it", ctx->packet.session_id);
+            send_control_packet(ctx->packet.session_id, ctx, NULL, CTL_CLOSE);
+            return;
+        }
+        remote_ctx_t* remote_ctx = calloc(1, sizeof(remote_ctx_t));
+        remote_ctx->ctl_cmd = CTL_NORMAL;
+        remote_ctx->server_ctx = ctx;
+        remote_ctx->handle.data = remote_ctx;
+        remote_ctx->http_timeout = (uv_timer_t*)malloc(sizeof(uv_timer_t));
+        remote_ctx->http_timeout->data = remote_ctx;
+        uv_tcp_init(loop, &remote_ctx->handle);
+        uv_timer_init(loop, remote_ctx->http_timeout);
+        LOGW("uv_timer_start remote_ctx = %x http_timeout = %x", remote_ctx, remote_ctx->http_timeout);
+        uv_timer_start(remote_ctx->http_timeout, remote_timeout_cb, conf.timeout, conf.timeout);
+        list_init(&remote_ctx->send_queue);
+        ctx->packet.atyp = dest.atyp;
+        ctx->packet.addrlen = dest.addrlen;
+        remote_ctx->addrlen = dest.addrlen;
+        memcpy(remote_ctx->host, dest.host, dest.addrlen);
+        memcpy(remote_ctx->port, dest.port, PORT_LEN);
+        ctx->packet.payloadlen = ctx->packet.hdrlen + ctx->packet.datalen - ctx->packet.offset;
+
+        remote_ctx->host[remote_ctx->addrlen] = '\0'; // put a EOF on domain name
+        remote_ctx->session_id = ctx->packet.session_id;
+        remote_ctx->flow = sched_flow_new(is_interactive_port(&conf, ntohs(*(uint16_t*)remote_ctx->port)));
+        LOGW("server_handle_packet remote_ctx = %x create session id = %d rsv = %d payloadlen = %d addrlen = %d", remote_ctx, remote_ctx->session_id, ctx->packet.rsv, ctx->packet.payloadlen, ctx->packet.addrlen);
+        remote_ctx_t* ins_r = RB_INSERT(remote_map_tree, &ctx->remote_map, remote_ctx);
+        if (ins_r) {
+            LOGE("RB_INSERT error!");
+            assert(0);
+        }
+
+        queue_slice(ctx->recv_slab, remote_ctx, packet_buf + ctx->packet.offset, ctx->packet.payloadlen);
+        remote_ctx->rx_seq = ctx->packet.payloadlen;
+        if (ctx->packet.flags & WIRE_FLAG_FIN)
+            remote_ctx->fin_rx = 1;
+
+        if (ctx->packet.atyp == 0x03) {
+            // have to resolve domain name first, unless it is cached
+            remote_ctx->named = 1;
+            remote_ctx->lookup = dns_resolve(remote_ctx->host, remote_addr_resolved_cb, remote_ctx);
+        }
+        else {
+            // DNS resolve is not in use, server_parse_dest() checked the length
+            dns_addr_t addr;
+            addr.family = ctx->packet.atyp == 0x04 ? AF_INET6 : AF_INET;
+            memcpy(addr.addr, remote_ctx->host, remote_ctx->addrlen);
+            int r = remote_connect(remote_ctx, &addr, 1);
+            if (r) {
+                LOGW("Received packet with atyp 0x%02x, connect failed: %s", ctx->packet.atyp, uv_strerror(r));
+                HANDLECLOSE(&remote_ctx->handle, remote_after_close_cb);
+            }
+        }
+
+        LOGW("server_handle_packet:1 remote_ctx = %x session_id = %d type = %d", remote_ctx, remote_ctx->session_id, remote_ctx->handle.type);
+    }
+}
+
+// dispatch the complete frames in [data, data + len). Returns the bytes they
+// took up, -1 for a malformed header
+static int server_parse_frames(server_ctx_t* ctx, char* data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        wire_hdr_t hdr;
+        char* packet_buf = data + pos;
+        size_t avail = len - pos;
+        // the format may change after a hello, so parse one frame at a time
+        int hdr_len = wire_hdr_parse(packet_buf, avail, ctx->compact_rx, &hdr);
+        if (hdr_len < 0)
+            return -1;
+        if (hdr_len == 0 || avail < hdr_len + hdr.len)
+            break; // partial frame, wait for more
+
+        ctx->packet.session_id = hdr.session_id;
+        ctx->packet.rsv = hdr.type;
+        ctx->packet.flags = hdr.flags;
+        ctx->packet.datalen = hdr.len;
+        ctx->packet.hdrlen = hdr_len;
+        ctx->packet.offset = hdr_len;
+        LOGD("session id = %d RSV = %d datalen = %d", ctx->packet.session_id, ctx->packet.rsv, ctx->packet.datalen);
+        pos += hdr_len + hdr.len;
+        server_handle_packet(ctx, packet_buf);
+        if (uv_is_closing((uv_handle_t*)&ctx->handle))
+            break;
+    }
+    return (int)pos;
+}
+
 // complex! de-multiplexing the long connection
+// every complete frame in the receive slab is dispatched in one callback,
+// a trailing partial frame stays where it is until the next read completes it.
+// On an encrypted connection the frames come in records, each opened in place
+// and holding whole frames
 static void server_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf)
 {
     server_ctx_t* ctx = (server_ctx_t*)stream->data;
-    LOGD("hehe nread = %d", nread);
-    LOGD("server_read_cb: ==============================start============================");
     if (unlikely(nread <= 0)) {
         if (nread == 0)
             return;
@@ -367,190 +1287,54 @@ static void server_read_cb(uv_stream_t* stream, ssize_t nread, const uv_buf_t* b
             LOGW("remote long connection is closed or error when reading");
             server_exception(ctx);
         }
+        return;
     }
-    else if (nread > 0) {
-
-        // one packet finished, reset!
-        LOGD("1: buf_len = %d, reset = %d, stage = %d, expect_to_recv %d", ctx->buf_len, ctx->reset, ctx->stage, ctx->expect_to_recv);
-
-        if (!ctx->reset) {
-            LOGD("reset!");
-            packetnbuf_reset(ctx);
-            ctx->packet.offset = 0;
-        }
-
-        LOGD("2: buf_len = %d, reset = %d, stage = %d, expect_to_recv %d", ctx->buf_len, ctx->reset, ctx->stage, ctx->expect_to_recv);
-
-        memcpy(ctx->packet_buf + ctx->buf_len, buf->base, nread); // copy current buf to packet_buf
-        ctx->buf_len += nread; // record how much data we put in the packet_buf
-
-        if (ctx->stage == 0) {
-            if (ctx->buf_len >= EXP_TO_RECV_LEN) {
-                if (ctx->buf_len > EXP_TO_RECV_LEN)
-                    assert(0);
-                LOGD("stage = 0");
-                LOGD("3: buf_len = %d, reset = %d, stage = %d, expect_to_recv %d", ctx->buf_len, ctx->reset, ctx->stage, ctx->expect_to_recv);
-                get_id(ctx, &ctx->packet.session_id, ctx->packet_buf, ID_LEN, ctx->packet.offset);
-                LOGW("Received packet with session id = %d", ctx->packet.session_id);
-                get_header(&ctx->packet.rsv, ctx->packet_buf, RSV_LEN, ctx->packet.offset);
-                get_header(&ctx->packet.datalen, ctx->packet_buf, DATALEN_LEN, ctx->packet.offset);
-                ctx->packet.datalen = ntohs((uint16_t)ctx->packet.datalen);
-                ctx->expect_to_recv = ctx->packet.datalen;
-                LOGD("session id = %d RSV = %d", ctx->packet.session_id, ctx->packet.rsv);
-                ctx->stage = 1;
-                if (ctx->packet.rsv == CTL_CLOSE) {
-                    LOGW("received a packet with CTL_CLOSE (0x04) session id = %d", ctx->packet.session_id);
-                    remote_ctx_t* exist_ctx = NULL;
-                    find_ctx.session_id = ctx->packet.session_id;
-                    exist_ctx = RB_FIND(remote_map_tree, &ctx->remote_map, &find_ctx);
-                    if (exist_ctx != NULL) {
-                        exist_ctx->ctl_cmd = CTL_CLOSE;
-                        LOGW("exist session close remote_ctx = %x", exist_ctx);
-                        uv_read_stop((uv_stream_t*)&exist_ctx->handle);
-                        if (!uv_is_closing((uv_handle_t*)&exist_ctx->handle)) {
-                            if (exist_ctx->resolved == 1)
-                                uv_close((uv_handle_t*)&exist_ctx->handle, remote_after_close_cb);
-                            else
-                                exist_ctx->closing = 1;
-                        }
-                    }
-                    else {
-                        LOGW("warning: closing an non-existent remote_ctx which means this session id is safe to be reused in local-side");
-                        send_control_packet(ctx->packet.session_id, ctx, CTL_CLOSE_ACK);
-                    }
-
-                    ctx->reset = 0;
-                    ctx->expect_to_recv = EXP_TO_RECV_LEN;
-                }
-                LOGD("4: buf_len = %d, reset = %d, stage = %d, expect_to_recv %d", ctx->buf_len, ctx->reset, ctx->stage, ctx->expect_to_recv);
-            }
-            else {
-                LOGD("< header length ... gather more");
-                ctx->expect_to_recv = HDRLEN - ctx->buf_len;
-                LOGD("ctx->expect_to_recv %d", ctx->expect_to_recv);
-                return;
-            }
+
+    slab_t* slab = ctx->recv_slab;
+    slab->wpos += nread;
+    if (ctx->crypto == NULL) {
+        int n = server_parse_frames(ctx, slab->data + slab->rpos, slab->wpos - slab->rpos);
+        if (n < 0) {
+            LOGW("malformed frame header from js-local");
+            server_exception(ctx);
+            return;
         }
-        else if (ctx->stage == 1) {
-            if (ctx->buf_len == ctx->packet.datalen + HDRLEN) {
-                // after processing this packet, we have to handle the next packet so reset all stuffs
-                ctx->reset = 0;
-                ctx->expect_to_recv = HDRLEN;
-                remote_ctx_t* exist_ctx = NULL;
-                find_ctx.session_id = ctx->packet.session_id;
-                exist_ctx = RB_FIND(remote_map_tree, &ctx->remote_map, &find_ctx);
-                if (exist_ctx != NULL) {
-                    uv_timer_again(exist_ctx->http_timeout);
-                    LOGD("server_read_cb: exist_ctx in session_id = %d, RSV = %d datalen = %d\n", ctx->packet.session_id, ctx->packet.rsv, ctx->packet.datalen);
-                    if (ctx->packet.rsv == CTL_INIT)
-                        assert(0);
-                    ctx->packet.payloadlen = ctx->packet.datalen;
-                    pending_packet_t* pkt_to_send = ALLOCATE_PACKET(pending_packet, ctx->packet.payloadlen);
-                    get_header(pkt_to_send->data, ctx->packet_buf, ctx->packet.payloadlen, ctx->packet.offset);
-                    LOGD("server_read_cb: (request) packet.payloadlen = %d packet.data = \n%s", pkt_to_send->payloadlen, pkt_to_send->data);
-                    //LOG_SHOW_BUFFER(pkt_to_send->data, pkt_to_send->payloadlen);
-                    list_add_to_tail(&exist_ctx->send_queue, pkt_to_send);
-                    LOGD("server_read_cb: ip: %d.%d.%d.%d", (unsigned char)exist_ctx->host[0], (unsigned char)exist_ctx->host[1], (unsigned char)exist_ctx->host[2], (unsigned char)exist_ctx->host[3]);
-                    LOGD("server_read_cb: resovled = %d connected = %d", exist_ctx->resolved, exist_ctx->connected);
-                    if (exist_ctx->resolved == 1 && exist_ctx->connected == 1) {
-                        pending_packet_t* packet = list_get_head_elem(&exist_ctx->send_queue);
-                        if (packet) {
-                            write_req_t* wr = ALLOCATE_W_REQ(exist_ctx, packet->data, packet->payloadlen);
-                            int r = uv_write(&wr->req, (uv_stream_t*)(void*)&exist_ctx->handle, &wr->buf, 1, remote_write_cb);
-                            UV_WRITE_CHECK(r, wr, &exist_ctx->handle, remote_after_close_cb);
-                            list_remove_elem(packet);
-                            free(packet);
-                        }
-                        else
-                            LOGD("server_read_cb: got nothing to send");
-                    }
-                    else if (exist_ctx->connected == 0) {
-                        LOGD("remote is closing");
-                        //try_to_connect_remote(exist_ctx);
-                    }
-                    LOGD("buf_len = %d, reset = %d, stage = %d, expect_to_recv %d", ctx->buf_len, ctx->reset, ctx->stage, ctx->expect_to_recv);
-                    LOGW("server_read_cb:2 remote_ctx = %x session_id = %d type = %d", exist_ctx, exist_ctx->session_id, exist_ctx->handle.type);
-                }
-                else {
-                    if (ctx->packet.rsv == CTL_NORMAL) {
-                        LOGW("Received packet from freed session, just drop!");
-                        ctx->reset = 0;
-                        return;
-                    }
-                    remote_ctx_t* remote_ctx = calloc(1, sizeof(remote_ctx_t));
-                    remote_ctx->ctl_cmd = CTL_NORMAL;
-                    remote_ctx->server_ctx = ctx;
-                    remote_ctx->handle.data = remote_ctx;
-                    remote_ctx->http_timeout = (uv_timer_t*)malloc(sizeof(uv_timer_t));
-                    remote_ctx->http_timeout->data = remote_ctx;
-                    uv_tcp_init(loop, &remote_ctx->handle);
-                    uv_timer_init(loop, remote_ctx->http_timeout);
-                    LOGW("uv_timer_start remote_ctx = %x http_timeout = %x", remote_ctx, remote_ctx->http_timeout);
-                    uv_timer_start(remote_ctx->http_timeout, remote_timeout_cb, conf.timeout, conf.timeout);
-                    list_init(&remote_ctx->send_queue);
-                    get_header(&ctx->packet.atyp, ctx->packet_buf, ATYP_LEN, ctx->packet.offset);
-                    get_header(&ctx->packet.addrlen, ctx->packet_buf, ADDRLEN_LEN, ctx->packet.offset);
-                    remote_ctx->addrlen = ctx->packet.addrlen;
-                    get_header(remote_ctx->host, ctx->packet_buf, ctx->packet.addrlen, ctx->packet.offset);
-                    get_header(remote_ctx->port, ctx->packet_buf, PORT_LEN, ctx->packet.offset);
-                    ctx->packet.payloadlen = ctx->packet.datalen - (ATYP_LEN + ADDRLEN_LEN + ctx->packet.addrlen + PORT_LEN);
-                    pending_packet_t* pkt_to_send = ALLOCATE_PACKET(pending_packet, ctx->packet.payloadlen);
-                    get_payload(pkt_to_send->data, ctx->packet_buf, ctx->packet.payloadlen, ctx->packet.offset);
-
-                    remote_ctx->host[remote_ctx->addrlen] = '\0'; // put a EOF on domain name
-                    remote_ctx->session_id = ctx->packet.session_id;
-                    LOGW("server_read_cb remote_ctx = %x create session id = %d rsv = %d payloadlen = %d addrlen = %d", remote_ctx, remote_ctx->session_id, ctx->packet.rsv, ctx->packet.payloadlen, ctx->packet.addrlen);
-                    remote_ctx_t* ins_r = RB_INSERT(remote_map_tree, &ctx->remote_map, remote_ctx);
-                    if (ins_r) {
-                        LOGE("RB_INSERT error!");
-                        assert(0);
-                    }
-
-                    list_add_to_tail(&remote_ctx->send_queue, pkt_to_send);
-
-                    if (ctx->packet.atyp == 0x03) {
-                        uv_getaddrinfo_t* resolver = malloc(sizeof(uv_getaddrinfo_t));
-                        // have to resolve domain name first
-                        resolver->data = remote_ctx;
-                        int r = uv_getaddrinfo(loop, resolver, remote_addr_resolved_cb, remote_ctx->host, NULL, NULL);
-                    }
-                    else if (ctx->packet.atyp == 0x01) // do not have to resolve ipv4 address
-                    {
-                        // DNS resolve is not in use
-                        remote_ctx->resolved = 1;
-                        int r = try_to_connect_remote(remote_ctx);
-                        if (r)
-                            LOGW("Received packet with atyp 0x01");
-                    }
-                    else if (ctx->packet.atyp == 0x04) {
-                        // TODO: ipv6 temporarily unsupported
-                    }
-
-                    LOGW("server_read_cb:1 remote_ctx = %x session_id = %d type = %d", remote_ctx, remote_ctx->session_id, remote_ctx->handle.type);
-                }
-            }
-            else if (ctx->buf_len < ctx->packet.datalen + HDRLEN) {
-                if (verbose)
-                    LOGD("< datalen gather more");
-                ctx->expect_to_recv = HDRLEN + ctx->packet.datalen - ctx->buf_len;
-                return;
-            }
-            else {
-                LOGD("impossible! should never reach here (> datalen)");
-                assert(0);
-            }
+        slab->rpos += n;
+        return;
+    }
+
+    while (slab->wpos > slab->rpos) {
+        char* plain = NULL;
+        size_t plain_len = 0;
+        int n = crypto_open(ctx->crypto, slab->data + slab->rpos, slab->wpos - slab->rpos, &plain, &plain_len);
+        if (n < 0) {
+            LOGW("record from js-local does not authenticate, check method and password");
+            server_exception(ctx);
+            return;
         }
-        else {
-            LOGD("strange stage %d", ctx->stage);
-            assert(0);
+        if (n == 0)
+            break; // partial record
+        slab->rpos += n;
+        if (plain_len == 0)
+            continue;
+        int used = server_parse_frames(ctx, plain, plain_len);
+        if (uv_is_closing((uv_handle_t*)&ctx->handle))
+            return;
+        if (used != (int)plain_len) {
+            LOGW("record from js-local does not end on a frame boundary");
+            server_exception(ctx);
+            return;
         }
     }
-    LOGD("server_read_cb: ==============================end==============================");
 }
 
 int main(int argc, char** argv)
 {
     memset(&conf, 0, sizeof(conf_t));
+    conf.resume_timeout = RESUME_TIMEOUT_DEFAULT;
+    conf.keepalive = KEEPALIVE_DEFAULT;
+    conf.dns_ttl = DNS_TTL_DEFAULT;
+    conf.conn_pool_idle = CONNPOOL_IDLE_DEFAULT;
     int c, option_index = 0, daemon = 0;
     char* configfile = NULL;
     opterr = 0;
@@ -597,6 +1381,11 @@ int main(int argc, char** argv)
     }
 
     server_validate_conf(&conf);
+    if (conf.method != NULL) {
+        if (conf.password == NULL || crypto_setup(conf.method, conf.password))
+            FATAL("Unknown method or no password for the long connection");
+        LOGI("Long connections are encrypted with %s", conf.method);
+    }
 
 #ifndef XCODE_DEBUG
     if (daemon == 1) {
@@ -607,6 +1396,21 @@ int main(int argc, char** argv)
 
     loop = malloc(sizeof *loop);
     uv_loop_init(loop);
+    read_pools_init(&read_pools, HEADROOM, MAX_IDLE_BUFS);
+    buf_pool_init(&slice_pool, sizeof(pending_packet_t), MAX_IDLE_BUFS);
+    list_init(&servers);
+    list_init(&resume_groups);
+    dns_init(loop, conf.dns_ttl, conf.nameserver, conf.dns_snapshot);
+    connpool_init(loop, conf.conn_pool_size, conf.conn_pool_idle);
+    if (conf.backend_mode && conf.centralgw_address != NULL && conf.gatewayport) {
+        // every session of a backend mode js-local goes to the gateway
+        dns_addr_t gateway;
+        uint16_t gateway_port_n = htons(conf.gatewayport);
+        if (resolver_literal(conf.centralgw_address, &gateway))
+            connpool_pin(&gateway, (char*)&gateway_port_n);
+        else
+            LOGW("gateway_address %s is not an IP address, not pooled", conf.centralgw_address);
+    }
 
     char* serverlog = "/tmp/server.log";
     if (log_to_file)
@@ -1,9 +1,21 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 #include "tree.h"
+#include "buffer.h"
+#include "flowsched.h"
+#include "wire.h"
+#include "zframe.h"
+#include "replay.h"
+#include "ping.h"
+#include "dns.h"
+#include "connpool.h"
 
 #define BUF_SIZE 2048
 #define MAX_PKT_SIZE 8192
+#define RECV_SLAB_SIZE (128 * 1024) // room for at least one max-sized frame plus slack
+#define MIN_READ_SPACE (16 * 1024) // move on to a new slab below this tail space
+#define HEADROOM WIRE_HDR_MAX // room in front of destination reads for the frame header
+#define MAX_IDLE_BUFS 1024
 #define HDRLEN (ID_LEN + RSV_LEN + DATALEN_LEN)
 #define EXP_TO_RECV_LEN (ID_LEN + RSV_LEN + DATALEN_LEN)
 #define ID_LEN 4
@@ -17,7 +29,53 @@
 #define CTL_CLOSE 0x04
 #define CTL_INIT 0x01
 #define CTL_NORMAL 0
-#define CTL_CLOSE_ACK 0x03
+#define CTL_CLOSE_ACK 0x03 // no longer sent, js-local session ids carry a generation
+#define CTL_WINDOW_UPDATE 0x05
+#define CTL_HELLO 0x06
+#define CTL_CLOSE_BATCH 0x07 // see wire.h
+#define CTL_RESUME 0x08 // see HELLO_F_RESUME
+#define CTL_PING 0x09 // see ping.h
+#define CTL_PONG 0x0a
+
+// js-local opens every long connection with a hello on session 0 carrying
+// the protocol version, the largest frame payload it accepts, a feature
+// mask and the token of its pool connection (see local.h for the layout),
+// js-server answers with its own
+#define HELLO_SESSION 0
+#define HELLO_MIN_LEN 8 // version 1 stops after the frame size
+#define HELLO_V2_LEN 12 // ... version 2 after the feature mask
+#define HELLO_LEN 20
+#define PROTO_VERSION 3
+#define HELLO_F_COMPACT 0x01 // the sender parses compact headers (wire.h)
+#define HELLO_F_SWITCH 0x02 // the sender's frames after this hello are compact
+#define HELLO_F_DEFLATE 0x04 // the sender inflates compressed frames (zframe.h)
+#define HELLO_F_CLOSE_BATCH 0x08 // the sender takes CTL_CLOSE_BATCH frames
+#define HELLO_F_HALF_CLOSE 0x10 // the sender takes FIN flags (wire.h)
+#define HELLO_F_RESUME 0x20 // the sender keeps sessions across reconnects, when configured to
+#define HELLO_F_PING 0x40 // the sender answers CTL_PING
+#define HELLO_FEATURES (HELLO_F_COMPACT | HELLO_F_DEFLATE | HELLO_F_CLOSE_BATCH | HELLO_F_HALF_CLOSE | HELLO_F_PING)
+#define MAX_FRAME_PAYLOAD READ_SIZE_MAX
+#define LEGACY_FRAME_PAYLOAD BUF_SIZE // what peers without CTL_HELLO accept
+
+// per-session flow control, a peer may have at most SESSION_WINDOW payload
+// bytes of a session that were not written out by the other end yet
+#define SESSION_WINDOW (256 * 1024)
+#define WINDOW_UPDATE_THRESHOLD (SESSION_WINDOW / 4)
+#define WINDOW_LEN 4
+
+// the sessions of a long connection that broke wait conf.resume_timeout for
+// js-local to come back with the same token. Its CTL_RESUME for a session
+// carries the payload bytes it received and wrote, ours the same the other
+// way; each side resends the rest from its replay buffer. An empty one on
+// session 0 ends js-local's list
+#define RESUME_LEN 8
+#define RESUME_TIMEOUT_DEFAULT 0 // off unless configured, replay buffers copy every payload byte
+
+// backlog of a session (queued for or sitting in the destination's write
+// queue), see remote_update_backlog()
+#define BACKLOG_HIGH_WATERMARK (SESSION_WINDOW / 2)
+#define BACKLOG_LOW_WATERMARK (SESSION_WINDOW / 8)
+#define BACKLOG_HARD_LIMIT (SESSION_WINDOW + 65536)
 
 #define packet_payload_alloc(packet, flag)                                                           \
     do {                                                                                             \
@@ -28,15 +86,6 @@
         packet.data = calloc(1, packet.payloadlen);                                                  \
     } while (0)
 
-//FIXME: memset the whole packet structure is unneccessary! just reset offset
-#define packetnbuf_reset(ctx)                      \
-    do {                                           \
-        ctx->buf_len = 0;                          \
-        ctx->stage = 0;                            \
-        memset(&ctx->packet, 0, sizeof(packet_t)); \
-        ctx->reset = 1;                            \
-    } while (0)
-
 // debug
 #define SHOWPKTDEBUG(remote_ctx) LOGD("session_id=%d, rsv=%d, datalen=%d, atyp=%d, addrlen=%d, host=%s, port=%d, data=\n%s", remote_ctx->packet->session_id, remote_ctx->packet->rsv, remote_ctx->packet->datalen, remote_ctx->packet->atyp, remote_ctx->packet->addrlen, remote_ctx->packet->host, ntohs(*(uint16_t*)remote_ctx->packet->port), remote_ctx->packet->data)
 
@@ -55,6 +104,7 @@ int compare_id(void* left, void* right)
 typedef struct packet {
     uint32_t session_id;
     uint8_t rsv;
+    uint8_t flags;
     uint16_t datalen;
     uint16_t payloadlen;
     uint8_t atyp;
@@ -62,14 +112,18 @@ typedef struct packet {
     char host[257];
     char port[2];
     char* data;
+    int hdrlen;
     int offset;
     struct packet* prev;
     struct packet* next;
 } packet_t;
 
+// a payload slice of a receive slab waiting to be written to the destination,
+// the write request is embedded so a slice needs no allocation of its own
 typedef struct pending_packet {
-    char* data;
-    uint16_t payloadlen;
+    uv_write_t req;
+    uv_buf_t buf;
+    slab_t* slab;
     struct pending_packet* prev;
     struct pending_packet* next;
 } pending_packet_t;
@@ -89,19 +143,74 @@ typedef struct listener {
 
 RB_HEAD(remote_map_tree, remote_ctx);
 
-typedef struct {
+typedef struct server_ctx {
     TCP_HANDLE_BASIC
     struct remote_map_tree remote_map;
     packet_t packet;
-    queue_t send_queue;
-    char packet_buf[MAX_PKT_SIZE];
-    char recv_buffer[MAX_PKT_SIZE];
-    int buf_len;
-    int reset;
-    int stage;
-    int expect_to_recv;
+    scheduler_t sched;
+    uv_prepare_t* flush_handle;
+    slab_t* recv_slab;
+    size_t max_frame; // largest frame payload js-local accepts
+    int hello_sent;
+    int compact_tx; // frames we send use the compact header
+    int compact_rx; // ... and the ones we receive
+    int peer_inflates; // js-local takes compressed frames
+    dest_t addr_table[ADDR_TABLE_SIZE]; // destinations js-local defined by index
+    crypto_t* crypto; // NULL when the long connection is not encrypted
+    int peer_close_batch; // js-local takes CTL_CLOSE_BATCH
+    int peer_half_close; // js-local takes FIN flags
+    uint32_t close_ids[WIRE_CLOSE_BATCH_MAX]; // closes leaving with the next flush
+    int close_count;
+    uint64_t token; // js-local's pool connection, 0 before its hello
+    int peer_resume; // js-local keeps sessions across reconnects
+    int peer_pings; // js-local answers CTL_PING
+    ping_stats_t ping; // round trip times of this connection
+    uv_timer_t* ping_timer;
+    struct server_ctx* prev;
+    struct server_ctx* next;
 } server_ctx_t;
 
+typedef struct server_list {
+    server_ctx_t head;
+} server_list_t;
+
+// the sessions of a broken long connection, see server_orphan_sessions()
+typedef struct resume_group {
+    uint64_t token;
+    struct remote_map_tree remote_map;
+    uv_timer_t* timer;
+    struct resume_group* prev;
+    struct resume_group* next;
+} resume_group_t;
+
+typedef struct resume_group_list {
+    resume_group_t head;
+} resume_group_list_t;
+
+// a destination with several addresses is dialed as in RFC 8305: one
+// attempt at a time, alternating between IPv6 and IPv4, the next one
+// started when the last fails or after CONNECT_ATTEMPT_DELAY. The first
+// to connect hands its socket over to the session, the others are closed
+#define CONNECT_ATTEMPT_DELAY 250
+
+typedef struct connect_attempt {
+    uv_tcp_t handle;
+    uv_connect_t req;
+    struct connect_race* race;
+    int index; // in race->addrs
+} connect_attempt_t;
+
+typedef struct connect_race {
+    struct remote_ctx* remote_ctx; // NULL once the race is over
+    dns_addr_t addrs[DNS_MAX_ADDRS]; // in the order they are tried
+    int count;
+    int next; // the address tried next
+    int pending; // attempts still connecting
+    int handles; // open handles, the race is freed once they are closed
+    uv_timer_t timer;
+    connect_attempt_t attempts[DNS_MAX_ADDRS];
+} connect_race_t;
+
 typedef struct remote_ctx {
     TCP_HANDLE_BASIC
     RB_ENTRY(remote_ctx) rb_link;
@@ -109,12 +218,34 @@ typedef struct remote_ctx {
     server_ctx_t* server_ctx;
     char host[257];
     char port[2];
+    dns_addr_t addr; // what host resolved to, the destination is dialed there
+    int named; // host is a name, whether it could be connected goes to the cache
+    connect_race_t* race; // while its addresses race to connect
     queue_t send_queue;
+    uint32_t tx_bytes; // payload bytes sent to js-local
+    uint32_t tx_acked; // ... of which js-local reported written
+    uint32_t rx_bytes; // payload bytes written to the destination
+    uint32_t rx_reported; // ... as last reported in a window update
+    uint32_t rx_seq; // payload bytes received from js-local
+    replay_t replay; // sent payload js-local has not written yet
+    int suspended; // its long connection broke, waiting for CTL_RESUME
+    struct resume_group* group; // ... and it is kept here meanwhile
+    int read_paused;
+    int read_class; // size class of the next destination read
+    zframe_t* z; // compression state, once the session compressed anything
+    size_t queued_bytes; // payload bytes in send_queue
+    int backlogged;
+    sched_flow_t* flow; // frames queued on server_ctx
     int resolved;
+    dns_waiter_t* lookup; // while its destination name is being resolved
     int connected;
     char addrlen;
     int stage;
     int closing;
+    int fin_tx; // the destination sent EOF, our FIN is queued
+    int fin_rx; // js-local's FIN arrived
+    int shutting; // ... the destination's write side is being shut down
+    int shut; // ... and the shutdown completed
     int ctl_cmd;
     uv_timer_t* http_timeout;
 } remote_ctx_t;
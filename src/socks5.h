@@ -29,11 +29,17 @@
 #define ATYP_OK 0x01
 #define ATYP_IPV4 0x01
 #define ATYP_DOMAIN 0x03
+#define ATYP_IPV6 0x04
 #define IPV6 0x04
 #define CMD_NOT_SUPPORTED 0x07
+#define ATYP_NOT_SUPPORTED 0x08
+#define METHOD_NOAUTH 0x00
+#define METHOD_UNACCEPTABLE 0xff
 #define HEXZERO 0x00
 #define SOCKS5_FISRT_REQ_SIZE 3
 #define SOCKS5_FISRT_RESP_SIZE 2
+#define SOCKS5_REQ_HDR_LEN 4 // VER CMD RSV ATYP
+#define SOCKS5_HS_MAX (SOCKS5_REQ_HDR_LEN + 1 + 255 + 2) // longest handshake message, a CONNECT to a domain
 
 #pragma pack(1)
 
@@ -304,6 +304,9 @@ extern FILE* logfile;
 #define list_get_head_elem(list) \
     (((list)->head.next == &(list)->head) ? NULL : (list)->head.next)
 
+#define list_get_tail_elem(list) \
+    (((list)->head.prev == &(list)->head) ? NULL : (list)->head.prev)
+
 #define list_remove_elem(elem)             \
     do {                                   \
         (elem)->prev->next = (elem)->next; \
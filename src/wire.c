@@ -0,0 +1,126 @@
+//
+//  wire.c
+//  jedisocks
+//
+//  Frame header encodings of the long connection, shared by js-local and
+//  js-server.
+//
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "wire.h"
+
+static int varint_len(uint32_t v)
+{
+    int n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static int varint_write(char* dst, uint32_t v)
+{
+    int n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (char)v;
+    return n;
+}
+
+// returns the bytes used, 0 if src ends before the varint does, -1 if it
+// runs past max_len bytes
+static int varint_read(const char* src, size_t avail, int max_len, uint32_t* v)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < max_len; i++) {
+        if ((size_t)i >= avail)
+            return 0;
+        uint8_t byte = (uint8_t)src[i];
+        value |= (uint32_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            *v = value;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int wire_hdr_len(int compact, uint32_t session_id, uint32_t len)
+{
+    if (!compact)
+        return WIRE_LEGACY_HDR_LEN;
+    return 1 + varint_len(session_id) + varint_len(len);
+}
+
+// returns the header length
+int wire_hdr_write(char* dst, int compact, uint32_t session_id, uint8_t type, uint8_t flags, uint32_t len)
+{
+    if (!compact) {
+        uint32_t id = htonl(session_id);
+        uint16_t datalen = htons((uint16_t)len);
+        memcpy(dst, &id, 4);
+        dst[4] = (char)(type | flags);
+        memcpy(dst + 5, &datalen, 2);
+        return WIRE_LEGACY_HDR_LEN;
+    }
+    int n = 0;
+    dst[n++] = (char)((type & WIRE_TYPE_MASK) | (flags & WIRE_FLAG_MASK));
+    n += varint_write(dst + n, session_id);
+    n += varint_write(dst + n, len);
+    return n;
+}
+
+// returns the header length, 0 if avail bytes do not hold a complete
+// header yet and -1 for a header no peer could have sent
+int wire_hdr_parse(const char* src, size_t avail, int compact, wire_hdr_t* hdr)
+{
+    if (!compact) {
+        if (avail < WIRE_LEGACY_HDR_LEN)
+            return 0;
+        uint32_t id;
+        uint16_t datalen;
+        memcpy(&id, src, 4);
+        memcpy(&datalen, src + 5, 2);
+        hdr->session_id = ntohl(id);
+        hdr->type = (uint8_t)src[4];
+        hdr->flags = 0;
+        hdr->len = ntohs(datalen);
+        return WIRE_LEGACY_HDR_LEN;
+    }
+    if (avail < 1)
+        return 0;
+    int n = 1;
+    hdr->type = (uint8_t)src[0] & WIRE_TYPE_MASK;
+    hdr->flags = (uint8_t)src[0] & WIRE_FLAG_MASK;
+    int r = varint_read(src + n, avail - n, 5, &hdr->session_id);
+    if (r <= 0)
+        return r;
+    n += r;
+    r = varint_read(src + n, avail - n, 3, &hdr->len);
+    if (r <= 0)
+        return r;
+    if (hdr->len > 0xffff)
+        return -1;
+    return n + r;
+}
+
+// returns the payload length, at most count * WIRE_VARINT_MAX
+int wire_close_batch_write(char* dst, const uint32_t* ids, int count)
+{
+    int n = 0;
+    for (int i = 0; i < count; i++)
+        n += varint_write(dst + n, ids[i]);
+    return n;
+}
+
+// returns the bytes of the next id in a CTL_CLOSE_BATCH payload, -1 if the
+// payload is cut short or malformed
+int wire_close_batch_next(const char* src, size_t avail, uint32_t* id)
+{
+    int n = varint_read(src, avail, WIRE_VARINT_MAX, id);
+    return n > 0 ? n : -1;
+}
@@ -0,0 +1,62 @@
+//
+//  wire.h
+//  jedisocks
+//
+//  Frame header encodings of the long connection, shared by js-local and
+//  js-server.
+//
+//  legacy:  [session id, 4 bytes][type, 1 byte][length, 2 bytes]
+//  compact: [flags << 4 | type, 1 byte][session id, varint][length, varint]
+//
+//  Varints are little endian base 128. The compact form is only used once
+//  both ends agreed on it in their hellos.
+//
+
+#ifndef jedisocks_wire_h
+#define jedisocks_wire_h
+#include <stddef.h>
+#include <stdint.h>
+
+#define WIRE_LEGACY_HDR_LEN 7
+#define WIRE_HDR_MAX 9 // compact: type, 5-byte id, 3-byte length
+#define WIRE_TYPE_MASK 0x0f
+#define WIRE_FLAG_MASK 0xf0
+
+// a compact CTL_INIT names its destination by an index into a per
+// connection table; with this flag the full address follows the index and
+// (re)defines that entry
+#define WIRE_FLAG_ADDR_DEFINE 0x10
+
+// on a compact CTL_INIT or CTL_NORMAL frame: the sender's side of the
+// session is done, the receiver shuts down the write side of its socket once
+// the payload (if any) is written
+#define WIRE_FLAG_FIN 0x80
+#define ADDR_TABLE_SIZE 64
+#define ADDR_INDEX_LEN 1
+
+// a CTL_CLOSE_BATCH frame closes every session whose id is in its payload,
+// one varint each
+#define WIRE_CLOSE_BATCH_MAX 256 // ids per frame
+#define WIRE_VARINT_MAX 5
+
+typedef struct wire_hdr {
+    uint32_t session_id;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t len;
+} wire_hdr_t;
+
+// a destination as carried by CTL_INIT
+typedef struct dest {
+    uint8_t atyp;
+    uint8_t addrlen;
+    char host[256];
+    char port[2];
+} dest_t;
+
+extern int wire_hdr_len(int compact, uint32_t session_id, uint32_t len);
+extern int wire_hdr_write(char* dst, int compact, uint32_t session_id, uint8_t type, uint8_t flags, uint32_t len);
+extern int wire_hdr_parse(const char* src, size_t avail, int compact, wire_hdr_t* hdr);
+extern int wire_close_batch_write(char* dst, const uint32_t* ids, int count);
+extern int wire_close_batch_next(const char* src, size_t avail, uint32_t* id);
+#endif
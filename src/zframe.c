@@ -0,0 +1,136 @@
+//
+//  zframe.c
+//  jedisocks
+//
+//  Per-session payload compression on the long connection.
+//
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "utils.h"
+#include "buffer.h"
+#include "zframe.h"
+
+// every frame ends in a sync flush, whose empty stored block is left off
+// the wire and put back in front of the inflater
+static const char sync_trailer[4] = { 0x00, 0x00, (char)0xff, (char)0xff };
+static char inflate_buf[READ_SIZE_MAX + 1];
+
+static zframe_t* zframe_get(zframe_t** z)
+{
+    if (*z == NULL) {
+        *z = calloc(1, sizeof(zframe_t));
+        if (*z == NULL)
+            FATAL("Not enough memory");
+        (*z)->backoff = 1;
+    }
+    return *z;
+}
+
+// order-2 (collision) entropy of a sample of the payload: compressed or
+// encrypted data is close to 8 bits per byte, text and markup far below.
+// Below 6 bits, i.e. when two sampled bytes are equal more often than one
+// time in 64, deflate is expected to pay off
+static int low_entropy(const char* data, size_t len)
+{
+    int count[256] = { 0 };
+    size_t n = len < ZFRAME_SAMPLE ? len : ZFRAME_SAMPLE;
+    size_t stride = len / n;
+    for (size_t i = 0; i < n; i++)
+        count[(uint8_t)data[i * stride]]++;
+    uint64_t sum = 0;
+    for (int i = 0; i < 256; i++)
+        sum += (uint64_t)count[i] * count[i];
+    return sum * 64 > (uint64_t)n * n;
+}
+
+// whether to run this payload through the session's deflate stream
+int zframe_worth(zframe_t** z, const char* data, size_t len)
+{
+    if (len < ZFRAME_MIN_LEN)
+        return 0;
+    if (*z != NULL && (*z)->skip > 0) {
+        (*z)->skip--;
+        return 0;
+    }
+    if (!low_entropy(data, len))
+        return 0;
+    zframe_get(z);
+    return 1;
+}
+
+// compress src into dst, returns the compressed length. When the result
+// does not fit into cap the stream is restarted and -1 returned; the payload
+// then has to go out as it is, flagged WIRE_FLAG_ZRESET
+int zframe_deflate(zframe_t* z, int level, const char* src, size_t len, char* dst, size_t cap)
+{
+    if (!z->tx_ready) {
+        if (deflateInit2(&z->tx, level, Z_DEFLATED, -ZFRAME_WINDOW_BITS, ZFRAME_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        z->tx_ready = 1;
+    }
+    z->tx.next_in = (Bytef*)src;
+    z->tx.avail_in = (uInt)len;
+    z->tx.next_out = (Bytef*)dst;
+    z->tx.avail_out = (uInt)cap;
+    int r = deflate(&z->tx, Z_SYNC_FLUSH);
+    if (r != Z_OK || z->tx.avail_in != 0 || z->tx.avail_out == 0) {
+        deflateReset(&z->tx);
+        return -1;
+    }
+    size_t out = cap - z->tx.avail_out - sizeof(sync_trailer);
+
+    // saving less than an eighth is not worth the cycles, back off for a
+    // growing number of frames before trying again
+    if (out * 8 > len * 7) {
+        z->skip = z->backoff;
+        z->backoff = z->backoff * 2 > ZFRAME_MAX_BACKOFF ? ZFRAME_MAX_BACKOFF : z->backoff * 2;
+    }
+    else
+        z->backoff = 1;
+    return (int)out;
+}
+
+// inflate a compressed frame, *out points to a buffer that is only valid
+// until the next call. Returns the length or -1 for a corrupt stream
+int zframe_inflate(zframe_t** z, const char* src, size_t len, char** out)
+{
+    zframe_t* zf = zframe_get(z);
+    if (!zf->rx_ready) {
+        if (inflateInit2(&zf->rx, -15) != Z_OK)
+            return -1;
+        zf->rx_ready = 1;
+    }
+    zf->rx.next_out = (Bytef*)inflate_buf;
+    zf->rx.avail_out = sizeof(inflate_buf);
+    zf->rx.next_in = (Bytef*)src;
+    zf->rx.avail_in = (uInt)len;
+    int r = inflate(&zf->rx, Z_SYNC_FLUSH);
+    if ((r != Z_OK && r != Z_BUF_ERROR) || zf->rx.avail_in != 0)
+        return -1;
+    zf->rx.next_in = (Bytef*)sync_trailer;
+    zf->rx.avail_in = sizeof(sync_trailer);
+    r = inflate(&zf->rx, Z_SYNC_FLUSH);
+    if ((r != Z_OK && r != Z_BUF_ERROR) || zf->rx.avail_in != 0 || zf->rx.avail_out == 0)
+        return -1;
+    *out = inflate_buf;
+    return (int)(sizeof(inflate_buf) - zf->rx.avail_out);
+}
+
+void zframe_reset_rx(zframe_t* z)
+{
+    if (z != NULL && z->rx_ready)
+        inflateReset(&z->rx);
+}
+
+void zframe_free(zframe_t* z)
+{
+    if (z == NULL)
+        return;
+    if (z->tx_ready)
+        deflateEnd(&z->tx);
+    if (z->rx_ready)
+        inflateEnd(&z->rx);
+    free(z);
+}
@@ -0,0 +1,39 @@
+//
+//  zframe.h
+//  jedisocks
+//
+//  Per-session payload compression on the long connection: one raw deflate
+//  stream per direction, flushed at every frame so each compressed frame
+//  can be written out as soon as it is inflated.
+//
+
+#ifndef jedisocks_zframe_h
+#define jedisocks_zframe_h
+#include <stddef.h>
+#include <zlib.h>
+
+// frame flags of compact CTL_NORMAL frames
+#define WIRE_FLAG_COMPRESSED 0x40 // payload is the session's deflate stream
+#define WIRE_FLAG_ZRESET 0x20 // the sender restarted its deflate stream
+
+#define ZFRAME_MIN_LEN 128 // smaller payloads are sent as they are
+#define ZFRAME_SAMPLE 512 // bytes looked at to estimate the entropy
+#define ZFRAME_WINDOW_BITS 13 // deflate history, inflate always takes 15
+#define ZFRAME_MEM_LEVEL 5
+#define ZFRAME_MAX_BACKOFF 64 // frames skipped after a poor ratio, at most
+
+typedef struct zframe {
+    z_stream tx;
+    z_stream rx;
+    int tx_ready;
+    int rx_ready;
+    int skip; // frames to send uncompressed before trying again
+    int backoff; // ... the next time compression does not pay off
+} zframe_t;
+
+extern int zframe_worth(zframe_t** z, const char* data, size_t len);
+extern int zframe_deflate(zframe_t* z, int level, const char* src, size_t len, char* dst, size_t cap);
+extern int zframe_inflate(zframe_t** z, const char* src, size_t len, char** out);
+extern void zframe_reset_rx(zframe_t* z);
+extern void zframe_free(zframe_t* z);
+#endif